@@ -1,86 +1,149 @@
-(* Compression algorithm is slightly simplified version of
-   external/memtrace/backtrace_codec.ml
-   (callstacks and backtraces are essentially the same) *)
+(* Callstacks are stored in a trie of their frames, oldest first, so every distinct
+   callstack prefix is a node with its own id. A callstack is then written as the id of
+   its node, along with whichever symbols and nodes were created to reach it. *)
 
 open Core
 
+module Edge = struct
+  type t =
+    { parent : int
+    ; symbol : int
+    }
+  [@@deriving compare, hash, sexp_of]
+end
+
 type t =
-  { symbol_to_id : (Symbol.t, int) Hashtbl.t
-  ; id_to_symbol : (int, Symbol.t) Hashtbl.t
+  { (* Compression *)
+    symbol_ids : (Symbol.t, int) Hashtbl.t
   ; mutable next_symbol_id : int
-  ; follow_table : (int, int) Hashtbl.t
+  ; children : (Edge.t, int) Hashtbl.t
+  ; mutable next_node_id : int
+  ; (* The last callstack compressed and the node for each of its frames, so that the
+       frames it shares with the next one needn't be looked up again. Both are reused
+       from one callstack to the next and only grow; the first [last_depth] are valid. *)
+    mutable last_callstack : Symbol.t array
+  ; mutable last_nodes : int array
+  ; mutable last_depth : int
+  ; (* Decompression, indexed by symbol and node id *)
+    symbols : Symbol.t Queue.t
+  ; parents : int Queue.t
+  ; node_symbols : int Queue.t
+  ; depths : int Queue.t
   }
 
+(* The node for the empty callstack. *)
+let root = 0
+
 let init () =
-  { symbol_to_id = Hashtbl.create (module Symbol)
-  ; id_to_symbol = Hashtbl.create (module Int)
+  { symbol_ids = Hashtbl.create (module Symbol)
   ; next_symbol_id = 0
-  ; follow_table = Hashtbl.create (module Int)
+  ; children = Hashtbl.create (module Edge)
+  ; next_node_id = root + 1
+  ; last_callstack = [||]
+  ; last_nodes = [||]
+  ; last_depth = 0
+  ; symbols = Queue.create ()
+  ; parents = Queue.singleton (-1)
+  ; node_symbols = Queue.singleton (-1)
+  ; depths = Queue.singleton 0
   }
 ;;
 
 type compression_event =
-  { new_symbols : (Symbol.t * int) list
-  ; callstack : (int * int) list
+  { new_symbols : Symbol.t array
+  ; new_nodes : (int * int) array
+  ; callstack : int
   }
 [@@deriving sexp, bin_io]
 
-let update_follow_table t stack =
-  (let%bind.Option suffix = List.tl stack in
-   let%map.Option prefix = List.drop_last stack in
-   List.iter2_exn prefix suffix ~f:(fun prev next ->
-     Hashtbl.set t.follow_table ~key:prev ~data:next))
-  |> Option.value ~default:()
+let same_symbol a b = phys_equal a b || Symbol.equal a b
+
+let symbol_id t symbol ~new_symbols =
+  match Hashtbl.find t.symbol_ids symbol with
+  | Some id -> id
+  | None ->
+    let id = t.next_symbol_id in
+    Hashtbl.add_exn t.symbol_ids ~key:symbol ~data:id;
+    t.next_symbol_id <- id + 1;
+    new_symbols := symbol :: !new_symbols;
+    id
 ;;
 
-let compress_with_follow_table t stack =
-  let compressed_stack =
-    List.fold stack ~init:[] ~f:(fun acc x ->
-      match acc with
-      | [] -> [ x, x, 0 ]
-      | (from_s, to_s, steps) :: tl ->
-        let pred_next = Hashtbl.find t.follow_table to_s in
-        (match pred_next with
-         | Some a when a = x -> (from_s, x, steps + 1) :: tl
-         | _ -> (x, x, 0) :: acc))
-    |> List.rev
-  in
-  List.map compressed_stack ~f:(fun (from_s, _, steps) -> from_s, steps)
+let child t ~parent ~symbol ~new_nodes =
+  let edge = { Edge.parent; symbol } in
+  match Hashtbl.find t.children edge with
+  | Some node -> node
+  | None ->
+    let node = t.next_node_id in
+    Hashtbl.add_exn t.children ~key:edge ~data:node;
+    t.next_node_id <- node + 1;
+    new_nodes := (parent, symbol) :: !new_nodes;
+    node
 ;;
 
-let rec follow_symbol_steps t symbol = function
-  | 0 -> []
-  | steps ->
-    let next_symbol = Hashtbl.find_exn t.follow_table symbol in
-    next_symbol :: follow_symbol_steps t next_symbol (steps - 1)
+let ensure_capacity t ~depth =
+  let capacity = Array.length t.last_nodes in
+  if depth > capacity
+  then (
+    let len = Int.max depth (2 * capacity) in
+    let last_callstack = Array.create ~len Symbol.Unknown in
+    let last_nodes = Array.create ~len root in
+    Array.blit
+      ~src:t.last_callstack
+      ~src_pos:0
+      ~dst:last_callstack
+      ~dst_pos:0
+      ~len:capacity;
+    Array.blit ~src:t.last_nodes ~src_pos:0 ~dst:last_nodes ~dst_pos:0 ~len:capacity;
+    t.last_callstack <- last_callstack;
+    t.last_nodes <- last_nodes)
 ;;
 
-let decompress_with_follow_table t comp_stack =
-  List.concat_map comp_stack ~f:(fun (from_s, steps) ->
-    from_s :: follow_symbol_steps t from_s steps)
+let compress_frames t ~depth ~symbol_at =
+  ensure_capacity t ~depth;
+  let max_shared = Int.min depth t.last_depth in
+  let shared = ref 0 in
+  while
+    !shared < max_shared && same_symbol (symbol_at !shared) t.last_callstack.(!shared)
+  do
+    incr shared
+  done;
+  let new_symbols = ref [] in
+  let new_nodes = ref [] in
+  for i = !shared to depth - 1 do
+    let frame = symbol_at i in
+    let symbol = symbol_id t frame ~new_symbols in
+    let parent = if i = 0 then root else t.last_nodes.(i - 1) in
+    t.last_callstack.(i) <- frame;
+    t.last_nodes.(i) <- child t ~parent ~symbol ~new_nodes
+  done;
+  t.last_depth <- depth;
+  { new_symbols = Array.of_list_rev !new_symbols
+  ; new_nodes = Array.of_list_rev !new_nodes
+  ; callstack = (if depth = 0 then root else t.last_nodes.(depth - 1))
+  }
 ;;
 
 let compress_callstack t callstack =
-  let symbols = callstack in
-  let new_symbol_events =
-    List.filter_map symbols ~f:(fun s ->
-      match Hashtbl.mem t.symbol_to_id s with
-      | true -> None
-      | false ->
-        Hashtbl.add_exn t.symbol_to_id ~key:s ~data:t.next_symbol_id;
-        t.next_symbol_id <- t.next_symbol_id + 1;
-        Some (s, t.next_symbol_id - 1))
-  in
-  let symbol_ids = List.map symbols ~f:(fun s -> Hashtbl.find_exn t.symbol_to_id s) in
-  let compressed_stack = compress_with_follow_table t symbol_ids in
-  update_follow_table t symbol_ids;
-  { new_symbols = new_symbol_events; callstack = compressed_stack }
+  compress_frames t ~depth:(Array.length callstack) ~symbol_at:(Array.get callstack)
 ;;
 
-let decompress_callstack t { new_symbols; callstack } =
-  List.iter new_symbols ~f:(fun (symbol, id) ->
-    Hashtbl.set t.id_to_symbol ~key:id ~data:symbol);
-  let symbol_ids = decompress_with_follow_table t callstack in
-  update_follow_table t symbol_ids;
-  List.map symbol_ids ~f:(fun s -> Hashtbl.find_exn t.id_to_symbol s)
+let decompress_callstack t { new_symbols; new_nodes; callstack } =
+  Array.iter new_symbols ~f:(Queue.enqueue t.symbols);
+  Array.iter new_nodes ~f:(fun (parent, symbol) ->
+    Queue.enqueue t.parents parent;
+    Queue.enqueue t.node_symbols symbol;
+    Queue.enqueue t.depths (Queue.get t.depths parent + 1));
+  let depth = Queue.get t.depths callstack in
+  if depth = 0
+  then [||]
+  else (
+    let symbol node = Queue.get t.symbols (Queue.get t.node_symbols node) in
+    let result = Array.create ~len:depth (symbol callstack) in
+    let node = ref callstack in
+    for i = depth - 1 downto 0 do
+      result.(i) <- symbol !node;
+      node := Queue.get t.parents !node
+    done;
+    result)
 ;;
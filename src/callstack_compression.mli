@@ -1,33 +1,38 @@
 open Core
 
-type t =
-  { symbol_to_id : (Symbol.t, int) Hashtbl.t
-  ; id_to_symbol : (int, Symbol.t) Hashtbl.t
-  ; mutable next_symbol_id : int
-  ; follow_table : (int, int) Hashtbl.t
-  }
+type t
 
 (* Initialise a compression state *)
 val init : unit -> t
 
+(* Every distinct callstack prefix is a node in a trie, numbered from 1 in order of
+   creation; 0 is the empty callstack. Symbols are likewise numbered from 0, so a
+   compression event only needs to list the symbols and nodes it creates, in order. Each
+   new node is given as its parent node and its symbol. *)
 type compression_event =
-  { new_symbols : (Symbol.t * int) list
-  ; callstack : (int * int) list
+  { new_symbols : Symbol.t array
+  ; new_nodes : (int * int) array
+  ; callstack : int
   }
 [@@deriving sexp, bin_io]
 
-(* Compress a callstack represented as a list of symbol, and update the compression
-   state inplace.
+(* Compress a callstack represented as an array of symbols, oldest frame first, and
+   update the compression state inplace.
 
    When compressing a sequence of many callstacks, this function should be called
    in order on all callstacks with the same compression state.
 *)
-val compress_callstack : t -> Symbol.t list -> compression_event
+val compress_callstack : t -> Symbol.t array -> compression_event
+
+(* Like [compress_callstack], for a callstack of [depth] frames whose [i]th frame, oldest
+   first, is [symbol_at i]. This saves building an array of the callstack for each event;
+   frames shared with the previous callstack are only compared, not looked up. *)
+val compress_frames : t -> depth:int -> symbol_at:(int -> Symbol.t) -> compression_event
 
-(* Decompress a callstack represented as a compression_event, and update the compression
-   state inplace.
+(* Decompress a callstack represented as a compression_event into an array of symbols,
+   oldest frame first, and update the compression state inplace.
 
    When decompressing a sequence of many callstacks, this function should be called
    in order on all compression events with the same compression state.
 *)
-val decompress_callstack : t -> compression_event -> Symbol.t list
+val decompress_callstack : t -> compression_event -> Symbol.t array
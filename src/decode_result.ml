@@ -5,3 +5,5 @@ type t =
   { events : Event.t Pipe.Reader.t list
   ; close_result : unit Or_error.t Deferred.t
   }
+
+let max_batch_size = 4096
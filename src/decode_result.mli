@@ -9,3 +9,8 @@ type t =
   { events : Event.t Pipe.Reader.t list
   ; close_result : unit Or_error.t Deferred.t
   }
+
+(* Stages between decoding and trace writing move events in batches of at most this many
+   (with [Pipe.map'] / [Pipe.iter']) rather than one at a time, so Async's per-element
+   pipe and scheduler overhead is paid once per batch. *)
+val max_batch_size : int
@@ -50,6 +50,10 @@ let no_ocaml_exception_debug_info =
   Option.is_some (Unix.getenv "MAGIC_TRACE_NO_OCAML_EXCEPTION_DEBUG_INFO")
 ;;
 
+(* Write uncompressed traces through a memory mapping of the output file rather than with
+   [write] calls. Avoids copying the trace, but may be slower on network filesystems. *)
+let mmap_output = Option.is_some (Unix.getenv "MAGIC_TRACE_MMAP_OUTPUT")
+
 (* Skip any special case transaction handling, intended for debugging tx/tx_abrt. *)
 let skip_transaction_handling =
   Option.is_some (Unix.getenv "MAGIC_TRACE_SKIP_TX_HANDLING")
@@ -11,4 +11,5 @@ val share_command_filename : string option
 val no_dlfilter : bool
 val fzf_demangle_symbols : bool
 val no_ocaml_exception_debug_info : bool
+val mmap_output : bool
 val skip_transaction_handling : bool
@@ -24,7 +24,7 @@ let range_hit_times ~decode_events ~range_symbols =
     let { Trace_filter.start_symbol; stop_symbol } = range_symbols in
     let is_start symbol = String.(Symbol.display_name symbol = start_symbol) in
     let is_stop symbol = String.(Symbol.display_name symbol = stop_symbol) in
-    Pipe.filter_map events ~f:(function
+    let symbol_hit : Event.t -> Symbol_hit.t option = function
       | Error _ | Ok { data = Power _; _ } | Ok { data = Event_sample _; _ } -> None
       | Ok { data = Trace trace; time; _ } ->
         (match trace.kind with
@@ -44,7 +44,10 @@ let range_hit_times ~decode_events ~range_symbols =
             Some { Symbol_hit.kind = Start; symbol; time }
           | None, { symbol; _ } when is_stop symbol ->
             Some { Symbol_hit.kind = Stop; symbol; time }
-          | acc, _ -> acc))
+          | acc, _ -> acc)
+    in
+    Pipe.map' events ~max_queue_length:Decode_result.max_batch_size ~f:(fun batch ->
+      Queue.filter_map batch ~f:symbol_hit |> Deferred.return)
     |> Pipe.to_list)
   |> Deferred.map ~f:Or_error.return
 ;;
@@ -64,6 +67,25 @@ let remove_unmatched_hits (hits : Symbol_hit.t list) =
   remove_unmatched_hits' ~accum:[] hits |> List.rev
 ;;
 
+(* Consumes the next hit in [hits] if [event] is that hit, toggling whether we're in the
+   filtered region. *)
+let advance_through_hits (hits, in_filtered_region) (event : Event.t) =
+  match hits with
+  | [] -> hits, in_filtered_region
+  | (hd : Symbol_hit.t) :: tl ->
+    (match event with
+     | Ok { data = Trace { kind = Some Call; dst; _ }; time; _ }
+       when Time_ns_unix.Span.(time = hd.time) && Symbol.equal dst.symbol hd.symbol ->
+       tl, not in_filtered_region
+     | Ok { data = Stacktrace_sample _; time; _ } when Time_ns_unix.Span.(time = hd.time)
+       -> tl, not in_filtered_region
+     | Ok { data = Trace _; _ }
+     | Ok { data = Power _; _ }
+     | Ok { data = Stacktrace_sample _; _ }
+     | Ok { data = Event_sample _; _ }
+     | Error _ -> hits, in_filtered_region)
+;;
+
 (* Calls provided [decode_event] and marks events if they should be written (are
    in-between a start and stop symbol). If there are multiple calls to
    [range_start_symbol] at the same time, they will all be marked [should_write = true]. *)
@@ -75,28 +97,13 @@ let decode_events_and_annotate ~decode_events ~range_symbols =
   let events =
     List.zip_exn events hit_sequences
     |> List.map ~f:(fun (events, hit_sequence) ->
-      Pipe.folding_map
-        events
-        ~init:(hit_sequence, false)
-        ~f:(fun (hits, in_filtered_region) event ->
-          let hits, in_filtered_region =
-            match hits with
-            | [] -> hits, in_filtered_region
-            | hd :: tl ->
-              (match event with
-               | Ok { data = Trace { kind = Some Call; dst; _ }; time; _ }
-                 when Time_ns_unix.Span.(time = hd.time)
-                      && Symbol.equal dst.symbol hd.symbol -> tl, not in_filtered_region
-               | Ok { data = Stacktrace_sample _; time; _ }
-                 when Time_ns_unix.Span.(time = hd.time) -> tl, not in_filtered_region
-               | Ok { data = Trace _; _ }
-               | Ok { data = Power _; _ }
-               | Ok { data = Stacktrace_sample _; _ }
-               | Ok { data = Event_sample _; _ }
-               | Error _ -> hits, in_filtered_region)
-          in
-          ( (hits, in_filtered_region)
-          , Event.With_write_info.create ~should_write:in_filtered_region event )))
+      let state = ref (hit_sequence, false) in
+      Pipe.map' events ~max_queue_length:Decode_result.max_batch_size ~f:(fun batch ->
+        Queue.map batch ~f:(fun event ->
+          state := advance_through_hits !state event;
+          let _, in_filtered_region = !state in
+          Event.With_write_info.create ~should_write:in_filtered_region event)
+        |> Deferred.return))
   in
   return (events, close_result)
 ;;
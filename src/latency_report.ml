@@ -0,0 +1,312 @@
+open! Core
+open Trace_writer_intf
+
+(* A log-linear histogram of nanoseconds, as in HdrHistogram: values below [2 * half]
+   have a bucket each, and each power of two above that is split into [half] buckets, so
+   a bucket is never wider than 1/[half] of the values in it. *)
+module Histogram = struct
+  let half = 128
+  let bits = Int.floor_log2 half
+
+  type t =
+    { counts : int array
+    ; mutable total : int
+    }
+
+  let bucket ns =
+    if ns < 2 * half
+    then ns
+    else (
+      let shift = Int.floor_log2 ns - bits in
+      (shift * half) + (ns lsr shift))
+  ;;
+
+  (* The smallest value which would land in [bucket]. *)
+  let lowest_in_bucket bucket =
+    if bucket < 2 * half
+    then bucket
+    else (
+      let shift = (bucket / half) - 1 in
+      (bucket - (shift * half)) lsl shift)
+  ;;
+
+  let create () =
+    { counts = Array.create ~len:(bucket Int.max_value + 1) 0; total = 0 }
+  ;;
+
+  let add t ns =
+    let ns = Int.max ns 0 in
+    let bucket = bucket ns in
+    t.counts.(bucket) <- t.counts.(bucket) + 1;
+    t.total <- t.total + 1
+  ;;
+
+  (* Rounded down to its bucket. *)
+  let percentile t p =
+    let rank = Int.max 1 (Float.iround_up_exn (p *. Float.of_int t.total /. 100.)) in
+    let rec loop bucket ~seen =
+      let seen = seen + t.counts.(bucket) in
+      if seen >= rank then lowest_in_bucket bucket else loop (bucket + 1) ~seen
+    in
+    loop 0 ~seen:0
+  ;;
+end
+
+module Span = struct
+  type t =
+    { duration : Time_ns.Span.t
+    ; start : Time_ns.Span.t
+    ; process : string
+    }
+end
+
+module Symbol_report = struct
+  type t =
+    { histogram : Histogram.t
+    ; (* Longest first. *)
+      mutable slowest : Span.t list
+    ; (* Spans cut off by the edges of the trace, which aren't in [histogram]. *)
+      mutable num_partial : int
+    }
+
+  let num_slowest = 5
+
+  let add t (span : Span.t) =
+    Histogram.add t.histogram (Time_ns.Span.to_int_ns span.duration);
+    if List.length t.slowest < num_slowest
+       || Time_ns.Span.( > ) span.duration (List.last_exn t.slowest).duration
+    then (
+      let slowest =
+        List.merge t.slowest [ span ] ~compare:(fun (a : Span.t) b ->
+          Time_ns.Span.descending a.duration b.duration)
+      in
+      t.slowest <- List.take slowest num_slowest)
+  ;;
+
+  let add_partial t = t.num_partial <- t.num_partial + 1
+end
+
+type t =
+  { symbols : string list
+  ; reports : (string, Symbol_report.t) Hashtbl.t
+  ; mutable cutting_spans_short : bool
+  }
+
+let create ~symbols =
+  { symbols
+  ; reports =
+      List.map symbols ~f:(fun symbol ->
+        ( symbol
+        , { Symbol_report.histogram = Histogram.create (); slowest = []; num_partial = 0 }
+        ))
+      |> Hashtbl.of_alist_reduce (module String) ~f:Fn.const
+  ; cutting_spans_short = false
+  }
+;;
+
+let cutting_spans_short t ~f =
+  t.cutting_spans_short <- true;
+  Exn.protect ~f ~finally:(fun () -> t.cutting_spans_short <- false)
+;;
+
+module Open_span = struct
+  type t =
+    { report : Symbol_report.t option
+    ; start : Time_ns.Span.t
+    }
+end
+
+module Thread = struct
+  type 'thread t =
+    { thread : 'thread
+    ; process : string
+    ; (* Every span begun in order and not yet ended on the thread. *)
+      open_spans : Open_span.t Stack.t
+    ; mutable last_time : Time_ns.Span.t
+    }
+
+  let saw_time t time = t.last_time <- Time_ns.Span.max t.last_time time
+end
+
+let wrap (type thread) t (module T : S_trace with type thread = thread) =
+  let processes = Int.Table.create () in
+  let module Reporting = struct
+    type nonrec thread = thread Thread.t
+
+    let allocate_pid ~name =
+      let pid = T.allocate_pid ~name in
+      Hashtbl.set processes ~key:pid ~data:name;
+      pid
+    ;;
+
+    let allocate_thread ~pid ~name =
+      { Thread.thread = T.allocate_thread ~pid ~name
+      ; process = Hashtbl.find processes pid |> Option.value ~default:name
+      ; open_spans = Stack.create ()
+      ; last_time = Time_ns.Span.zero
+      }
+    ;;
+
+    let add (thread : thread) report ~start ~end_ =
+      Option.iter report ~f:(fun report ->
+        Symbol_report.add
+          report
+          { duration = Time_ns.Span.( - ) end_ start; start; process = thread.process })
+    ;;
+
+    let is_inferred_start_time ((name, _) : Tracing.Trace.Arg.t) =
+      String.equal name "inferred_start_time"
+    ;;
+
+    (* [Trace_writer] writes the begins of frames it infers, and of calls at the very
+       start of the trace, once the thread ends, after the spans nested in them and
+       sometimes after their own ends. They'd be matched to the wrong ends, so they're
+       never pushed, only counted: their start is a guess anyway. *)
+    let write_duration_begin ~args ~(thread : thread) ~name ~time =
+      let report = Hashtbl.find t.reports name in
+      if List.exists args ~f:is_inferred_start_time
+         || Time_ns.Span.( < ) time thread.last_time
+      then Option.iter report ~f:Symbol_report.add_partial
+      else (
+        Stack.push thread.open_spans { report; start = time };
+        Thread.saw_time thread time);
+      T.write_duration_begin ~args ~thread:thread.thread ~name ~time
+    ;;
+
+    (* Spans with a forced end would skew the report, so they're only counted. *)
+    let write_duration_end ~args ~(thread : thread) ~name ~time =
+      Option.iter (Stack.pop thread.open_spans) ~f:(fun { Open_span.report; start } ->
+        if t.cutting_spans_short
+        then Option.iter report ~f:Symbol_report.add_partial
+        else add thread report ~start ~end_:time);
+      Thread.saw_time thread time;
+      T.write_duration_end ~args ~thread:thread.thread ~name ~time
+    ;;
+
+    let write_duration_complete ~args ~(thread : thread) ~name ~time ~time_end =
+      add thread (Hashtbl.find t.reports name) ~start:time ~end_:time_end;
+      T.write_duration_complete ~args ~thread:thread.thread ~name ~time ~time_end
+    ;;
+
+    let write_duration_instant ~args ~(thread : thread) ~name ~time =
+      Thread.saw_time thread time;
+      T.write_duration_instant ~args ~thread:thread.thread ~name ~time
+    ;;
+
+    let write_counter ~args ~(thread : thread) ~name ~time =
+      T.write_counter ~args ~thread:thread.thread ~name ~time
+    ;;
+  end
+  in
+  (module Reporting : S_trace with type thread = thread Thread.t)
+;;
+
+let print t =
+  List.iter t.symbols ~f:(fun symbol ->
+    let { Symbol_report.histogram; slowest; num_partial } =
+      Hashtbl.find_exn t.reports symbol
+    in
+    let print_partial () =
+      if num_partial > 0
+      then printf "  %d more cut off by the edges of the trace, left out\n" num_partial
+    in
+    if histogram.total = 0
+    then (
+      printf "%s: no spans\n" symbol;
+      print_partial ())
+    else (
+      printf "%s: %d spans\n" symbol histogram.total;
+      print_partial ();
+      List.iter
+        [ "p50", 50.; "p90", 90.; "p99", 99.; "p99.9", 99.9; "max", 100. ]
+        ~f:(fun (label, p) ->
+          let span = Time_ns.Span.of_int_ns (Histogram.percentile histogram p) in
+          printf "  %-6s %s\n" label (Time_ns.Span.to_string span));
+      printf "  slowest:\n";
+      List.iter slowest ~f:(fun { Span.duration; start; process } ->
+        printf
+          "    %s at %s in %s\n"
+          (Time_ns.Span.to_string duration)
+          (Time_ns.Span.to_string start)
+          process)))
+;;
+
+let%expect_test "latency report" =
+  let module Null_trace = struct
+    type thread = unit
+
+    let allocate_pid ~name:_ = 0
+    let allocate_thread ~pid:_ ~name:_ = ()
+    let write_duration_begin ~args:_ ~thread:() ~name:_ ~time:_ = ()
+    let write_duration_end ~args:_ ~thread:() ~name:_ ~time:_ = ()
+    let write_duration_complete ~args:_ ~thread:() ~name:_ ~time:_ ~time_end:_ = ()
+    let write_duration_instant ~args:_ ~thread:() ~name:_ ~time:_ = ()
+    let write_counter ~args:_ ~thread:() ~name:_ ~time:_ = ()
+  end
+  in
+  let t = create ~symbols:[ "handle_order"; "unused" ] in
+  let module T = (val wrap t (module Null_trace)) in
+  let pid = T.allocate_pid ~name:"server" in
+  let threads = List.init 2 ~f:(fun (_ : int) -> T.allocate_thread ~pid ~name:"main") in
+  (* Orders take 1us each, but for a few which are a good deal slower. *)
+  for i = 0 to 999 do
+    let thread = List.nth_exn threads (i % 2) in
+    let at = Time_ns.Span.of_int_us (10 * i) in
+    let took =
+      Time_ns.Span.of_int_us (if i % 250 = 249 then 1 lsl ((i / 250) + 1) else 1)
+    in
+    T.write_duration_begin ~args:[] ~thread ~name:"handle_order" ~time:at;
+    T.write_duration_complete
+      ~args:[]
+      ~thread
+      ~name:"send"
+      ~time:at
+      ~time_end:(Time_ns.Span.( + ) at took);
+    T.write_duration_end
+      ~args:[]
+      ~thread
+      ~name:"handle_order"
+      ~time:(Time_ns.Span.( + ) at took)
+  done;
+  (* Slower still, but one begins as the trace does and the other is ended with it. *)
+  let thread = List.hd_exn threads in
+  T.write_duration_begin
+    ~args:[ "inferred_start_time", Interned "true" ]
+    ~thread
+    ~name:"handle_order"
+    ~time:(Time_ns.Span.of_int_ms 20);
+  T.write_duration_end
+    ~args:[]
+    ~thread
+    ~name:"handle_order"
+    ~time:(Time_ns.Span.of_int_ms 30);
+  T.write_duration_begin
+    ~args:[]
+    ~thread
+    ~name:"handle_order"
+    ~time:(Time_ns.Span.of_int_ms 40);
+  cutting_spans_short t ~f:(fun () ->
+    T.write_duration_end
+      ~args:[]
+      ~thread
+      ~name:"handle_order"
+      ~time:(Time_ns.Span.of_int_ms 50));
+  print t;
+  [%expect
+    {|
+    handle_order: 1000 spans
+      2 more cut off by the edges of the trace, left out
+      p50    1us
+      p90    1us
+      p99    1us
+      p99.9  8us
+      max    16us
+      slowest:
+        16us at 9.99ms in server
+        8us at 7.49ms in server
+        4us at 4.99ms in server
+        2us at 2.49ms in server
+        1us at 0s in server
+    unused: no spans
+    |}]
+;;
@@ -0,0 +1,35 @@
+open! Core
+open Trace_writer_intf
+
+(** Collects the durations of every span of a few chosen symbols as a trace is written,
+    for [-latency-report].
+
+    Durations go into a histogram per symbol, shared by every thread and snapshot written
+    through [wrap], so the report covers the whole recording without keeping its spans
+    around. Histogram buckets are within 1% of the values in them. The slowest few spans
+    of each symbol are kept as well, to be looked up in the trace.
+
+    Spans begun with an inferred start time, or written after spans which began later
+    (as [Trace_writer] writes calls at the very start of the trace), or ended by
+    [cutting_spans_short], were cut off by the edges of the trace, so their durations
+    aren't known. They're counted, but left out of the histograms. *)
+
+type t
+
+val create : symbols:string list -> t
+
+module Thread : sig
+  type 'thread t
+end
+
+(** Writes to the given trace, while recording the spans of [t]'s symbols. *)
+val wrap
+  :  t
+  -> (module S_trace with type thread = 'thread)
+  -> (module S_trace with type thread = 'thread Thread.t)
+
+(** Spans ended within [f] are ended early, because their thread or the trace ended. *)
+val cutting_spans_short : t -> f:(unit -> unit) -> unit
+
+(** Prints each symbol's count, percentiles and slowest spans. *)
+val print : t -> unit
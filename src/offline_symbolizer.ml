@@ -0,0 +1,316 @@
+open! Core
+
+let mmap_re =
+  (* Examples:
+
+     25375/25375 4509191.343298468: PERF_RECORD_MMAP2 25375/25375: [0x7f6fce028000(0x195000) @ 0x28000 fd:01 1837201 0]: r-xp /usr/lib/libc.so.6
+     25375/25375 4509191.343298468: PERF_RECORD_MMAP2 25375/25375: [0x7f6fce028000(0x195000) @ 0x28000 <6e3c087aca9b39549e4ba92c451f1e399b586e28>]: r-xp /usr/lib/libc.so.6
+     -1/0 0.000000000: PERF_RECORD_MMAP -1/0: [0xffffffff81000000(0x1000000) @ 0xffffffff81000000]: x [kernel.kallsyms]_text
+  *)
+  Re.Perl.re
+    {|PERF_RECORD_MMAP2? (-?[0-9]+)/-?[0-9]+: \[(0x[0-9a-f]+)\((0x[0-9a-f]+)\) @ (0x[0-9a-f]+|0)(?: <([0-9a-f]+)>)?[^\]]*\]: (?:[-rwxsp]+ )?(.*)$|}
+  |> Re.compile
+;;
+
+external cxa_demangle : string -> string option = "magic_cxa_demangle_stub"
+
+(* [perf script] prints C++ symbols demangled, so those from ELFs are too. Other symbols,
+   OCaml ones included, are printed as they are. *)
+let demangle name =
+  if String.is_prefix name ~prefix:"_Z"
+  then Option.value (cxa_demangle name) ~default:name
+  else name
+;;
+
+(* The kernel's text symbols from [/proc/kallsyms], sorted by address, as the kernel's
+   mappings aren't backed by an ELF that can be read. Addresses read as 0 when
+   [kptr_restrict] hides them, in which case there are no symbols. *)
+module Kallsyms = struct
+  type t =
+    { addrs : int array
+    ; names : string array
+    }
+
+  let load filename =
+    let symbols =
+      try
+        In_channel.read_lines filename
+        |> List.filter_map ~f:(fun line ->
+          match String.split line ~on:' ' with
+          | addr :: ("t" | "T") :: name :: _ ->
+            let addr = Util.int_trunc_of_hex_string addr in
+            (* Symbols in modules are followed by a tab and the module's name. *)
+            let name =
+              Option.value_map (String.lsplit2 name ~on:'\t') ~default:name ~f:fst
+            in
+            Option.some_if (addr <> 0) (addr, name)
+          | _ -> None)
+      with
+      | _ -> []
+    in
+    let symbols =
+      List.sort symbols ~compare:(fun (a, _) (b, _) -> Int.compare a b) |> Array.of_list
+    in
+    { addrs = Array.map symbols ~f:fst; names = Array.map symbols ~f:snd }
+  ;;
+
+  (* Each symbol ends where the next one starts. *)
+  let resolve t addr : Elf.Symbol_resolver.resolved option =
+    Array.binary_search
+      t.addrs
+      ~compare:Int.compare
+      `Last_less_than_or_equal_to
+      addr
+    |> Option.map ~f:(fun i ->
+      { Elf.Symbol_resolver.name = t.names.(i)
+      ; start_addr = t.addrs.(i)
+      ; end_addr =
+          (if i + 1 < Array.length t.addrs then t.addrs.(i + 1) else addr + 1)
+      })
+  ;;
+end
+
+module Resolver = struct
+  type t =
+    | Elf of Elf.Symbol_resolver.t
+    | Kallsyms of Kallsyms.t
+
+  let resolve t addr =
+    match t with
+    | Elf resolver -> Elf.Symbol_resolver.resolve resolver addr
+    | Kallsyms kallsyms -> Kallsyms.resolve kallsyms addr
+  ;;
+end
+
+module Resolved = struct
+  type t =
+    { symbol : Symbol.t
+    ; start_addr : int
+    ; end_addr : int
+    }
+end
+
+module Mapping = struct
+  type t =
+    { start : int
+    ; end_ : int
+    ; dso : string
+    ; resolver : Resolver.t option
+    ; (* Symbols resolved so far, keyed by start address. Resolving an address against the
+         ELF scans its symbol table, so each symbol is only resolved once. *)
+      mutable resolved : Resolved.t Int.Map.t
+    ; (* Addresses which aren't covered by any symbol, for the same reason, up to
+         [max_unresolvable] of them. *)
+      unresolvable : Int.Hash_set.t
+    }
+
+  let max_unresolvable = 4096
+
+  let contains t addr = t.start <= addr && addr < t.end_
+end
+
+type t =
+  { (* Keyed by build id when [perf] recorded one, and by path otherwise. *)
+    elfs : (string, Elf.t option) Hashtbl.t
+  ; (* Mappings by pid, keyed by start address. Kernel mappings are under pid -1. *)
+    mappings : Mapping.t Int.Map.t Int.Table.t
+  ; (* Every symbol with a given name is the same [Symbol.t], so resolving an address
+       allocates nothing once its symbol has been seen. *)
+    symbols_by_name : Symbol.t String.Table.t
+  ; (* Only read once a kernel mapping is seen. *)
+    kallsyms : Kallsyms.t Lazy.t
+  ; mutable last_pid : int
+  ; mutable last_mapping : Mapping.t option
+  }
+
+let kernel_pid = -1
+
+let create ?(kallsyms = "/proc/kallsyms") () =
+  { elfs = String.Table.create ()
+  ; mappings = Int.Table.create ()
+  ; symbols_by_name = String.Table.create ()
+  ; kallsyms = lazy (Kallsyms.load kallsyms)
+  ; last_pid = kernel_pid
+  ; last_mapping = None
+  }
+;;
+
+let elf t ~build_id ~dso =
+  let key = if String.is_empty build_id then dso else build_id in
+  Hashtbl.find_or_add t.elfs key ~default:(fun () -> Elf.create dso)
+;;
+
+let try_add_mmap_line t line =
+  match Re.Group.all (Re.exec mmap_re line) with
+  | [| _; pid; start; length; pgoff; build_id; dso |] ->
+    let start = Util.int_trunc_of_hex_string ~remove_hex_prefix:true start in
+    let length = Util.int_trunc_of_hex_string ~remove_hex_prefix:true length in
+    let pgoff =
+      if String.equal pgoff "0"
+      then 0
+      else Util.int_trunc_of_hex_string ~remove_hex_prefix:true pgoff
+    in
+    let pid = Int.of_string pid in
+    let resolver : Resolver.t option =
+      if pid = kernel_pid
+      then Some (Kallsyms (Lazy.force t.kallsyms))
+      else
+        Option.map (elf t ~build_id ~dso) ~f:(fun elf : Resolver.t ->
+          Elf { elf; file_offset = pgoff; loaded_offset = start })
+    in
+    let mapping =
+      { Mapping.start
+      ; end_ = start + length
+      ; dso
+      ; resolver
+      ; resolved = Int.Map.empty
+      ; unresolvable = Int.Hash_set.create ()
+      }
+    in
+    Hashtbl.update t.mappings pid ~f:(fun mappings ->
+      Map.set (Option.value mappings ~default:Int.Map.empty) ~key:start ~data:mapping);
+    (* A new mapping can shadow the cached one. *)
+    t.last_mapping <- None;
+    true
+  | _ | (exception _) -> false
+;;
+
+let add_mmap_line t line =
+  (* Checked first so that the regex only runs on the rare lines that can match it. *)
+  String.is_substring line ~substring:"PERF_RECORD_MMAP" && try_add_mmap_line t line
+;;
+
+let find_mapping_in t ~pid addr =
+  match Hashtbl.find t.mappings pid with
+  | None -> None
+  | Some mappings ->
+    (match Map.closest_key mappings `Less_or_equal_to addr with
+     | Some (_, mapping) when Mapping.contains mapping addr -> Some mapping
+     | Some _ | None -> None)
+;;
+
+let find_mapping t ~pid addr =
+  match t.last_mapping with
+  | Some mapping when t.last_pid = pid && Mapping.contains mapping addr -> t.last_mapping
+  | Some _ | None ->
+    let mapping =
+      match find_mapping_in t ~pid addr with
+      | Some _ as mapping -> mapping
+      | None -> find_mapping_in t ~pid:kernel_pid addr
+    in
+    if Option.is_some mapping
+    then (
+      t.last_pid <- pid;
+      t.last_mapping <- mapping);
+    mapping
+;;
+
+let resolve_in_mapping t (mapping : Mapping.t) addr =
+  match Map.closest_key mapping.resolved `Less_or_equal_to addr with
+  | Some (_, resolved) when addr < resolved.end_addr -> Some resolved
+  | Some _ | None ->
+    if Hash_set.mem mapping.unresolvable addr
+    then None
+    else (
+      match mapping.resolver with
+      | None -> None
+      | Some resolver ->
+        (match Resolver.resolve resolver addr with
+         | None ->
+           if Hash_set.length mapping.unresolvable >= Mapping.max_unresolvable
+           then Hash_set.clear mapping.unresolvable;
+           Hash_set.add mapping.unresolvable addr;
+           None
+         | Some { name; start_addr; end_addr } ->
+           let symbol =
+             Hashtbl.find_or_add t.symbols_by_name name ~default:(fun () ->
+               Symbol.From_perf (demangle name))
+           in
+           (* Zero-sized symbols still cover the address they were found for. *)
+           let resolved =
+             { Resolved.symbol; start_addr; end_addr = Int.max end_addr (addr + 1) }
+           in
+           mapping.resolved <- Map.set mapping.resolved ~key:start_addr ~data:resolved;
+           Some resolved))
+;;
+
+let resolve t ~pid ~addr =
+  let pid = Option.value_map pid ~default:kernel_pid ~f:Pid.to_int in
+  let addr = Int64.to_int_trunc addr in
+  match find_mapping t ~pid addr with
+  | None -> `Unmapped
+  | Some mapping ->
+    (match resolve_in_mapping t mapping addr with
+     | None -> `In_dso mapping.dso
+     | Some resolved -> `Symbol (resolved.symbol, addr - resolved.start_addr))
+;;
+
+let%expect_test "parsing mmap lines" =
+  let kallsyms = Filename_unix.temp_file "kallsyms" "" in
+  Out_channel.write_lines
+    kallsyms
+    [ "ffffffff81000000 T _stext"
+    ; "ffffffff81000010 t do_one_initcall"
+    ; "ffffffff81000040 D some_data"
+    ; "ffffffffc0000000 t nft_do_chain\t[nf_tables]"
+    ];
+  let t = create ~kallsyms () in
+  List.iter
+    [ {|25375/25375 4509191.343298468: PERF_RECORD_MMAP2 25375/25375: [0x7f6fce028000(0x195000) @ 0x28000 fd:01 1837201 0]: r-xp /nonexistent/libc.so.6|}
+    ; {|25375/25375 4509191.343298469: PERF_RECORD_MMAP2 25375/25375: [0x56234f400000(0x1000) @ 0 <6e3c087aca9b39549e4ba92c451f1e399b586e28>]: r-xp /nonexistent/foo|}
+    ; {|-1/0 0.000000000: PERF_RECORD_MMAP -1/0: [0xffffffff81000000(0x1000000) @ 0xffffffff81000000]: x [kernel.kallsyms]_text|}
+    ; {| 25375/25375 4509191.343298468:                            1   branches:uH:   call                     7f6fce0b71f4 =>     7ffd193838e0|}
+    ]
+    ~f:(fun line -> print_s [%message "" ~is_mmap:(add_mmap_line t line : bool)]);
+  [%expect
+    {|
+    (is_mmap true)
+    (is_mmap true)
+    (is_mmap true)
+    (is_mmap false)
+    |}];
+  List.iter
+    [ Some 25375, 0x7f6fce0b71f4L
+    ; Some 25375, 0x56234f400010L
+    ; Some 25375, 0xffffffff81000010L
+    ; Some 25375, 0x1000L
+    ; None, 0xffffffff81000010L
+    ; None, 0xffffffff81000058L
+    ]
+    ~f:(fun (pid, addr) ->
+      let pid = Option.map pid ~f:Pid.of_int in
+      let result =
+        match resolve t ~pid ~addr with
+        | `Symbol (symbol, offset) ->
+          [%message "symbol" (symbol : Symbol.t) (offset : int)]
+        | `In_dso dso -> [%message "in dso" ~_:(dso : string)]
+        | `Unmapped -> [%message "unmapped"]
+      in
+      print_s result);
+  [%expect
+    {|
+    ("in dso" /nonexistent/libc.so.6)
+    ("in dso" /nonexistent/foo)
+    (symbol (symbol (From_perf do_one_initcall)) (offset 0))
+    unmapped
+    (symbol (symbol (From_perf do_one_initcall)) (offset 0))
+    (symbol (symbol (From_perf do_one_initcall)) (offset 72))
+    |}]
+;;
+
+let%expect_test "demangling" =
+  List.iter
+    [ "_ZN9wikipedia7article6formatEv"
+    ; "_ZNSt6vectorIiSaIiEE9push_backERKi"
+    ; "camlStdlib__List__map_123"
+    ; "main"
+    ]
+    ~f:(fun name -> print_endline (demangle name));
+  [%expect
+    {|
+    wikipedia::article::format()
+    std::vector<int, std::allocator<int> >::push_back(int const&)
+    camlStdlib__List__map_123
+    main
+    |}]
+;;
@@ -0,0 +1,26 @@
+open! Core
+
+(** Resolves instruction pointers to symbols inside magic-trace, using the MMAP events
+    [perf script --show-mmap-events] prints, rather than having [perf] look up and print a
+    symbol, offset and DSO for every address it emits.
+
+    Symbols are named as [perf] would name them, so C++ symbols are demangled. *)
+
+type t
+
+(** Kernel addresses are symbolized from [kallsyms], by default [/proc/kallsyms], which is
+    only read if the kernel is mapped. *)
+val create : ?kallsyms:string -> unit -> t
+
+(** If [line] is a [PERF_RECORD_MMAP] or [PERF_RECORD_MMAP2] line, records the mapping
+    it describes and returns [true]. Returns [false] for any other line. *)
+val add_mmap_line : t -> string -> bool
+
+val resolve
+  :  t
+  -> pid:Pid.t option
+  -> addr:int64
+  -> [ `Symbol of Symbol.t * int (** The symbol and the offset of [addr] into it. *)
+     | `In_dso of string (** Mapped, but not covered by any symbol in the DSO. *)
+     | `Unmapped
+     ]
@@ -0,0 +1,25 @@
+#include <stdlib.h>
+
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/mlvalues.h>
+
+// From libstdc++'s C++ ABI support, which is what [perf] demangles C++ symbols with
+// when it's built without libbfd.
+extern char *__cxa_demangle(const char *mangled_name, char *output_buffer,
+                            size_t *length, int *status);
+
+CAMLprim value magic_cxa_demangle_stub(value v_mangled) {
+  CAMLparam1(v_mangled);
+  CAMLlocal2(demangled, res);
+  int status = 0;
+  char *buf = __cxa_demangle(String_val(v_mangled), NULL, NULL, &status);
+  if (buf == NULL || status != 0) {
+    free(buf);
+    CAMLreturn(Val_none);
+  }
+  demangled = caml_copy_string(buf);
+  free(buf);
+  res = caml_alloc_some(demangled);
+  CAMLreturn(res);
+}
@@ -19,9 +19,30 @@ let perf_extra_sampled_event_re =
 
 let perf_callstack_entry_re = Re.Perl.re "^\t *([0-9a-f]+) (.*)$" |> Re.compile
 
+let perf_branch_kind_re =
+  {|(call|return|tr strt|syscall|sysret|hw int|iret|int|tx abrt|tr end|tr strt tr end|tr end  (?:async|call|return|syscall|sysret|iret)|jmp|jcc)|}
+;;
+
 let perf_branches_event_re =
   Re.Perl.re
-    {|^ *(call|return|tr strt|syscall|sysret|hw int|iret|int|tx abrt|tr end|tr strt tr end|tr end  (?:async|call|return|syscall|sysret|iret)|jmp|jcc) +(\(x\) +)?([0-9a-f]+) (.*) => +([0-9a-f]+) (.*)$|}
+    ({|^ *|}
+     ^ perf_branch_kind_re
+     ^ {| +(\(x\) +)?([0-9a-f]+) (.*) => +([0-9a-f]+) (.*)$|})
+  |> Re.compile
+;;
+
+(* When symbolizing offline we don't ask [perf] for [sym,symoff,dso], so addresses are
+   printed bare. Whatever follows them is captured (and ignored) in place of the
+   symbol. *)
+let perf_extra_sampled_event_raw_re =
+  Re.Perl.re {|^ *([0-9]+) +([0-9a-f]+)(.*)$|} |> Re.compile
+;;
+
+let perf_callstack_entry_raw_re = Re.Perl.re "^\t *([0-9a-f]+)(.*)$" |> Re.compile
+
+let perf_branches_event_raw_re =
+  Re.Perl.re
+    ({|^ *|} ^ perf_branch_kind_re ^ {| +(\(x\) +)?([0-9a-f]+)(.*) => +([0-9a-f]+)(.*)$|})
   |> Re.compile
 ;;
 
@@ -109,6 +130,14 @@ let parse_event_header line =
           "Regex of perf output did not match expected fields" (results : string array)])
 ;;
 
+let perf_map_symbol_and_offset perf_maps ~pid ~addr =
+  match Perf_map.Table.symbol ~pid perf_maps ~addr with
+  | None -> None
+  | Some location ->
+    let offset = saturating_sub_i64 addr location.start_addr in
+    Some (Symbol.From_perf_map location, offset)
+;;
+
 let parse_symbol_and_offset ?perf_maps pid str ~addr : Symbol.t * int =
   match Re.Group.all (Re.exec symbol_and_offset_re str) with
   | [| _; symbol; offset |] ->
@@ -136,13 +165,33 @@ let parse_symbol_and_offset ?perf_maps pid str ~addr : Symbol.t * int =
           From_perf [%string "[unknown @ %{addr#Int64.Hex} (%{dso})]"], 0
         | _ | (exception _) -> failed)
      | Some perf_map, Some pid ->
-       (match Perf_map.Table.symbol ~pid perf_map ~addr with
-        | None -> failed
-        | Some location ->
-          (* It's strange that perf isn't resolving these symbols. It says on the
-             tin that it supports perf map files! *)
-          let offset = saturating_sub_i64 addr location.start_addr in
-          From_perf_map location, offset))
+       (* It's strange that perf isn't resolving these symbols. It says on the tin that it
+          supports perf map files! *)
+       perf_map_symbol_and_offset perf_map ~pid ~addr |> Option.value ~default:failed)
+;;
+
+(* Code in an ELF is symbolized from it, and anything else (e.g. JITed code in anonymous
+   mappings) from perf maps. *)
+let symbolize_offline ?perf_maps symbolizer pid ~addr : Symbol.t * int =
+  match Offline_symbolizer.resolve symbolizer ~pid ~addr with
+  | `Symbol symbol_and_offset -> symbol_and_offset
+  | (`In_dso _ | `Unmapped) as unresolved ->
+    let from_perf_map =
+      match perf_maps, pid with
+      | Some perf_map, Some pid -> perf_map_symbol_and_offset perf_map ~pid ~addr
+      | None, _ | _, None -> None
+    in
+    (match from_perf_map, unresolved with
+     | Some symbol_and_offset, _ -> symbol_and_offset
+     | None, `In_dso dso ->
+       From_perf [%string "[unknown @ %{addr#Int64.Hex} (%{dso})]"], 0
+     | None, `Unmapped -> Unknown, 0)
+;;
+
+let symbol_and_offset ?perf_maps ?symbolizer pid str ~addr =
+  match symbolizer with
+  | None -> parse_symbol_and_offset ?perf_maps pid str ~addr
+  | Some symbolizer -> symbolize_offline ?perf_maps symbolizer pid ~addr
 ;;
 
 let trace_error_to_event line : Event.Decode_error.t =
@@ -178,20 +227,37 @@ let parse_perf_cbr_event thread time line : Event.t =
         "Regex of perf cbr event did not match expected fields" (results : string array)]
 ;;
 
-let parse_location ?perf_maps ~pid instruction_pointer symbol_and_offset
+let parse_location ?perf_maps ?symbolizer ~pid instruction_pointer symbol_and_offset
   : Event.Location.t
   =
   let instruction_pointer = Util.int64_of_hex_string instruction_pointer in
   let symbol, symbol_offset =
-    parse_symbol_and_offset ?perf_maps pid symbol_and_offset ~addr:instruction_pointer
+    symbol_and_offset
+      ?perf_maps
+      ?symbolizer
+      pid
+      symbol_and_offset
+      ~addr:instruction_pointer
   in
   { instruction_pointer; symbol; symbol_offset }
 ;;
 
-let parse_callstack_entry ?perf_maps (thread : Event.Thread.t) line : Event.Location.t =
-  match Re.Group.all (Re.exec perf_callstack_entry_re line) with
+let parse_callstack_entry ?perf_maps ?symbolizer (thread : Event.Thread.t) line
+  : Event.Location.t
+  =
+  let re =
+    if Option.is_some symbolizer
+    then perf_callstack_entry_raw_re
+    else perf_callstack_entry_re
+  in
+  match Re.Group.all (Re.exec re line) with
   | [| _; instruction_pointer; symbol_and_offset |] ->
-    parse_location ?perf_maps ~pid:thread.pid instruction_pointer symbol_and_offset
+    parse_location
+      ?perf_maps
+      ?symbolizer
+      ~pid:thread.pid
+      instruction_pointer
+      symbol_and_offset
   | results ->
     raise_s
       [%message
@@ -199,15 +265,24 @@ let parse_callstack_entry ?perf_maps (thread : Event.Thread.t) line : Event.Loca
           (results : string array)]
 ;;
 
-let parse_perf_cycles_event ?perf_maps (thread : Event.Thread.t) time lines : Event.t =
+let parse_perf_cycles_event ?perf_maps ?symbolizer (thread : Event.Thread.t) time lines
+  : Event.t
+  =
   let callstack =
-    List.map lines ~f:(parse_callstack_entry ?perf_maps thread) |> List.rev
+    List.map lines ~f:(parse_callstack_entry ?perf_maps ?symbolizer thread) |> List.rev
   in
   Ok { thread; time; data = Stacktrace_sample { callstack }; in_transaction = false }
 ;;
 
-let parse_perf_branches_event ?perf_maps (thread : Event.Thread.t) time line : Event.t =
-  match Re.Group.all (Re.exec perf_branches_event_re line) with
+let parse_perf_branches_event ?perf_maps ?symbolizer (thread : Event.Thread.t) time line
+  : Event.t
+  =
+  let re =
+    if Option.is_some symbolizer
+    then perf_branches_event_raw_re
+    else perf_branches_event_re
+  in
+  match Re.Group.all (Re.exec re line) with
   | [| _
      ; kind
      ; aux_flags
@@ -219,15 +294,17 @@ let parse_perf_branches_event ?perf_maps (thread : Event.Thread.t) time line : E
     let src_instruction_pointer = Util.int64_of_hex_string src_instruction_pointer in
     let dst_instruction_pointer = Util.int64_of_hex_string dst_instruction_pointer in
     let src_symbol, src_symbol_offset =
-      parse_symbol_and_offset
+      symbol_and_offset
         ?perf_maps
+        ?symbolizer
         thread.pid
         src_symbol_and_offset
         ~addr:src_instruction_pointer
     in
     let dst_symbol, dst_symbol_offset =
-      parse_symbol_and_offset
+      symbol_and_offset
         ?perf_maps
+        ?symbolizer
         thread.pid
         dst_symbol_and_offset
         ~addr:dst_instruction_pointer
@@ -300,6 +377,7 @@ let parse_perf_branches_event ?perf_maps (thread : Event.Thread.t) time line : E
 
 let parse_perf_extra_sampled_event
   ?perf_maps
+  ?symbolizer
   (thread : Event.Thread.t)
   time
   period
@@ -311,14 +389,24 @@ let parse_perf_extra_sampled_event
   let (location : Event.Location.t) =
     match lines with
     | [] ->
-      (match Re.Group.all (Re.exec perf_extra_sampled_event_re line) with
+      let re =
+        if Option.is_some symbolizer
+        then perf_extra_sampled_event_raw_re
+        else perf_extra_sampled_event_re
+      in
+      (match Re.Group.all (Re.exec re line) with
        | [| _str; _; instruction_pointer; symbol_and_offset |] ->
-         parse_location ?perf_maps ~pid:thread.pid instruction_pointer symbol_and_offset
+         parse_location
+           ?perf_maps
+           ?symbolizer
+           ~pid:thread.pid
+           instruction_pointer
+           symbol_and_offset
        | results ->
          raise_s
            [%message
              "Regex of perf event did not match expected fields" (results : string array)])
-    | lines -> List.hd_exn lines |> parse_callstack_entry ?perf_maps thread
+    | lines -> List.hd_exn lines |> parse_callstack_entry ?perf_maps ?symbolizer thread
   in
   Ok
     { thread
@@ -328,10 +416,18 @@ let parse_perf_extra_sampled_event
     }
 ;;
 
-let to_event ?perf_maps lines : Event.t option =
+(* MMAP events are only printed when symbolizing offline, and only feed the symbolizer. *)
+let consume_mmap_event ?symbolizer line =
+  match symbolizer with
+  | None -> false
+  | Some symbolizer -> Offline_symbolizer.add_mmap_line symbolizer line
+;;
+
+let to_event ?perf_maps ?symbolizer lines : Event.t option =
   try
     match lines with
     | [] -> raise_s [%message "Unexpected line while parsing perf output."]
+    | first_line :: _ when consume_mmap_event ?symbolizer first_line -> None
     | first_line :: lines ->
       let header = parse_event_header first_line in
       (match header with
@@ -339,16 +435,19 @@ let to_event ?perf_maps lines : Event.t option =
        | Event { thread; time; period; event; remaining_line } ->
          (match event with
           | `Branches ->
-            Some (parse_perf_branches_event ?perf_maps thread time remaining_line)
+            Some
+              (parse_perf_branches_event ?perf_maps ?symbolizer thread time remaining_line)
           | `Cbr ->
             (* cbr (core-to-bus ratio) are events which show frequency changes. *)
             Some (parse_perf_cbr_event thread time remaining_line)
           | `Psb -> (* Ignore psb (packet stream boundary) packets *) None
-          | `Cycles -> Some (parse_perf_cycles_event ?perf_maps thread time lines)
+          | `Cycles ->
+            Some (parse_perf_cycles_event ?perf_maps ?symbolizer thread time lines)
           | `Branch_misses ->
             Some
               (parse_perf_extra_sampled_event
                  ?perf_maps
+                 ?symbolizer
                  thread
                  time
                  period
@@ -359,6 +458,7 @@ let to_event ?perf_maps lines : Event.t option =
             Some
               (parse_perf_extra_sampled_event
                  ?perf_maps
+                 ?symbolizer
                  thread
                  time
                  period
@@ -375,39 +475,80 @@ let to_event ?perf_maps lines : Event.t option =
           ~perf_output:(lines : string list)]
 ;;
 
-let split_line_pipe pipe : string list Pipe.Reader.t =
-  let reader, writer = Pipe.create () in
-  don't_wait_for
-    (let%bind acc =
-       Pipe.fold pipe ~init:[] ~f:(fun acc line ->
-         let should_acc = not String.(line = "") in
-         let should_write =
-           String.(line = "") || not (Char.equal (String.get line 0) '\t')
-         in
-         let%map () =
-           if List.length acc > 0 && should_write
-           then Pipe.write writer (List.rev acc)
-           else Deferred.return ()
-         in
-         let prev_acc = if should_write then [] else acc in
-         if should_acc then line :: prev_acc else prev_acc)
-     in
-     let%map () =
-       if List.length acc > 0
-       then Pipe.write writer (List.rev acc)
-       else Deferred.return ()
-     in
-     Pipe.close writer);
-  reader
+(* [perf script] prints one record per line, except for sampled callstacks, whose frames
+   follow the header line on tab-prefixed continuation lines. An empty line also ends a
+   record. [Record_builder] groups lines into records as they arrive, so each line is
+   looked at exactly once. *)
+module Record_builder = struct
+  type t = { mutable rev_lines : string list }
+
+  let create () = { rev_lines = [] }
+
+  let flush t ~emit =
+    match t.rev_lines with
+    | [] -> ()
+    | [ _ ] as record ->
+      (* The overwhelmingly common case (branch events), which needs no reversal. *)
+      t.rev_lines <- [];
+      emit record
+    | rev_lines ->
+      t.rev_lines <- [];
+      emit (List.rev rev_lines)
+  ;;
+
+  let add_line t line ~emit =
+    if String.is_empty line
+    then flush t ~emit
+    else (
+      if not (Char.equal (String.unsafe_get line 0) '\t') then flush t ~emit;
+      t.rev_lines <- line :: t.rev_lines)
+  ;;
+end
+
+(* Frames [perf script]'s stdout into records straight out of the [Reader]'s buffer,
+   rather than going through [Reader.lines], which pays a pipe write and a deferred per
+   line. Line boundaries are found with [memchr]; the only per-line allocation left is
+   the string handed to the regex-based parser. Records are pushed downstream one chunk
+   at a time. *)
+let split_reader_into_records reader : string list Pipe.Reader.t =
+  Pipe.create_reader ~close_on_exception:false (fun writer ->
+    let builder = Record_builder.create () in
+    let records = Queue.create () in
+    let emit record = Queue.enqueue records record in
+    let add_line line = Record_builder.add_line builder line ~emit in
+    let handle_chunk buf ~pos ~len =
+      let stop = pos + len in
+      let rec add_complete_lines line_start =
+        let newline =
+          Bigstring.unsafe_find buf '\n' ~pos:line_start ~len:(stop - line_start)
+        in
+        if newline < 0
+        then line_start
+        else (
+          add_line (Bigstring.To_string.sub buf ~pos:line_start ~len:(newline - line_start));
+          add_complete_lines (newline + 1))
+      in
+      let consumed = add_complete_lines pos - pos in
+      let%map () = Pipe.transfer_in writer ~from:records in
+      (* If not even one line fit, ask the reader to grow its buffer. *)
+      if consumed = 0
+      then `Consumed (0, `Need (len + 1))
+      else `Consumed (consumed, `Need_unknown)
+    in
+    let%bind () =
+      match%map Reader.read_one_chunk_at_a_time reader ~handle_chunk with
+      | `Eof | `Stopped () -> ()
+      | `Eof_with_unconsumed_data last_line -> add_line last_line
+    in
+    Record_builder.flush builder ~emit;
+    let%bind () = Pipe.transfer_in writer ~from:records in
+    Reader.close reader)
 ;;
 
-let to_events ?perf_maps pipe =
-  let pipe = split_line_pipe pipe in
-  (* Every route of filtering on streams in an async way seems to be deprecated,
-     including converting to pipes which says that the stream creation should be
-     switched to a pipe creation. Changing Async_shell is out-of-scope, and I also
-     can't see a reason why filter_map would lead to memory leaks. *)
-  Pipe.map pipe ~f:(to_event ?perf_maps) |> Pipe.filter_map ~f:Fn.id
+let to_events ?perf_maps ?symbolizer reader =
+  let pipe = split_reader_into_records reader in
+  Pipe.map' pipe ~max_queue_length:Decode_result.max_batch_size ~f:(fun records ->
+    Queue.filter_map records ~f:(to_event ?perf_maps ?symbolizer) |> return)
 ;;
 
 module%test _ = struct
@@ -457,6 +598,25 @@ module%test _ = struct
            (data (Trace (kind Call) (src 0x56234f77576b) (dst 0x56234f4bc7a0)))))) |}]
   ;;
 
+  let%expect_test "offline symbolization" =
+    let symbolizer = Offline_symbolizer.create () in
+    let check s =
+      to_event ~symbolizer (String.split ~on:'\n' s)
+      |> [%sexp_of: Event.t option]
+      |> print_s
+    in
+    check
+      {|25375/25375 4509191.343298468: PERF_RECORD_MMAP2 25375/25375: [0x7f6fce000000(0x1c000) @ 0 fd:01 1837201 0]: r-xp /nonexistent/foo.so|};
+    [%expect {| () |}];
+    check
+      {| 25375/25375 4509191.343298468:                            1   branches:uH:   call                     7f6fce0071f4 =>     7ffd193838e0|};
+    [%expect
+      {|
+        ((Ok
+          ((thread ((pid (25375)) (tid (25375)))) (time 52d4h33m11.343298468s)
+           (data (Trace (kind Call) (src 0x7f6fce0071f4) (dst 0x7ffd193838e0)))))) |}]
+  ;;
+
   (* CR-someday wduff: Leaving this concrete example here for when we support this. See my
      comment above as well.
 
@@ -728,5 +888,5 @@ end
 
 module For_testing = struct
   let to_event = to_event
-  let split_line_pipe = split_line_pipe
+  let split_reader_into_records = split_reader_into_records
 end
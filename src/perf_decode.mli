@@ -3,12 +3,24 @@
 open! Core
 open! Async
 
+(** Parses [perf script] output read from [Reader.t] into events. Closes the reader once
+    it reaches EOF.
+
+    With [symbolizer], [perf script] is expected to have been run without the [sym],
+    [symoff] and [dso] fields and with [--show-mmap-events]; addresses are then
+    symbolized by [symbolizer] instead. *)
 val to_events
   :  ?perf_maps:Perf_map.Table.t
-  -> string Pipe.Reader.t
+  -> ?symbolizer:Offline_symbolizer.t
+  -> Reader.t
   -> Event.t Pipe.Reader.t
 
 module For_testing : sig
-  val to_event : ?perf_maps:Perf_map.Table.t -> string list -> Event.t option
-  val split_line_pipe : string Pipe.Reader.t -> string list Pipe.Reader.t
+  val to_event
+    :  ?perf_maps:Perf_map.Table.t
+    -> ?symbolizer:Offline_symbolizer.t
+    -> string list
+    -> Event.t option
+
+  val split_reader_into_records : Reader.t -> string list Pipe.Reader.t
 end
@@ -1,8 +1,6 @@
 open! Core
 open! Async
 
-type t = Perf_map_location.t Int64.Map.t
-
 let perf_map_re =
   (* Example: 3a6caa49c2e f3 LazyCompile:~afterInspector node:internal/errors:753
 
@@ -191,58 +189,314 @@ let map_of_sequence_prefer_later sequence =
     Map.set map ~key ~data)
 ;;
 
-let load file_location =
-  let%map lines =
-    Monitor.try_with_or_error ~rest:`Log (fun () -> Reader.file_lines file_location)
+(* Perf maps are compiled into flat arrays sorted by start address, so a lookup is a
+   binary search over unboxed ints rather than a walk down an [Int64.Map.t]. Entry [i]
+   covers addresses from [starts.(i)] up to, but excluding, [ends.(i)]. Addresses are
+   stored as [int]s, which loses nothing for the canonical (48- or 57-bit,
+   sign-extended) addresses code can live at.
+
+   Consecutive lookups nearly always land in the same JITed function, so the index of the
+   last hit is checked before searching. [locations] holds preallocated [Some]s so that
+   lookups don't allocate. *)
+module Index = struct
+  type t =
+    { entries : Perf_map_location.t array
+    ; starts : int array
+    ; ends : int array
+    ; locations : Perf_map_location.t option array
+    ; mutable last_hit : int
+    }
+
+  let of_sorted_entries (entries : Perf_map_location.t array) =
+    { entries
+    ; starts = Array.map entries ~f:(fun entry -> Int64.to_int_trunc entry.start_addr)
+    ; ends =
+        Array.map entries ~f:(fun entry ->
+          Int64.to_int_trunc entry.start_addr + entry.size)
+    ; locations = Array.map entries ~f:Option.some
+    ; last_hit = -1
+    }
+  ;;
+
+  let empty () = of_sorted_entries [||]
+
+  (* Merges [newer] (sorted, without duplicate addresses) into [t]. There can be
+     duplicate entries in these files as JITs reuse code that is no longer useful in favor
+     of newly compiled code (e.g. V8 does this), so on a shared start address the newer
+     entry wins. *)
+  let merge_prefer_newer t (newer : Perf_map_location.t array) =
+    let older = t.entries in
+    let num_older = Array.length older in
+    let merged = Queue.create ~capacity:(num_older + Array.length newer) () in
+    let i = ref 0 in
+    Array.iter newer ~f:(fun entry ->
+      let start = Int64.to_int_trunc entry.start_addr in
+      while !i < num_older && t.starts.(!i) < start do
+        Queue.enqueue merged older.(!i);
+        incr i
+      done;
+      if !i < num_older && t.starts.(!i) = start then incr i;
+      Queue.enqueue merged entry);
+    for j = !i to num_older - 1 do
+      Queue.enqueue merged older.(j)
+    done;
+    of_sorted_entries (Queue.to_array merged)
+  ;;
+
+  (* Index of the entry with the greatest start address [<= addr], or [-1] if there is
+     none. The loop runs a fixed number of iterations for a given length and folds the
+     comparison into arithmetic instead of branching on it. *)
+  let index_of_last_start_at_or_before starts addr =
+    let length = Array.length starts in
+    if length = 0
+    then -1
+    else (
+      let base = ref 0 in
+      let remaining = ref length in
+      while !remaining > 1 do
+        let half = !remaining / 2 in
+        let go_right = Bool.to_int (Array.unsafe_get starts (!base + half) <= addr) in
+        base := !base + (half * go_right);
+        remaining := !remaining - half
+      done;
+      if Array.unsafe_get starts !base <= addr then !base else -1)
+  ;;
+
+  let symbol t ~addr =
+    let addr = Int64.to_int_trunc addr in
+    let last_hit = t.last_hit in
+    if last_hit >= 0 && t.starts.(last_hit) <= addr && addr < t.ends.(last_hit)
+    then t.locations.(last_hit)
+    else (
+      (* This assumes that code for functions can't be inside each other. If that
+         assumption is violated, this will attribute code inside both functions to the
+         one with the greater address. *)
+      let index = index_of_last_start_at_or_before t.starts addr in
+      if index >= 0 && addr < t.ends.(index)
+      then (
+        t.last_hit <- index;
+        t.locations.(index))
+      else None)
+  ;;
+end
+
+let%expect_test "symbol lookup" =
+  let entries addrs =
+    List.map addrs ~f:(fun (start_addr, size, function_) ->
+      { Perf_map_location.start_addr; size; function_ })
+    |> Array.of_list
   in
-  match lines with
+  let index =
+    Index.merge_prefer_newer
+      (Index.of_sorted_entries
+         (entries [ 0x1000L, 0x10, "a"; 0x1010L, 0x20, "stale"; 0x2000L, 0x8, "c" ]))
+      (entries [ 0x1010L, 0x20, "b" ])
+  in
+  List.iter
+    [ 0xfffL; 0x1000L; 0x100fL; 0x1010L; 0x102fL; 0x1030L; 0x2004L; 0x2008L ]
+    ~f:(fun addr ->
+      let function_ =
+        Option.map (Index.symbol index ~addr) ~f:(fun location -> location.function_)
+      in
+      print_s [%message "" ~addr:(addr : Int64.Hex.t) (function_ : string option)]);
+  [%expect
+    {|
+    ((addr 0xfff) (function_ ()))
+    ((addr 0x1000) (function_ (a)))
+    ((addr 0x100f) (function_ (a)))
+    ((addr 0x1010) (function_ (b)))
+    ((addr 0x102f) (function_ (b)))
+    ((addr 0x1030) (function_ ()))
+    ((addr 0x2004) (function_ (c)))
+    ((addr 0x2008) (function_ ()))
+    |}]
+  |> Deferred.return
+;;
+
+(* JITs keep appending to their perf map for as long as they run, so a [t] remembers how
+   far into the file it has parsed and [refresh] only reads what was added since. *)
+type t =
+  { filename : Filename.t
+  ; (* The device and inode of the file read so far. *)
+    mutable file_id : (int * int) option
+  ; mutable bytes_consumed : int
+  ; mutable index : Index.t
+  ; mutable warned : bool
+  }
+
+(* Parses the complete lines in [data], returning their entries sorted by address along
+   with how many bytes of [data] they span. A trailing partial line (the JIT may be midway
+   through writing it) is left to be read again next time. *)
+let parse_complete_lines data =
+  match String.rindex data '\n' with
+  | None -> [||], 0
+  | Some last_newline ->
+    let entries =
+      String.sub data ~pos:0 ~len:last_newline
+      |> String.split ~on:'\n'
+      |> Sequence.of_list
+      |> Sequence.filter_map ~f:parse_line
+      |> map_of_sequence_prefer_later
+      |> Map.data
+      |> Array.of_list
+    in
+    entries, last_newline + 1
+;;
+
+(* The file was rewritten from scratch, e.g. by a new process reusing the pid, if it's a
+   different file from the one read so far, or if it no longer has a line ending where
+   reading it stopped. *)
+let read_from filename ~file_id ~offset =
+  Monitor.try_with_or_error ~rest:`Log (fun () ->
+    In_thread.run (fun () ->
+      In_channel.with_file filename ~f:(fun in_channel ->
+        let stats = Core_unix.fstat (Core_unix.descr_of_in_channel in_channel) in
+        let new_file_id = stats.st_dev, stats.st_ino in
+        let ends_a_line () =
+          In_channel.seek in_channel (Int64.of_int (offset - 1));
+          [%equal: char option] (In_channel.input_char in_channel) (Some '\n')
+        in
+        let rewritten =
+          (not ([%equal: (int * int) option] file_id (Some new_file_id)))
+          || Int64.(stats.st_size < of_int offset)
+          || (offset > 0 && not (ends_a_line ()))
+        in
+        if rewritten
+        then `Rewritten new_file_id
+        else (
+          In_channel.seek in_channel (Int64.of_int offset);
+          `Appended (In_channel.input_all in_channel)))))
+;;
+
+let rec refresh' t =
+  match%bind read_from t.filename ~file_id:t.file_id ~offset:t.bytes_consumed with
+  | Error _ as error -> return error
+  | Ok (`Rewritten file_id) ->
+    t.file_id <- Some file_id;
+    t.bytes_consumed <- 0;
+    t.index <- Index.empty ();
+    refresh' t
+  | Ok (`Appended data) ->
+    let entries, bytes = parse_complete_lines data in
+    t.bytes_consumed <- t.bytes_consumed + bytes;
+    if not (Array.is_empty entries)
+    then t.index <- Index.merge_prefer_newer t.index entries;
+    return (Ok ())
+;;
+
+(* If the file has gone away since, keep serving what we've already read. *)
+let refresh t =
+  match%map refresh' t with
+  | Ok () -> ()
+  | Error error ->
+    if not t.warned
+    then (
+      t.warned <- true;
+      Core.eprintf
+        !"Warning: failed to refresh %s, keeping the symbols already read from it: \
+          %{Error#hum}\n%!"
+        t.filename
+        error)
+;;
+
+let load filename =
+  let t =
+    { filename
+    ; file_id = None
+    ; bytes_consumed = 0
+    ; index = Index.empty ()
+    ; warned = false
+    }
+  in
+  match%map refresh' t with
   | Error _ ->
     (* There's no perf.map file detected -- this probably isn 't a JITed executable. *)
     None
-  | Ok lines ->
-    Sequence.of_list lines
-    |> Sequence.filter_map ~f:parse_line
-    (* There can be duplicate entries in these files as JITs reuse code that is no longer useful
-       in favor of newly compiled code. (e.g. V8 does this). *)
-    |> map_of_sequence_prefer_later
-    |> Some
+  | Ok () -> Some t
 ;;
 
-let symbol (t : t) ~addr =
-  (* This assumes that code for functions can't be inside each other. If that
-     assumption is violated, this will attribute code inside both functions to the one with the
-     greater address. *)
-  match Map.closest_key t `Less_or_equal_to addr with
-  | None -> None
-  | Some (_, location) ->
-    assert (Int64.(location.start_addr <= addr));
-    Option.some_if Int64.(location.start_addr + of_int location.size < addr) location
+let symbol t ~addr = Index.symbol t.index ~addr
+
+let%expect_test "refreshing a perf map" =
+  let filename = Filename_unix.temp_file "perf-" ".map" in
+  let print_symbols t =
+    List.map [ 0x1000L; 0x2000L; 0x3000L ] ~f:(fun addr ->
+      Option.map (symbol t ~addr) ~f:(fun location -> location.function_))
+    |> [%sexp_of: string option list]
+    |> print_s
+  in
+  Out_channel.write_all filename ~data:"1000 10 a\n";
+  let%bind t = load filename >>| Option.value_exn in
+  Out_channel.with_file filename ~append:true ~f:(fun out ->
+    Out_channel.output_string out "2000 10 b\n");
+  let%bind () = refresh t in
+  print_symbols t;
+  [%expect {| ((a) (b) ()) |}];
+  (* Rewritten in place by a new process with the same pid, with more than was read. *)
+  Out_channel.write_all filename ~data:"3000 10 cc\n4000 10 dd\n";
+  let%map () = refresh t in
+  print_symbols t;
+  [%expect {| (() () (cc)) |}];
+  Core_unix.unlink filename
 ;;
 
 module Table = struct
-  type nonrec t = (Pid.t, t) Hashtbl.t
+  type nonrec t =
+    { maps : (Pid.t, t) Hashtbl.t
+    ; mutable not_yet_loaded : (Pid.t * Filename.t) list
+    ; (* Events arrive in long runs from the same thread, so remember the last pid looked
+         up and its map rather than hashing the pid every time. [last_map] is always the
+         map for [last_pid]. *)
+      mutable last_pid : Pid.t
+    ; mutable last_map : t option
+    }
 
-  let create maps =
-    List.filter_map maps ~f:(function
-      | _, None -> None
-      | pid, Some map -> Some (pid, map))
-    |> Hashtbl.of_alist_exn (module Pid)
+  let remember t pid =
+    t.last_pid <- pid;
+    t.last_map <- Hashtbl.find t.maps pid
+  ;;
+
+  let refresh_perf_map = refresh
+
+  let refresh t =
+    let%bind () =
+      Deferred.List.iter (Hashtbl.data t.maps) ~how:`Sequential ~f:refresh_perf_map
+    in
+    let%map newly_loaded =
+      Deferred.List.filter_map t.not_yet_loaded ~how:`Sequential ~f:(fun (pid, filename) ->
+        load filename >>| Option.map ~f:(fun map -> pid, map))
+    in
+    List.iter newly_loaded ~f:(fun (pid, map) -> Hashtbl.set t.maps ~key:pid ~data:map);
+    t.not_yet_loaded
+    <- List.filter t.not_yet_loaded ~f:(fun (pid, _) -> not (Hashtbl.mem t.maps pid));
+    remember t t.last_pid
+  ;;
+
+  let create sources =
+    let t =
+      { maps = Hashtbl.create (module Pid)
+      ; not_yet_loaded = sources
+      ; last_pid = Pid.init
+      ; last_map = None
+      }
+    in
+    let%map () = refresh t in
+    t
   ;;
 
   let load_by_files files =
-    Deferred.List.map files ~how:`Sequential ~f:(fun filename ->
-      load filename |> Deferred.map ~f:(fun map -> pid_of_filename filename, map))
-    >>| create
+    List.map files ~f:(fun filename -> pid_of_filename filename, filename) |> create
   ;;
 
-  let load_by_pids pids =
-    Deferred.List.map pids ~how:`Sequential ~f:(fun pid ->
-      load (default_filename ~pid) |> Deferred.map ~f:(fun map -> pid, map))
-    >>| create
+  let load_by_pids pids = List.map pids ~f:(fun pid -> pid, default_filename ~pid) |> create
+
+  let map_for_pid t pid =
+    if not (Pid.equal t.last_pid pid) then remember t pid;
+    t.last_map
   ;;
 
   let symbol t ~pid ~addr =
-    match Hashtbl.find t pid with
+    match map_for_pid t pid with
     | None -> None
     | Some map -> symbol map ~addr
   ;;
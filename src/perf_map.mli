@@ -17,6 +17,12 @@ val default_filename : pid:Pid.t -> Filename.t
 (* Returns `None` if there is no perf-map file in /tmp. *)
 val load : Filename.t -> t option Deferred.t
 
+(* Parses whatever has been appended to the file since it was last read, keeping the
+   newest entry when an address is reused. Starts over if the file was rewritten: if it's
+   a different file, shrank, or no longer has a line ending where reading it stopped.
+   Warns, once, if the file can't be read, and keeps what was already read. *)
+val refresh : t -> unit Deferred.t
+
 (* Looks up an address, returning the function that address is for. Returns `None` if that address
    is not in the perf-map file. *)
 val symbol : t -> addr:int64 -> Perf_map_location.t option
@@ -33,5 +39,9 @@ module Table : sig
       raises if any filename is not. Ignores perf maps which don't exist. *)
   val load_by_files : Filename.t list -> t Deferred.t
 
+  (** Picks up lines appended to every loaded perf map, and loads perf maps that didn't
+      exist yet when the table was created. *)
+  val refresh : t -> unit Deferred.t
+
   val symbol : t -> pid:Pid.t -> addr:int64 -> Perf_map_location.t option
 end
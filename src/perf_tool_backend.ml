@@ -603,19 +603,32 @@ module Recording = struct
 end
 
 module Decode_opts = struct
-  type t = unit
+  type t = { offline_symbolization : bool }
 
-  let param = Command.Param.return ()
+  let param =
+    let%map_open.Command offline_symbolization =
+      flag
+        "-offline-symbolization"
+        no_arg
+        ~doc:
+          "Have perf print raw addresses and memory mappings, and symbolize them in \
+           magic-trace rather than in perf. This roughly halves the amount of perf \
+           output to decode."
+      |> Util.experimental_flag ~default:false
+    in
+    { offline_symbolization }
+  ;;
 end
 
 let decode_events
       ?perf_maps
       ?(filter_same_symbol_jumps = true)
+      ?time_window
       ~debug_print_perf_commands
       ~(recording_data : Recording.Data.t option)
       ~record_dir
       ~(collection_mode : Collection_mode.t)
-      ()
+      { Decode_opts.offline_symbolization }
   =
   let%bind capabilities = Perf_capabilities.detect_exn () in
   let%bind.Deferred.Or_error dlfilter_opts =
@@ -640,6 +653,9 @@ let decode_events
     >>| Array.to_list
     >>| List.filter ~f:(String.is_prefix ~prefix:"perf.data")
   in
+  (* One symbolizer is shared by every snapshot, as [perf] only reports the mappings that
+     already exist once, at the start of the first. *)
+  let symbolizer = Option.some_if offline_symbolization (Offline_symbolizer.create ()) in
   let%map result =
     Deferred.List.map files ~how:`Sequential ~f:(fun perf_data_file ->
       let itrace_opts =
@@ -654,21 +670,31 @@ let decode_events
           [ "--itrace=be" ]
       in
       let fields_opts =
-        match collection_mode with
-        | Intel_processor_trace _ ->
+        match collection_mode, offline_symbolization with
+        | Intel_processor_trace _, false ->
           [ "-F"; "pid,tid,time,flags,ip,addr,sym,symoff,synth,dso,event,period" ]
-        | Stacktrace_sampling _ -> [ "-F"; "pid,tid,time,ip,sym,symoff,dso,event,period" ]
-        | Arm_coresight _ ->
+        | Stacktrace_sampling _, false ->
+          [ "-F"; "pid,tid,time,ip,sym,symoff,dso,event,period" ]
+        | Arm_coresight _, false ->
           (* Same fields as Intel PT — the synthetic events produced by cs_etm
              decode have the same structure. *)
           [ "-F"; "pid,tid,time,flags,ip,addr,sym,symoff,synth,dso,event,period" ]
+        | (Intel_processor_trace _ | Arm_coresight _), true ->
+          [ "-F"; "pid,tid,time,flags,ip,addr,synth,event,period" ]
+        | Stacktrace_sampling _, true -> [ "-F"; "pid,tid,time,ip,event,period" ]
       in
+      let mmap_opts = if offline_symbolization then [ "--show-mmap-events" ] else [] in
       let args =
         List.concat
           [ [ "script"; "-i"; record_dir ^/ perf_data_file; "--ns" ]
           ; itrace_opts
           ; fields_opts
+          ; mmap_opts
           ; dlfilter_opts
+          ; Option.value_map
+              time_window
+              ~default:[]
+              ~f:Time_window.Resolved.perf_script_args
           ; Option.map recording_data ~f:(fun recording_data ->
               Callgraph_mode.to_perf_script_args recording_data.callgraph_mode)
             |> Option.value ~default:[]
@@ -676,16 +702,22 @@ let decode_events
       in
       if debug_print_perf_commands
       then Core.printf "%s %s\n%!" perf (String.concat ~sep:" " args);
+      (* Runtimes keep appending to their perf maps while we record, so catch up on them
+         before decoding each snapshot. *)
+      let%bind () =
+        Option.value_map perf_maps ~default:Deferred.unit ~f:Perf_map.Table.refresh
+      in
       (* CR-someday tbrindus: this should be switched over to using
          [perf_fork_exec] to avoid the [perf script] process from outliving
          the parent. *)
       let%map perf_script_proc = Process.create_exn ~env:perf_env ~prog:perf ~args () in
-      let line_pipe = Process.stdout perf_script_proc |> Reader.lines in
       don't_wait_for
         (Reader.transfer
            (Process.stderr perf_script_proc)
            (Writer.pipe (force Writer.stderr)));
-      let events = Perf_decode.to_events ?perf_maps line_pipe in
+      let events =
+        Perf_decode.to_events ?perf_maps ?symbolizer (Process.stdout perf_script_proc)
+      in
       let close_result =
         let%map exit_or_signal = Process.wait perf_script_proc in
         perf_exit_to_or_error exit_or_signal
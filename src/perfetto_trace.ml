@@ -0,0 +1,507 @@
+open! Core
+open Trace_writer_intf
+
+(* Field numbers, from the messages in Perfetto's protos/perfetto/trace. *)
+module Trace_packet = struct
+  let clock_snapshot = 6
+  let timestamp = 8
+  let trusted_packet_sequence_id = 10
+  let track_event = 11
+  let interned_data = 12
+  let sequence_flags = 13
+  let timestamp_clock_id = 58
+  let trace_packet_defaults = 59
+  let track_descriptor = 60
+
+  (* Values of [sequence_flags] *)
+  let incremental_state_cleared = 1
+  let needs_incremental_state = 2
+end
+
+module Trace_packet_defaults = struct
+  let timestamp_clock_id = 58
+end
+
+module Clock_snapshot = struct
+  let clocks = 1
+
+  module Clock = struct
+    let clock_id = 1
+    let timestamp = 2
+    let is_incremental = 3
+  end
+end
+
+module Track_descriptor = struct
+  let uuid = 1
+  let name = 2
+  let process = 3
+  let thread = 4
+  let parent_uuid = 5
+  let counter = 8
+
+  module Process = struct
+    let pid = 1
+    let process_name = 6
+  end
+
+  module Thread = struct
+    let pid = 1
+    let tid = 2
+    let thread_name = 5
+  end
+end
+
+module Track_event = struct
+  let debug_annotations = 4
+  let type_ = 9
+  let name_iid = 10
+  let track_uuid = 11
+  let counter_value = 30
+  let double_counter_value = 44
+
+  (* Values of [type_] *)
+  let slice_begin = 1
+  let slice_end = 2
+  let instant = 3
+  let counter = 4
+end
+
+module Debug_annotation = struct
+  let name_iid = 1
+  let int_value = 4
+  let double_value = 5
+  let string_value = 6
+  let pointer_value = 7
+  let string_value_iid = 17
+end
+
+(* Every kind of interned string is a message with the [iid] and the string in these
+   fields, repeated in its own field of [InternedData]. *)
+module Interned_data = struct
+  let event_names = 2
+  let debug_annotation_names = 3
+  let debug_annotation_string_values = 29
+
+  module Entry = struct
+    let iid = 1
+    let string = 2
+  end
+end
+
+(* Packets are only interpreted in the context of the ones before them on the same
+   sequence, and everything is written on this one. *)
+let sequence_id = 1
+
+(* The clock Perfetto uses for a trace by default. *)
+let boottime_clock = 6
+
+(* Sequence-scoped clocks are numbered from 64. *)
+let incremental_clock = 64
+
+module Interned = struct
+  type t =
+    { field : int
+    ; iids : (string, int) Hashtbl.t
+    }
+
+  let create ~field = { field; iids = Hashtbl.create (module String) }
+end
+
+module Counter_track = struct
+  type t =
+    { process : int
+    ; name : string
+    }
+  [@@deriving compare, hash, sexp_of]
+end
+
+module Thread = struct
+  type t =
+    { uuid : int
+    ; process : int
+    }
+end
+
+type t =
+  { out : Out_channel.t
+  ; packet : Buffer.t
+  ; header : Buffer.t
+  ; scratch : Protobuf.scratch
+  ; event_names : Interned.t
+  ; arg_names : Interned.t
+  ; string_values : Interned.t
+  ; (* Strings interned since the last packet, to be written as part of the next one. *)
+    new_interned : (Interned.t * int * string) Queue.t
+  ; counter_tracks : (Counter_track.t, int) Hashtbl.t
+  ; (* Pids, tids and track uuids are all allocated from here, since they're never mixed
+       up in Perfetto, and processes and threads are tracks of their own. *)
+    mutable next_id : int
+  ; (* The value of [incremental_clock], in nanoseconds of trace time. *)
+    mutable clock : int
+  }
+
+let next_id t =
+  let id = t.next_id in
+  t.next_id <- id + 1;
+  id
+;;
+
+let write_packet t ~f =
+  let packet = t.packet in
+  Buffer.clear packet;
+  Protobuf.int packet ~field:Trace_packet.trusted_packet_sequence_id sequence_id;
+  f packet;
+  (* The file is a [Trace] message, which is just its [packet] field repeated. *)
+  Buffer.clear t.header;
+  Protobuf.length_delimited t.header ~field:1 ~length:(Buffer.length packet);
+  Out_channel.output_buffer t.out t.header;
+  Out_channel.output_buffer t.out packet
+;;
+
+let intern t (interned : Interned.t) string =
+  match Hashtbl.find interned.iids string with
+  | Some iid -> iid
+  | None ->
+    let iid = Hashtbl.length interned.iids + 1 in
+    Hashtbl.add_exn interned.iids ~key:string ~data:iid;
+    Queue.enqueue t.new_interned (interned, iid, string);
+    iid
+;;
+
+let write_interned_data t packet =
+  if not (Queue.is_empty t.new_interned)
+  then (
+    Protobuf.message t.scratch packet ~field:Trace_packet.interned_data ~f:(fun data ->
+      Queue.iter t.new_interned ~f:(fun ((interned : Interned.t), iid, string) ->
+        Protobuf.message t.scratch data ~field:interned.field ~f:(fun entry ->
+          Protobuf.int entry ~field:Interned_data.Entry.iid iid;
+          Protobuf.string entry ~field:Interned_data.Entry.string string)));
+    Queue.clear t.new_interned)
+;;
+
+(* Timestamps are written as the time since the previous one on [incremental_clock], which
+   usually takes a byte or two rather than five. Events which go back in time are written
+   against [boottime_clock] instead, which the incremental clock starts in step with. *)
+let write_timestamp t packet time =
+  let time = Int.max 0 (Time_ns.Span.to_int_ns time) in
+  if time >= t.clock
+  then (
+    Protobuf.int packet ~field:Trace_packet.timestamp (time - t.clock);
+    t.clock <- time)
+  else (
+    Protobuf.int packet ~field:Trace_packet.timestamp time;
+    Protobuf.int packet ~field:Trace_packet.timestamp_clock_id boottime_clock)
+;;
+
+let write_track_descriptor t ~f =
+  write_packet t ~f:(fun packet ->
+    Protobuf.message t.scratch packet ~field:Trace_packet.track_descriptor ~f)
+;;
+
+let write_event t ~track ~type_ ~time ~f =
+  write_packet t ~f:(fun packet ->
+    write_timestamp t packet time;
+    Protobuf.int
+      packet
+      ~field:Trace_packet.sequence_flags
+      Trace_packet.needs_incremental_state;
+    Protobuf.message t.scratch packet ~field:Trace_packet.track_event ~f:(fun event ->
+      Protobuf.int event ~field:Track_event.type_ type_;
+      Protobuf.int event ~field:Track_event.track_uuid track;
+      f event);
+    write_interned_data t packet)
+;;
+
+let write_debug_annotation t event (name, (value : Tracing.Trace.Arg.value)) =
+  Protobuf.message t.scratch event ~field:Track_event.debug_annotations ~f:(fun annotation ->
+    Protobuf.int annotation ~field:Debug_annotation.name_iid (intern t t.arg_names name);
+    match value with
+    | Interned string ->
+      Protobuf.int
+        annotation
+        ~field:Debug_annotation.string_value_iid
+        (intern t t.string_values string)
+    | String string -> Protobuf.string annotation ~field:Debug_annotation.string_value string
+    | Int int -> Protobuf.int annotation ~field:Debug_annotation.int_value int
+    | Int64 int -> Protobuf.int64 annotation ~field:Debug_annotation.int_value int
+    | Pointer pointer ->
+      Protobuf.int64 annotation ~field:Debug_annotation.pointer_value pointer
+    | Float float -> Protobuf.double annotation ~field:Debug_annotation.double_value float)
+;;
+
+let write_slice_event t ~(thread : Thread.t) ~type_ ~name ~args ~time =
+  write_event t ~track:thread.uuid ~type_ ~time ~f:(fun event ->
+    Option.iter name ~f:(fun name ->
+      Protobuf.int event ~field:Track_event.name_iid (intern t t.event_names name));
+    List.iter args ~f:(write_debug_annotation t event))
+;;
+
+let counter_track t ~(thread : Thread.t) ~name =
+  Hashtbl.find_or_add
+    t.counter_tracks
+    { Counter_track.process = thread.process; name }
+    ~default:(fun () ->
+      let uuid = next_id t in
+      write_track_descriptor t ~f:(fun track ->
+        Protobuf.int track ~field:Track_descriptor.uuid uuid;
+        Protobuf.int track ~field:Track_descriptor.parent_uuid thread.process;
+        Protobuf.string track ~field:Track_descriptor.name name;
+        Protobuf.message t.scratch track ~field:Track_descriptor.counter ~f:ignore);
+      uuid)
+;;
+
+let create ~filename =
+  let t =
+    { out = Out_channel.create filename
+    ; packet = Buffer.create 256
+    ; header = Buffer.create 16
+    ; scratch = Protobuf.create_scratch ()
+    ; event_names = Interned.create ~field:Interned_data.event_names
+    ; arg_names = Interned.create ~field:Interned_data.debug_annotation_names
+    ; string_values = Interned.create ~field:Interned_data.debug_annotation_string_values
+    ; new_interned = Queue.create ()
+    ; counter_tracks = Hashtbl.create (module Counter_track)
+    ; next_id = 1
+    ; clock = 0
+    }
+  in
+  write_packet t ~f:(fun packet ->
+    Protobuf.int
+      packet
+      ~field:Trace_packet.sequence_flags
+      Trace_packet.incremental_state_cleared;
+    Protobuf.message
+      t.scratch
+      packet
+      ~field:Trace_packet.trace_packet_defaults
+      ~f:(fun defaults ->
+        Protobuf.int
+          defaults
+          ~field:Trace_packet_defaults.timestamp_clock_id
+          incremental_clock);
+    Protobuf.message t.scratch packet ~field:Trace_packet.clock_snapshot ~f:(fun snapshot ->
+      List.iter
+        [ boottime_clock, false; incremental_clock, true ]
+        ~f:(fun (clock_id, is_incremental) ->
+          Protobuf.message t.scratch snapshot ~field:Clock_snapshot.clocks ~f:(fun clock ->
+            Protobuf.int clock ~field:Clock_snapshot.Clock.clock_id clock_id;
+            Protobuf.int clock ~field:Clock_snapshot.Clock.timestamp 0;
+            if is_incremental
+            then Protobuf.int clock ~field:Clock_snapshot.Clock.is_incremental 1))));
+  t
+;;
+
+let to_trace t =
+  let module Perfetto = struct
+    type thread = Thread.t
+
+    let allocate_pid ~name =
+      let pid = next_id t in
+      write_track_descriptor t ~f:(fun track ->
+        Protobuf.int track ~field:Track_descriptor.uuid pid;
+        Protobuf.message t.scratch track ~field:Track_descriptor.process ~f:(fun process ->
+          Protobuf.int process ~field:Track_descriptor.Process.pid pid;
+          Protobuf.string process ~field:Track_descriptor.Process.process_name name));
+      pid
+    ;;
+
+    let allocate_thread ~pid ~name =
+      let tid = next_id t in
+      write_track_descriptor t ~f:(fun track ->
+        Protobuf.int track ~field:Track_descriptor.uuid tid;
+        Protobuf.int track ~field:Track_descriptor.parent_uuid pid;
+        Protobuf.message t.scratch track ~field:Track_descriptor.thread ~f:(fun thread ->
+          Protobuf.int thread ~field:Track_descriptor.Thread.pid pid;
+          Protobuf.int thread ~field:Track_descriptor.Thread.tid tid;
+          Protobuf.string thread ~field:Track_descriptor.Thread.thread_name name));
+      { Thread.uuid = tid; process = pid }
+    ;;
+
+    let write_duration_begin ~args ~thread ~name ~time =
+      write_slice_event
+        t
+        ~thread
+        ~type_:Track_event.slice_begin
+        ~name:(Some name)
+        ~args
+        ~time
+    ;;
+
+    (* Perfetto ends the innermost slice on the track, so the name needn't be repeated. *)
+    let write_duration_end ~args ~thread ~name:_ ~time =
+      write_slice_event t ~thread ~type_:Track_event.slice_end ~name:None ~args ~time
+    ;;
+
+    let write_duration_complete ~args ~thread ~name ~time ~time_end =
+      write_duration_begin ~args ~thread ~name ~time;
+      write_duration_end ~args:[] ~thread ~name ~time:time_end
+    ;;
+
+    let write_duration_instant ~args ~thread ~name ~time =
+      write_slice_event t ~thread ~type_:Track_event.instant ~name:(Some name) ~args ~time
+    ;;
+
+    (* Each argument is a separate counter, with its own track. *)
+    let write_counter ~args ~thread ~name ~time =
+      List.iter args ~f:(fun (arg_name, (value : Tracing.Trace.Arg.value)) ->
+        let write_value =
+          match value with
+          | Int int ->
+            Some (fun event -> Protobuf.int event ~field:Track_event.counter_value int)
+          | Int64 int ->
+            Some (fun event -> Protobuf.int64 event ~field:Track_event.counter_value int)
+          | Float float ->
+            Some
+              (fun event ->
+                Protobuf.double event ~field:Track_event.double_counter_value float)
+          | Interned _ | String _ | Pointer _ -> None
+        in
+        Option.iter write_value ~f:(fun write_value ->
+          let track = counter_track t ~thread ~name:[%string "%{name} %{arg_name}"] in
+          write_event t ~track ~type_:Track_event.counter ~time ~f:write_value))
+    ;;
+  end
+  in
+  (module Perfetto : S_trace with type thread = Thread.t)
+;;
+
+let close t = Out_channel.close t.out
+
+let%expect_test "packets" =
+  (* Prints the fields of each packet, indented by nesting, taking any printable bytes
+     to be a string rather than a message. *)
+  let print_packets contents =
+    let pos = ref 0 in
+    let varint () =
+      let rec loop ~shift acc =
+        let byte = Char.to_int contents.[!pos] in
+        incr pos;
+        let acc = acc lor ((byte land 0x7f) lsl shift) in
+        if byte land 0x80 = 0 then acc else loop ~shift:(shift + 7) acc
+      in
+      loop ~shift:0 0
+    in
+    let rec print_fields ~end_ ~indent =
+      while !pos < end_ do
+        let key = varint () in
+        let field = key lsr 3 in
+        match key land 7 with
+        | 0 -> printf "%s%d: %d\n" indent field (varint ())
+        | 2 ->
+          let length = varint () in
+          let value = String.sub contents ~pos:!pos ~len:length in
+          if String.for_all value ~f:Char.is_print
+          then (
+            printf "%s%d: %S\n" indent field value;
+            pos := !pos + length)
+          else (
+            printf "%s%d\n" indent field;
+            print_fields ~end_:(!pos + length) ~indent:(indent ^ "  "))
+        | wire_type -> raise_s [%message "Unexpected wire type" (wire_type : int)]
+      done
+    in
+    print_fields ~end_:(String.length contents) ~indent:""
+  in
+  let filename = Filename_unix.temp_file "magic-trace" ".pftrace" in
+  let t = create ~filename in
+  let module T = (val to_trace t) in
+  let thread = T.allocate_thread ~pid:(T.allocate_pid ~name:"process") ~name:"thread" in
+  let at ns = Time_ns.Span.of_int_ns ns in
+  let args = Tracing.Trace.Arg.[ "symbol", Interned "f"; "line", Int 3 ] in
+  T.write_duration_begin ~args ~thread ~name:"f" ~time:(at 1000);
+  T.write_duration_end ~args:[] ~thread ~name:"f" ~time:(at 1200);
+  (* Goes back in time, so is written against the boot clock. *)
+  T.write_duration_complete ~args ~thread ~name:"f" ~time:(at 1100) ~time_end:(at 1300);
+  close t;
+  print_packets (In_channel.read_all filename);
+  Core_unix.unlink filename;
+  [%expect
+    {|
+    1
+      10: 1
+      13: 1
+      59
+        58: 64
+      6
+        1
+          1: 6
+          2: 0
+        1
+          1: 64
+          2: 0
+          3: 1
+    1
+      10: 1
+      60
+        1: 1
+        3
+          1: 1
+          6: "process"
+    1
+      10: 1
+      60
+        1: 2
+        5: 1
+        4
+          1: 1
+          2: 2
+          5: "thread"
+    1
+      10: 1
+      8: 1000
+      13: 2
+      11
+        9: 1
+        11: 2
+        10: 1
+        4
+          1: 1
+          17: 1
+        4
+          1: 2
+          4: 3
+      12
+        2
+          1: 1
+          2: "f"
+        3
+          1: 1
+          2: "symbol"
+        29
+          1: 1
+          2: "f"
+        3
+          1: 2
+          2: "line"
+    1
+      10: 1
+      8: 200
+      13: 2
+      11
+        9: 2
+        11: 2
+    1
+      10: 1
+      8: 1100
+      58: 6
+      13: 2
+      11
+        9: 1
+        11: 2
+        10: 1
+        4
+          1: 1
+          17: 1
+        4
+          1: 2
+          4: 3
+    1
+      10: 1
+      8: 100
+      13: 2
+      11
+        9: 2
+        11: 2
+    |}]
+;;
@@ -0,0 +1,19 @@
+open! Core
+open Trace_writer_intf
+
+(** Writes a trace as Perfetto's own protobuf format rather than Fuchsia's, which Perfetto
+    imports a good deal faster and which has no limit on the number of interned strings.
+
+    Events are [TrackEvent]s on one packet sequence, with event names, argument names and
+    [Interned] argument values (e.g. symbols and files) interned in the sequence's
+    [InternedData], and timestamps delta-encoded on an incremental clock. *)
+
+module Thread : sig
+  type t
+end
+
+type t
+
+val create : filename:string -> t
+val to_trace : t -> (module S_trace with type thread = Thread.t)
+val close : t -> unit
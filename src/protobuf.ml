@@ -0,0 +1,73 @@
+open! Core
+
+let rec varint64 buf n =
+  if Int64.(n >= 0L && n < 0x80L)
+  then Buffer.add_char buf (Char.of_int_exn (Int64.to_int_exn n))
+  else (
+    Buffer.add_char
+      buf
+      (Char.of_int_exn (Int64.to_int_exn Int64.((n land 0x7fL) lor 0x80L)));
+    varint64 buf (Int64.shift_right_logical n 7))
+;;
+
+let rec varint buf n =
+  if n < 0
+  then varint64 buf (Int64.of_int n)
+  else if n < 0x80
+  then Buffer.add_char buf (Char.of_int_exn n)
+  else (
+    Buffer.add_char buf (Char.of_int_exn ((n land 0x7f) lor 0x80));
+    varint buf (n lsr 7))
+;;
+
+let tag buf ~field ~wire_type = varint buf ((field lsl 3) lor wire_type)
+
+let int buf ~field n =
+  tag buf ~field ~wire_type:0;
+  varint buf n
+;;
+
+let int64 buf ~field n =
+  tag buf ~field ~wire_type:0;
+  varint64 buf n
+;;
+
+let double buf ~field x =
+  tag buf ~field ~wire_type:1;
+  let bits = Int64.bits_of_float x in
+  for i = 0 to 7 do
+    let byte = Int64.(shift_right_logical bits Int.(8 * i) land 0xffL) in
+    Buffer.add_char buf (Char.of_int_exn (Int64.to_int_exn byte))
+  done
+;;
+
+let length_delimited buf ~field ~length =
+  tag buf ~field ~wire_type:2;
+  varint buf length
+;;
+
+let string buf ~field s =
+  length_delimited buf ~field ~length:(String.length s);
+  Buffer.add_string buf s
+;;
+
+type scratch = Buffer.t Stack.t
+
+let create_scratch () = Stack.create ()
+
+let message (scratch : scratch) buf ~field ~f =
+  let sub =
+    match Stack.pop scratch with
+    | Some sub -> sub
+    | None -> Buffer.create 256
+  in
+  f sub;
+  length_delimited buf ~field ~length:(Buffer.length sub);
+  Buffer.add_buffer buf sub;
+  Buffer.clear sub;
+  Stack.push scratch sub
+;;
+
+let packed_ints scratch buf ~field ints =
+  message scratch buf ~field ~f:(fun packed -> List.iter ints ~f:(varint packed))
+;;
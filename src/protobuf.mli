@@ -0,0 +1,24 @@
+open! Core
+
+(** Just enough of the protobuf wire format to write Perfetto's and pprof's messages.
+    Each function appends a field with the given field number to a buffer. *)
+
+val varint : Buffer.t -> int -> unit
+val int : Buffer.t -> field:int -> int -> unit
+val int64 : Buffer.t -> field:int -> int64 -> unit
+val double : Buffer.t -> field:int -> float -> unit
+val string : Buffer.t -> field:int -> string -> unit
+
+(** The header of a length-delimited field, to be followed by [length] bytes. *)
+val length_delimited : Buffer.t -> field:int -> length:int -> unit
+
+(** Buffers to write nested messages to, since a message's length has to precede it. *)
+type scratch
+
+val create_scratch : unit -> scratch
+
+(** Writes a nested message, with [f] writing its fields. *)
+val message : scratch -> Buffer.t -> field:int -> f:(Buffer.t -> unit) -> unit
+
+(** A repeated integer field, packed into one length-delimited field. *)
+val packed_ints : scratch -> Buffer.t -> field:int -> int list -> unit
@@ -0,0 +1,419 @@
+open! Core
+open Trace_writer_intf
+
+module Limits = struct
+  type t =
+    { max_bytes : int option
+    ; max_duration : Time_ns.Span.t option
+    }
+
+  let param =
+    let%map_open.Command max_megabytes =
+      flag
+        "-rollover-size"
+        (optional int)
+        ~doc:
+          "MB Start a new trace file whenever the current one holds this many megabytes \
+           of trace data (before compression)."
+      |> Util.experimental_flag ~default:None
+    and max_duration =
+      flag
+        "-rollover-duration"
+        (optional (Command.Arg_type.create Time_ns.Span.of_string))
+        ~doc:
+          "DURATION Start a new trace file whenever the current one covers this much \
+           trace time (e.g. 500ms)."
+      |> Util.experimental_flag ~default:None
+    in
+    match max_megabytes, max_duration with
+    | None, None -> None
+    | _ ->
+      Some
+        { max_bytes = Option.map max_megabytes ~f:(fun megabytes -> megabytes lsl 20)
+        ; max_duration
+        }
+  ;;
+end
+
+module Manifest = struct
+  module File = struct
+    type t =
+      { filename : string
+      ; start : Time_ns.Span.t
+      ; end_ : Time_ns.Span.t
+      }
+    [@@deriving sexp]
+  end
+
+  type t =
+    { base_time : Time_ns_unix.t
+    ; files : File.t list
+    }
+  [@@deriving sexp]
+end
+
+module Process = struct
+  type t =
+    { name : string
+    ; mutable pid : int
+    }
+end
+
+module Thread = struct
+  type t =
+    { process : int
+    ; name : string
+    ; mutable thread : Tracing.Trace.Thread.t
+    ; (* Spans begun but not yet ended, innermost on top. *)
+      open_spans : (string * Tracing.Trace.Arg.t list) Stack.t
+    }
+end
+
+module Chunk = struct
+  type t =
+    { filename : string
+    ; trace : Tracing.Trace.t
+    ; bytes_written : int ref
+    ; mutable start : Time_ns.Span.t option
+    ; mutable end_ : Time_ns.Span.t
+    }
+end
+
+type t =
+  { limits : Limits.t
+  ; output_path : string
+  ; file_format : Tracing_zero.Writer.File_format.t
+  ; num_temp_strs : int option
+  ; processes : Process.t Queue.t
+  ; threads : Thread.t Queue.t
+  ; mutable base_time : Time_ns.t
+  ; mutable chunk : Chunk.t option
+  ; mutable files : Manifest.File.t list
+  }
+
+let create ?num_temp_strs limits ~output_path ~file_format =
+  { limits
+  ; output_path
+  ; file_format
+  ; num_temp_strs
+  ; processes = Queue.create ()
+  ; threads = Queue.create ()
+  ; base_time = Time_ns.epoch
+  ; chunk = None
+  ; files = []
+  }
+;;
+
+(* [dir/trace.fxt.gz] is split into [dir/trace.000.fxt.gz], [dir/trace.001.fxt.gz]... *)
+let split_output_path t =
+  let dir, basename = Filename.split t.output_path in
+  let stem, extensions =
+    match String.lsplit2 basename ~on:'.' with
+    | None -> basename, ""
+    | Some (stem, extensions) -> stem, "." ^ extensions
+  in
+  dir, stem, extensions
+;;
+
+let chunk_filename t index =
+  let dir, stem, extensions = split_output_path t in
+  Filename.concat dir (sprintf "%s.%03d%s" stem index extensions)
+;;
+
+let manifest_filename t =
+  let dir, stem, (_ : string) = split_output_path t in
+  Filename.concat dir (stem ^ ".manifest.sexp")
+;;
+
+(* Counts the bytes the writer hands to the file, before any compression. *)
+let counting_destination
+  (module D : Tracing_zero.Writer.Expert.Destination)
+  ~bytes_written
+  =
+  let module Counting = struct
+    let next_buf = D.next_buf
+
+    let wrote_bytes count =
+      bytes_written := !bytes_written + count;
+      D.wrote_bytes count
+    ;;
+
+    let close = D.close
+  end
+  in
+  (module Counting : Tracing_zero.Writer.Expert.Destination)
+;;
+
+(* Each file gets its own writer, so its strings are interned afresh, and every process
+   and thread allocated so far is written to it again. *)
+let open_chunk t =
+  let filename = chunk_filename t (List.length t.files) in
+  let bytes_written = ref 0 in
+  let destination =
+    counting_destination
+      (Tracing_zero.Destinations.file_destination ~file_format:t.file_format ~filename ())
+      ~bytes_written
+  in
+  let trace =
+    Tracing.Trace.Expert.create
+      ~base_time:(Some t.base_time)
+      (Tracing_zero.Writer.Expert.create ?num_temp_strs:t.num_temp_strs ~destination ())
+  in
+  Queue.iter t.processes ~f:(fun (process : Process.t) ->
+    process.pid <- Tracing.Trace.allocate_pid trace ~name:process.name);
+  Queue.iter t.threads ~f:(fun (thread : Thread.t) ->
+    thread.thread
+    <- Tracing.Trace.allocate_thread
+         trace
+         ~pid:(Queue.get t.processes thread.process).pid
+         ~name:thread.name);
+  let chunk =
+    { Chunk.filename; trace; bytes_written; start = None; end_ = Time_ns.Span.zero }
+  in
+  t.chunk <- Some chunk;
+  chunk
+;;
+
+let close_chunk t (chunk : Chunk.t) =
+  Tracing.Trace.close chunk.trace;
+  let start = Option.value chunk.start ~default:chunk.end_ in
+  t.files
+  <- { Manifest.File.filename = chunk.filename; start; end_ = chunk.end_ } :: t.files;
+  t.chunk <- None
+;;
+
+(* Spans still open are ended at [time] in the old file and begun again in the new one,
+   so each file is well nested on its own. *)
+let roll t (chunk : Chunk.t) ~time =
+  Queue.iter t.threads ~f:(fun (thread : Thread.t) ->
+    Stack.iter thread.open_spans ~f:(fun (name, (_ : Tracing.Trace.Arg.t list)) ->
+      Tracing.Trace.write_duration_end
+        chunk.trace
+        ~args:[]
+        ~thread:thread.thread
+        ~category:""
+        ~name
+        ~time));
+  if Queue.exists t.threads ~f:(fun (thread : Thread.t) ->
+       not (Stack.is_empty thread.open_spans))
+  then chunk.end_ <- Time_ns.Span.max chunk.end_ time;
+  close_chunk t chunk;
+  let chunk = open_chunk t in
+  chunk.start <- Some time;
+  Queue.iter t.threads ~f:(fun (thread : Thread.t) ->
+    List.iter
+      (List.rev (Stack.to_list thread.open_spans))
+      ~f:(fun (name, args) ->
+        Tracing.Trace.write_duration_begin
+          chunk.trace
+          ~args
+          ~thread:thread.thread
+          ~category:""
+          ~name
+          ~time));
+  chunk
+;;
+
+let is_full t (chunk : Chunk.t) ~start ~time =
+  (match t.limits.max_bytes with
+   | None -> false
+   | Some max_bytes -> !(chunk.bytes_written) >= max_bytes)
+  ||
+  (match t.limits.max_duration with
+   | None -> false
+   | Some max_duration ->
+     Time_ns.Span.( >= ) (Time_ns.Span.( - ) time start) max_duration)
+;;
+
+(* The file to write an event at [time] to, starting a new one if the current one is
+   full and [can_roll]. *)
+let chunk_for_event ?(can_roll = true) t ~time ~time_end =
+  let chunk = Option.value_exn t.chunk in
+  let chunk =
+    match chunk.start with
+    | None ->
+      chunk.start <- Some time;
+      chunk
+    | Some start ->
+      if can_roll && is_full t chunk ~start ~time then roll t chunk ~time else chunk
+  in
+  chunk.end_ <- Time_ns.Span.max chunk.end_ time_end;
+  chunk
+;;
+
+let start t ~base_time =
+  t.base_time <- base_time;
+  ignore (open_chunk t : Chunk.t);
+  let module Rolling = struct
+    type thread = Thread.t
+
+    let allocate_pid ~name =
+      let chunk = Option.value_exn t.chunk in
+      Queue.enqueue
+        t.processes
+        { Process.name; pid = Tracing.Trace.allocate_pid chunk.trace ~name };
+      Queue.length t.processes - 1
+    ;;
+
+    let allocate_thread ~pid:process ~name =
+      let chunk = Option.value_exn t.chunk in
+      let thread =
+        { Thread.process
+        ; name
+        ; thread =
+            Tracing.Trace.allocate_thread
+              chunk.trace
+              ~pid:(Queue.get t.processes process).pid
+              ~name
+        ; open_spans = Stack.create ()
+        }
+      in
+      Queue.enqueue t.threads thread;
+      thread
+    ;;
+
+    let write_duration_begin ~args ~(thread : thread) ~name ~time =
+      let chunk = chunk_for_event t ~time ~time_end:time in
+      Stack.push thread.open_spans (name, args);
+      Tracing.Trace.write_duration_begin
+        chunk.trace
+        ~args
+        ~thread:thread.thread
+        ~category:""
+        ~name
+        ~time
+    ;;
+
+    (* Ending a span never starts a new file, or the span would be begun again in the
+       new file only to end there at once. *)
+    let write_duration_end ~args ~(thread : thread) ~name ~time =
+      let chunk = chunk_for_event t ~time ~time_end:time ~can_roll:false in
+      ignore (Stack.pop thread.open_spans : _ option);
+      Tracing.Trace.write_duration_end
+        chunk.trace
+        ~args
+        ~thread:thread.thread
+        ~category:""
+        ~name
+        ~time
+    ;;
+
+    let write_duration_complete ~args ~(thread : thread) ~name ~time ~time_end =
+      let chunk = chunk_for_event t ~time ~time_end in
+      Tracing.Trace.write_duration_complete
+        chunk.trace
+        ~args
+        ~thread:thread.thread
+        ~category:""
+        ~name
+        ~time
+        ~time_end
+    ;;
+
+    let write_duration_instant ~args ~(thread : thread) ~name ~time =
+      let chunk = chunk_for_event t ~time ~time_end:time in
+      Tracing.Trace.write_duration_instant
+        chunk.trace
+        ~args
+        ~thread:thread.thread
+        ~category:""
+        ~name
+        ~time
+    ;;
+
+    let write_counter ~args ~(thread : thread) ~name ~time =
+      let chunk = chunk_for_event t ~time ~time_end:time in
+      Tracing.Trace.write_counter
+        chunk.trace
+        ~args
+        ~thread:thread.thread
+        ~category:""
+        ~name
+        ~time
+    ;;
+  end
+  in
+  (module Rolling : S_trace with type thread = Thread.t)
+;;
+
+let close t =
+  Option.iter t.chunk ~f:(close_chunk t);
+  let manifest = { Manifest.base_time = t.base_time; files = List.rev t.files } in
+  Sexp.save_hum (manifest_filename t) [%sexp (manifest : Manifest.t)]
+;;
+
+let num_files t = List.length t.files
+
+let%expect_test "rolling over by trace time" =
+  let dir = Filename_unix.temp_dir "magic-trace" "rolling" in
+  let t =
+    create
+      { Limits.max_bytes = None; max_duration = Some (Time_ns.Span.of_int_ns 100) }
+      ~output_path:(dir ^/ "trace.fxt")
+      ~file_format:Uncompressed
+  in
+  let module T = (val start t ~base_time:Time_ns.epoch) in
+  let thread = T.allocate_thread ~pid:(T.allocate_pid ~name:"process") ~name:"thread" in
+  let at ns = Time_ns.Span.of_int_ns ns in
+  T.write_duration_begin ~args:[] ~thread ~name:"outer" ~time:(at 0);
+  T.write_duration_complete
+    ~args:[]
+    ~thread
+    ~name:"inner"
+    ~time:(at 50)
+    ~time_end:(at 90);
+  T.write_duration_begin ~args:[] ~thread ~name:"middle" ~time:(at 120);
+  T.write_duration_end ~args:[] ~thread ~name:"middle" ~time:(at 150);
+  T.write_duration_end ~args:[] ~thread ~name:"outer" ~time:(at 230);
+  T.write_duration_complete
+    ~args:[]
+    ~thread
+    ~name:"last"
+    ~time:(at 260)
+    ~time_end:(at 270);
+  close t;
+  let { Manifest.files; base_time = _ } =
+    Sexp.load_sexp_conv_exn (manifest_filename t) [%of_sexp: Manifest.t]
+  in
+  List.iter files ~f:(fun { Manifest.File.filename; start; end_ } ->
+    print_s
+      [%message
+        (Filename.basename filename)
+          ~start:(Time_ns.Span.to_int_ns start : int)
+          ~end_:(Time_ns.Span.to_int_ns end_ : int)];
+    let parser = Tracing.Parser.create (Iobuf.of_string (In_channel.read_all filename)) in
+    let rec print_events () =
+      match Tracing.Parser.parse_next parser with
+      | Error (_ : Tracing.Parser.Parse_error.t) -> ()
+      | Ok (Event { timestamp; name; event_type; _ }) ->
+        let name = Tracing.Parser.lookup_string_exn parser ~index:name in
+        let event_type =
+          match event_type with
+          | Duration_begin -> "begin"
+          | Duration_end -> "end"
+          | Duration_complete _ -> "complete"
+          | _ -> "other"
+        in
+        printf "  %s %s @%d\n" event_type name (Time_ns.Span.to_int_ns timestamp);
+        print_events ()
+      | Ok (_ : Tracing.Parser.Record.t) -> print_events ()
+    in
+    print_events ();
+    Core_unix.unlink filename);
+  Core_unix.unlink (manifest_filename t);
+  Core_unix.rmdir dir;
+  [%expect
+    {|
+    (trace.000.fxt (start 0) (end_ 120))
+      begin outer @0
+      complete inner @50
+      end outer @120
+    (trace.001.fxt (start 120) (end_ 230))
+      begin outer @120
+      begin middle @120
+      end middle @150
+      end outer @230
+    (trace.002.fxt (start 260) (end_ 270))
+      complete last @260
+    |}]
+;;
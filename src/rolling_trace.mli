@@ -0,0 +1,45 @@
+open! Core
+open Trace_writer_intf
+
+(** Writes a trace as a series of files, starting a new one whenever the current one
+    reaches a size or covers a span of trace time, so that very long recordings can still
+    be loaded in Perfetto one piece at a time.
+
+    Every file stands on its own: it repeats all the process and thread records, interns
+    its own strings, and ends any spans still open when it's cut off, which the next file
+    begins again. Files are only cut off before an event that doesn't end a span. A
+    manifest alongside lists each file with the trace time it covers. *)
+
+module Limits : sig
+  type t =
+    { max_bytes : int option
+    ; max_duration : Time_ns.Span.t option
+    }
+
+  (** [None] unless one of [-rollover-size] or [-rollover-duration] is given. *)
+  val param : t option Command.Param.t
+end
+
+module Thread : sig
+  type t
+end
+
+type t
+
+(** Files are named after [output_path] with a sequence number before its extensions,
+    e.g. [trace.000.fxt.gz] for [trace.fxt.gz]. The manifest is [trace.manifest.sexp]. *)
+val create
+  :  ?num_temp_strs:int
+  -> Limits.t
+  -> output_path:string
+  -> file_format:Tracing_zero.Writer.File_format.t
+  -> t
+
+(** Opens the first file. Must be called once, before anything is written. *)
+val start : t -> base_time:Time_ns.t -> (module S_trace with type thread = Thread.t)
+
+(** Closes the last file and writes the manifest. *)
+val close : t -> unit
+
+val manifest_filename : t -> string
+val num_files : t -> int
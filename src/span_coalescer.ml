@@ -0,0 +1,264 @@
+open! Core
+open Trace_writer_intf
+
+module Span = struct
+  type t =
+    { name : string
+    ; args : Tracing.Trace.Arg.t list
+    ; time : Time_ns.Span.t
+    }
+end
+
+(* Consecutive leaf spans with the same parent, to be written as one span. *)
+module Run = struct
+  type t =
+    { first : Span.t
+    ; (* The end of the last span. *)
+      mutable last_end : Span.t
+    ; mutable count : int
+    ; mutable total : Time_ns.Span.t
+    ; mutable min : Time_ns.Span.t
+    ; mutable max : Time_ns.Span.t
+    ; mutable same_name : bool
+    ; mutable all_short : bool
+    }
+
+  let create ~(start : Span.t) ~(end_ : Span.t) ~duration ~is_short =
+    { first = start
+    ; last_end = end_
+    ; count = 1
+    ; total = duration
+    ; min = duration
+    ; max = duration
+    ; same_name = true
+    ; all_short = is_short
+    }
+  ;;
+
+  let can_extend t ~(start : Span.t) ~is_short =
+    (t.same_name && String.equal t.first.name start.name) || (is_short && t.all_short)
+  ;;
+
+  let extend t ~(start : Span.t) ~(end_ : Span.t) ~duration ~is_short =
+    t.last_end <- end_;
+    t.count <- t.count + 1;
+    t.total <- Time_ns.Span.( + ) t.total duration;
+    t.min <- Time_ns.Span.min t.min duration;
+    t.max <- Time_ns.Span.max t.max duration;
+    t.same_name <- t.same_name && String.equal t.first.name start.name;
+    t.all_short <- t.all_short && is_short
+  ;;
+end
+
+module Thread = struct
+  type 'thread t =
+    { thread : 'thread
+    ; (* A span which has begun with nothing inside it yet, so may turn out to be a
+         leaf. *)
+      mutable leaf_candidate : Span.t option
+    ; mutable run : Run.t option
+    }
+end
+
+type 'thread t =
+  { trace : (module S_trace with type thread = 'thread)
+  ; min_duration : Time_ns.Span.t
+  ; mutable threads : 'thread Thread.t list
+  }
+
+let create ~min_duration trace = { trace; min_duration; threads = [] }
+
+let write_run (type thread) (t : thread t) (thread : thread Thread.t) (run : Run.t) =
+  let module T = (val t.trace) in
+  if run.count = 1
+  then (
+    T.write_duration_begin
+      ~args:run.first.args
+      ~thread:thread.thread
+      ~name:run.first.name
+      ~time:run.first.time;
+    T.write_duration_end
+      ~args:run.last_end.args
+      ~thread:thread.thread
+      ~name:run.last_end.name
+      ~time:run.last_end.time)
+  else (
+    let name =
+      if run.same_name then run.first.name else [%string "[%{run.count#Int} short calls]"]
+    in
+    let args =
+      Tracing.Trace.Arg.
+        [ "count", Int run.count
+        ; "total_ns", Int (Time_ns.Span.to_int_ns run.total)
+        ; "min_ns", Int (Time_ns.Span.to_int_ns run.min)
+        ; "max_ns", Int (Time_ns.Span.to_int_ns run.max)
+        ]
+    in
+    let args = if run.same_name then args @ run.first.args else args in
+    T.write_duration_complete
+      ~args
+      ~thread:thread.thread
+      ~name
+      ~time:run.first.time
+      ~time_end:run.last_end.time)
+;;
+
+let flush_run t (thread : _ Thread.t) =
+  Option.iter thread.run ~f:(write_run t thread);
+  thread.run <- None
+;;
+
+(* Writes everything held back on [thread], since whatever is written next can't join
+   it. *)
+let flush_thread (type thread) (t : thread t) (thread : thread Thread.t) =
+  let module T = (val t.trace) in
+  flush_run t thread;
+  Option.iter thread.leaf_candidate ~f:(fun { Span.name; args; time } ->
+    T.write_duration_begin ~args ~thread:thread.thread ~name ~time);
+  thread.leaf_candidate <- None
+;;
+
+let flush t = List.iter t.threads ~f:(flush_thread t)
+
+let add_leaf t (thread : _ Thread.t) ~(start : Span.t) ~(end_ : Span.t) =
+  let duration = Time_ns.Span.( - ) end_.time start.time in
+  let is_short = Time_ns.Span.( < ) duration t.min_duration in
+  match thread.run with
+  | Some run when Run.can_extend run ~start ~is_short ->
+    Run.extend run ~start ~end_ ~duration ~is_short
+  | Some _ | None ->
+    flush_run t thread;
+    thread.run <- Some (Run.create ~start ~end_ ~duration ~is_short)
+;;
+
+let to_trace (type thread) (t : thread t) =
+  let module T = (val t.trace) in
+  let module Coalesced = struct
+    type nonrec thread = thread Thread.t
+
+    let allocate_pid = T.allocate_pid
+
+    let allocate_thread ~pid ~name =
+      let thread =
+        { Thread.thread = T.allocate_thread ~pid ~name
+        ; leaf_candidate = None
+        ; run = None
+        }
+      in
+      t.threads <- thread :: t.threads;
+      thread
+    ;;
+
+    let write_duration_begin ~args ~(thread : thread) ~name ~time =
+      (* A span begun before this one which hasn't ended is its parent, so not a leaf.
+         Otherwise this span may still join the current run. *)
+      if Option.is_some thread.leaf_candidate then flush_thread t thread;
+      thread.leaf_candidate <- Some { Span.name; args; time }
+    ;;
+
+    let write_duration_end ~args ~(thread : thread) ~name ~time =
+      match thread.leaf_candidate with
+      | Some start ->
+        thread.leaf_candidate <- None;
+        add_leaf t thread ~start ~end_:{ Span.name; args; time }
+      | None ->
+        flush_run t thread;
+        T.write_duration_end ~args ~thread:thread.thread ~name ~time
+    ;;
+
+    let write_duration_complete ~args ~(thread : thread) ~name ~time ~time_end =
+      flush_thread t thread;
+      T.write_duration_complete ~args ~thread:thread.thread ~name ~time ~time_end
+    ;;
+
+    let write_duration_instant ~args ~(thread : thread) ~name ~time =
+      flush_thread t thread;
+      T.write_duration_instant ~args ~thread:thread.thread ~name ~time
+    ;;
+
+    let write_counter ~args ~(thread : thread) ~name ~time =
+      flush_thread t thread;
+      T.write_counter ~args ~thread:thread.thread ~name ~time
+    ;;
+  end
+  in
+  (module Coalesced : S_trace with type thread = thread Thread.t)
+;;
+
+let%expect_test "coalescing leaf spans" =
+  let module Printing_trace = struct
+    type thread = unit
+
+    let allocate_pid ~name:_ = 0
+    let allocate_thread ~pid:_ ~name:_ = ()
+
+    let print kind ~args ~name ~time =
+      printf
+        "%s %s @%d %s\n"
+        kind
+        name
+        (Time_ns.Span.to_int_ns time)
+        (Sexp.to_string ([%sexp_of: Tracing.Trace.Arg.t list] args))
+    ;;
+
+    let write_duration_begin ~args ~thread:() ~name ~time =
+      print "begin" ~args ~name ~time
+    ;;
+
+    let write_duration_end ~args ~thread:() ~name ~time = print "end" ~args ~name ~time
+
+    let write_duration_complete ~args ~thread:() ~name ~time ~time_end =
+      print
+        [%string "complete (to %{Time_ns.Span.to_int_ns time_end#Int})"]
+        ~args
+        ~name
+        ~time
+    ;;
+
+    let write_duration_instant ~args ~thread:() ~name ~time =
+      print "instant" ~args ~name ~time
+    ;;
+
+    let write_counter ~args ~thread:() ~name ~time = print "counter" ~args ~name ~time
+  end
+  in
+  let t = create ~min_duration:(Time_ns.Span.of_int_ns 100) (module Printing_trace) in
+  let module T = (val to_trace t) in
+  let thread = T.allocate_thread ~pid:(T.allocate_pid ~name:"") ~name:"" in
+  let call name ~at ~until =
+    T.write_duration_begin
+      ~args:[ "symbol", Interned name ]
+      ~thread
+      ~name
+      ~time:(Time_ns.Span.of_int_ns at);
+    Option.iter until ~f:(fun until ->
+      T.write_duration_end ~args:[] ~thread ~name ~time:(Time_ns.Span.of_int_ns until))
+  in
+  let ret name ~at =
+    T.write_duration_end ~args:[] ~thread ~name ~time:(Time_ns.Span.of_int_ns at)
+  in
+  call "outer" ~at:0 ~until:None;
+  call "memcpy" ~at:10 ~until:(Some 20);
+  call "memcpy" ~at:30 ~until:(Some 45);
+  call "memcpy" ~at:50 ~until:(Some 60);
+  call "foo" ~at:70 ~until:(Some 80);
+  call "bar" ~at:100 ~until:None;
+  call "baz" ~at:110 ~until:(Some 500);
+  ret "bar" ~at:600;
+  ret "outer" ~at:700;
+  call "qux" ~at:800 ~until:(Some 900);
+  call "qux" ~at:1000 ~until:(Some 2000);
+  [%expect
+    {|
+    begin outer @0 ((symbol(Interned outer)))
+    complete (to 80) [4 short calls] @10 ((count(Int 4))(total_ns(Int 45))(min_ns(Int 10))(max_ns(Int 15)))
+    begin bar @100 ((symbol(Interned bar)))
+    begin baz @110 ((symbol(Interned baz)))
+    end baz @500 ()
+    end bar @600 ()
+    end outer @700 ()
+    |}];
+  flush t;
+  [%expect
+    {| complete (to 2000) qux @800 ((count(Int 2))(total_ns(Int 1100))(min_ns(Int 100))(max_ns(Int 1000))(symbol(Interned qux))) |}]
+;;
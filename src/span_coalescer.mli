@@ -0,0 +1,30 @@
+open! Core
+open Trace_writer_intf
+
+(** Wraps an [S_trace] to shrink traces of tight loops, which are otherwise dominated by
+    millions of nearly identical tiny spans.
+
+    Runs of consecutive leaf spans with the same parent are written as one span. A run
+    continues while its spans share a name, or while they're all shorter than
+    [min_duration], in which case it's written as "[N short calls]". Merged spans carry
+    [count], [total_ns], [min_ns] and [max_ns] arguments. A run of one span is written
+    unchanged.
+
+    A span is only known to be a leaf once it ends, so each thread holds back at most one
+    begun span and one run until something else is written on that thread. *)
+
+type 'thread t
+
+module Thread : sig
+  type 'thread t
+end
+
+val create
+  :  min_duration:Time_ns.Span.t
+  -> (module S_trace with type thread = 'thread)
+  -> 'thread t
+
+val to_trace : 'thread t -> (module S_trace with type thread = 'thread Thread.t)
+
+(** Writes everything held back. *)
+val flush : _ t -> unit
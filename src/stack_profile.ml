@@ -0,0 +1,488 @@
+open! Core
+open Trace_writer_intf
+
+module Format = struct
+  type t =
+    | Folded
+    | Pprof of { gzip : bool }
+
+  let of_filename filename =
+    if String.is_suffix filename ~suffix:".folded"
+    then Some Folded
+    else if String.is_suffix filename ~suffix:".pb.gz"
+    then Some (Pprof { gzip = true })
+    else if String.is_suffix filename ~suffix:".pb"
+    then Some (Pprof { gzip = false })
+    else None
+  ;;
+end
+
+(* Field numbers, from pprof's proto/profile.proto. *)
+module Profile = struct
+  let sample_type = 1
+  let sample = 2
+  let location = 4
+  let function_ = 5
+  let string_table = 6
+
+  module Value_type = struct
+    let type_ = 1
+    let unit = 2
+  end
+
+  module Sample = struct
+    let location_id = 1
+    let value = 2
+  end
+
+  module Location = struct
+    let id = 1
+    let line = 4
+
+    module Line = struct
+      let function_id = 1
+    end
+  end
+
+  module Function = struct
+    let id = 1
+    let name = 2
+    let system_name = 3
+  end
+end
+
+module Totals = struct
+  type t =
+    { inclusive : Time_ns.Span.t
+    ; self : Time_ns.Span.t
+    ; calls : int
+    }
+
+  let zero = { inclusive = Time_ns.Span.zero; self = Time_ns.Span.zero; calls = 0 }
+
+  let ( + ) a b =
+    { inclusive = Time_ns.Span.( + ) a.inclusive b.inclusive
+    ; self = Time_ns.Span.( + ) a.self b.self
+    ; calls = a.calls + b.calls
+    }
+  ;;
+end
+
+module Node = struct
+  type t =
+    { name : string
+    ; parent : int
+    ; mutable inclusive : Time_ns.Span.t
+    ; mutable self : Time_ns.Span.t
+    ; mutable calls : int
+    }
+
+  let create ~name ~parent =
+    { name; parent; inclusive = Time_ns.Span.zero; self = Time_ns.Span.zero; calls = 0 }
+  ;;
+
+  let totals { inclusive; self; calls; _ } = { Totals.inclusive; self; calls }
+end
+
+module Edge = struct
+  type t =
+    { parent : int
+    ; name : string
+    }
+  [@@deriving compare, hash, sexp_of]
+end
+
+module Frame = struct
+  type t =
+    { node : int
+    ; start : Time_ns.Span.t
+    ; mutable children : Time_ns.Span.t
+    }
+end
+
+(* A duration begun or ended on a thread. *)
+module Written = struct
+  type t =
+    | Begin of
+        { name : string
+        ; time : Time_ns.Span.t
+        }
+    | End of { time : Time_ns.Span.t }
+
+  let time = function
+    | Begin { time; _ } | End { time } -> time
+  ;;
+end
+
+(* A duration begun before something already written on its thread. *)
+module Late = struct
+  type t =
+    | Begin of
+        { name : string
+        ; time : Time_ns.Span.t
+        }
+    | Complete of
+        { name : string
+        ; time : Time_ns.Span.t
+        ; time_end : Time_ns.Span.t
+        }
+
+  (* By time. Of those at the same time, begins go in the order they were written, which
+     [Trace_writer] makes outermost first, then the begins of complete durations, longest
+     first, then ends, so that an empty one still ends after it began. The complete ones
+     are the [[unknown]] frames [Trace_writer] infers were returned out of, which are
+     innermost. *)
+  let to_sorted_array late =
+    Queue.to_list late
+    |> List.concat_mapi ~f:(fun i (late : t) ->
+      match late with
+      | Begin { name; time } ->
+        [ (time, 1, Time_ns.Span.zero, i), Written.Begin { name; time } ]
+      | Complete { name; time; time_end } ->
+        [ (time, 2, Time_ns.Span.neg time_end, i), Written.Begin { name; time }
+        ; (time_end, 3, Time_ns.Span.zero, i), End { time = time_end }
+        ])
+    |> List.sort ~compare:(fun (a, _) (b, _) ->
+      [%compare: Time_ns.Span.t * int * Time_ns.Span.t * int] a b)
+    |> List.map ~f:snd
+    |> Array.of_list
+  ;;
+end
+
+(* Node 0 is the root of every trie. *)
+let root = 0
+
+module Thread = struct
+  type t =
+    { node : int
+    ; frames : Frame.t Stack.t
+    ; (* The latest time written in order. *)
+      mutable last_time : Time_ns.Span.t
+    ; (* Durations written in order, and those begun before [last_time] when they were
+         written, until [Trie.end_thread] adds them up. *)
+      in_order : Written.t Queue.t
+    ; late : Late.t Queue.t
+    }
+
+  (* Its outermost frames are children of [node]. *)
+  let at_node node =
+    { node
+    ; frames = Stack.create ()
+    ; last_time = Time_ns.Span.zero
+    ; in_order = Queue.create ()
+    ; late = Queue.create ()
+    }
+  ;;
+
+  let create () = at_node root
+  let saw_time t time = t.last_time <- Time_ns.Span.max t.last_time time
+  let is_late t time = Time_ns.Span.( < ) time t.last_time
+
+  let begin_ t ~name ~time =
+    if is_late t time
+    then Queue.enqueue t.late (Begin { name; time })
+    else (
+      Queue.enqueue t.in_order (Begin { name; time });
+      saw_time t time)
+  ;;
+
+  let end_ t ~time =
+    Queue.enqueue t.in_order (End { time });
+    saw_time t time
+  ;;
+
+  let complete t ~name ~time ~time_end =
+    if is_late t time
+    then Queue.enqueue t.late (Complete { name; time; time_end })
+    else (
+      Queue.enqueue t.in_order (Begin { name; time });
+      Queue.enqueue t.in_order (End { time = time_end }));
+    saw_time t time_end
+  ;;
+end
+
+module Trie = struct
+  type t =
+    { (* Indexed by id, which is always greater than that of the node's parent. *)
+      nodes : Node.t Queue.t
+    ; children : (Edge.t, int) Hashtbl.t
+    }
+
+  let create () =
+    let nodes = Queue.create () in
+    Queue.enqueue nodes (Node.create ~name:"" ~parent:(-1));
+    { nodes; children = Hashtbl.create (module Edge) }
+  ;;
+
+  let child t ~parent ~name =
+    Hashtbl.find_or_add t.children { Edge.parent; name } ~default:(fun () ->
+      let id = Queue.length t.nodes in
+      Queue.enqueue t.nodes (Node.create ~name ~parent);
+      id)
+  ;;
+
+  let begin_ t (thread : Thread.t) ~name ~time =
+    let parent =
+      match Stack.top thread.frames with
+      | Some frame -> frame.node
+      | None -> thread.node
+    in
+    Stack.push
+      thread.frames
+      { Frame.node = child t ~parent ~name; start = time; children = Time_ns.Span.zero }
+  ;;
+
+  (* Once durations are in order, an end with nothing open on the thread can only be of
+     a duration begun before the trace was, which wasn't written. *)
+  let end_ t (thread : Thread.t) ~time =
+    Option.iter (Stack.pop thread.frames) ~f:(fun frame ->
+      let duration = Time_ns.Span.(max zero (time - frame.start)) in
+      let node = Queue.get t.nodes frame.node in
+      node.inclusive <- Time_ns.Span.(node.inclusive + duration);
+      node.self <- Time_ns.Span.(node.self + max zero (duration - frame.children));
+      node.calls <- node.calls + 1;
+      Option.iter (Stack.top thread.frames) ~f:(fun parent ->
+        parent.children <- Time_ns.Span.(parent.children + duration)))
+  ;;
+
+  let add t thread (written : Written.t) =
+    match written with
+    | Begin { name; time } -> begin_ t thread ~name ~time
+    | End { time } -> end_ t thread ~time
+  ;;
+
+  (* [Trace_writer] only learns of the frames a thread was in as the trace began, or as
+     it came back from a decode error, as they're returned out of. It writes their begins
+     once the thread ends, after everything nested in them and after their own ends. So
+     the durations written in order are replayed with the late ones merged back in: each
+     at its time, after whatever ended at that time and before whatever began then. *)
+  let end_thread t (thread : Thread.t) =
+    let in_order = Queue.to_array thread.in_order in
+    Array.stable_sort
+      in_order
+      ~compare:(Comparable.lift Time_ns.Span.compare ~f:Written.time);
+    let late = Late.to_sorted_array thread.late in
+    (* Whether anything written in order at the same time, from each index on, ended. *)
+    let ends_follow = Array.create ~len:(Array.length in_order) false in
+    for i = Array.length in_order - 1 downto 0 do
+      let next_at_same_time =
+        i + 1 < Array.length in_order
+        && Time_ns.Span.( = ) (Written.time in_order.(i + 1)) (Written.time in_order.(i))
+      in
+      ends_follow.(i)
+      <- (match in_order.(i) with
+          | End _ -> true
+          | Begin _ -> next_at_same_time && ends_follow.(i + 1))
+    done;
+    let late_goes_before ~late i =
+      let late = Written.time late in
+      let in_order = Written.time in_order.(i) in
+      Time_ns.Span.( > ) in_order late
+      || (Time_ns.Span.( = ) in_order late && not ends_follow.(i))
+    in
+    let i = ref 0 in
+    let j = ref 0 in
+    while !i < Array.length in_order || !j < Array.length late do
+      if !j < Array.length late
+         && (!i = Array.length in_order || late_goes_before ~late:late.(!j) !i)
+      then (
+        add t thread late.(!j);
+        incr j)
+      else (
+        add t thread in_order.(!i);
+        incr i)
+    done;
+    Queue.clear thread.in_order;
+    Queue.clear thread.late;
+    while not (Stack.is_empty thread.frames) do
+      end_ t thread ~time:thread.last_time
+    done
+  ;;
+
+  (* Calls [f] with each node that has been on a stack, and its frames from the leaf
+     up. *)
+  let iter_stacks t ~frame ~f =
+    let stacks = Array.create ~len:(Queue.length t.nodes) [] in
+    Queue.iteri t.nodes ~f:(fun id (node : Node.t) ->
+      if id <> root
+      then (
+        stacks.(id) <- frame node.name :: stacks.(node.parent);
+        if node.calls > 0 then f node stacks.(id)))
+  ;;
+
+  let paths t =
+    let paths = ref [] in
+    iter_stacks t ~frame:Fn.id ~f:(fun node stack ->
+      paths := (String.concat ~sep:";" (List.rev stack), Node.totals node) :: !paths);
+    !paths
+  ;;
+
+  (* A recursive call's time is already in that of the call it's nested in, so only a
+     symbol's outermost calls count towards its inclusive time. *)
+  let symbols t =
+    let symbols = Hashtbl.create (module String) in
+    let rec nested_in_itself (node : Node.t) ~parent =
+      parent <> root
+      &&
+      let parent = Queue.get t.nodes parent in
+      String.equal parent.name node.name || nested_in_itself node ~parent:parent.parent
+    in
+    Queue.iteri t.nodes ~f:(fun id (node : Node.t) ->
+      if id <> root && node.calls > 0
+      then (
+        let totals = Node.totals node in
+        let totals =
+          if nested_in_itself node ~parent:node.parent
+          then { totals with inclusive = Time_ns.Span.zero }
+          else totals
+        in
+        Hashtbl.update symbols node.name ~f:(fun sum ->
+          Totals.( + ) (Option.value sum ~default:Totals.zero) totals)));
+    Hashtbl.to_alist symbols
+  ;;
+end
+
+type t =
+  { format : Format.t
+  ; filename : string
+  ; (* Processes are at the root, with their threads beneath them. *)
+    trie : Trie.t
+  ; threads : Thread.t Queue.t
+  }
+
+let create ~format ~filename =
+  { format; filename; trie = Trie.create (); threads = Queue.create () }
+;;
+
+let to_trace t =
+  let module Sink = struct
+    type thread = Thread.t
+
+    let allocate_pid ~name = Trie.child t.trie ~parent:root ~name
+
+    let allocate_thread ~pid ~name =
+      let thread = Thread.at_node (Trie.child t.trie ~parent:pid ~name) in
+      Queue.enqueue t.threads thread;
+      thread
+    ;;
+
+    let write_duration_begin ~args:_ ~thread ~name ~time =
+      Thread.begin_ thread ~name ~time
+    ;;
+
+    let write_duration_end ~args:_ ~thread ~name:_ ~time = Thread.end_ thread ~time
+
+    let write_duration_complete ~args:_ ~thread ~name ~time ~time_end =
+      Thread.complete thread ~name ~time ~time_end
+    ;;
+
+    (* Neither takes any time. *)
+    let write_duration_instant ~args:_ ~thread ~name:_ ~time = Thread.saw_time thread time
+    let write_counter ~args:_ ~thread ~name:_ ~time = Thread.saw_time thread time
+  end
+  in
+  (module Sink : S_trace with type thread = Thread.t)
+;;
+
+let write_folded t out =
+  let frame =
+    String.map ~f:(function
+      | ';' | '\n' -> '_'
+      | c -> c)
+  in
+  Trie.iter_stacks t.trie ~frame ~f:(fun node stack ->
+    if Time_ns.Span.( > ) node.self Time_ns.Span.zero
+    then
+      Out_channel.fprintf
+        out
+        "%s %d\n"
+        (String.concat ~sep:";" (List.rev stack))
+        (Time_ns.Span.to_int_ns node.self))
+;;
+
+(* Every distinct frame name is a function with a location of its own, both with the
+   name's index in the string table as their id. Ids can't be 0, which is the empty
+   string's index. *)
+let pprof t =
+  let buf = Buffer.create 4096 in
+  let scratch = Protobuf.create_scratch () in
+  let strings = Hashtbl.create (module String) in
+  let string_table = Queue.create () in
+  let string s =
+    Hashtbl.find_or_add strings s ~default:(fun () ->
+      Queue.enqueue string_table s;
+      Queue.length string_table - 1)
+  in
+  let (_ : int) = string "" in
+  List.iter [ "time", "nanoseconds"; "calls", "count" ] ~f:(fun (type_, unit) ->
+    let type_ = string type_ in
+    let unit = string unit in
+    Protobuf.message scratch buf ~field:Profile.sample_type ~f:(fun value_type ->
+      Protobuf.int value_type ~field:Profile.Value_type.type_ type_;
+      Protobuf.int value_type ~field:Profile.Value_type.unit unit));
+  let functions = Hash_set.create (module Int) in
+  let frame name = string (if String.is_empty name then "[unknown]" else name) in
+  Trie.iter_stacks t.trie ~frame ~f:(fun node stack ->
+    Protobuf.message scratch buf ~field:Profile.sample ~f:(fun sample ->
+      Protobuf.packed_ints scratch sample ~field:Profile.Sample.location_id stack;
+      Protobuf.packed_ints
+        scratch
+        sample
+        ~field:Profile.Sample.value
+        [ Time_ns.Span.to_int_ns node.self; node.calls ]);
+    List.iter stack ~f:(Hash_set.add functions));
+  Hash_set.to_list functions
+  |> List.sort ~compare:Int.compare
+  |> List.iter ~f:(fun id ->
+    Protobuf.message scratch buf ~field:Profile.location ~f:(fun location ->
+      Protobuf.int location ~field:Profile.Location.id id;
+      Protobuf.message scratch location ~field:Profile.Location.line ~f:(fun line ->
+        Protobuf.int line ~field:Profile.Location.Line.function_id id));
+    Protobuf.message scratch buf ~field:Profile.function_ ~f:(fun function_ ->
+      Protobuf.int function_ ~field:Profile.Function.id id;
+      Protobuf.int function_ ~field:Profile.Function.name id;
+      Protobuf.int function_ ~field:Profile.Function.system_name id));
+  Queue.iter string_table ~f:(Protobuf.string buf ~field:Profile.string_table);
+  Buffer.contents buf
+;;
+
+let close t =
+  Queue.iter t.threads ~f:(Trie.end_thread t.trie);
+  match t.format with
+  | Folded -> Out_channel.with_file t.filename ~f:(write_folded t)
+  | Pprof { gzip = false } -> Out_channel.write_all t.filename ~data:(pprof t)
+  | Pprof { gzip = true } ->
+    let profile = pprof t in
+    let out = Gzip.open_out t.filename in
+    Exn.protect
+      ~f:(fun () -> Gzip.output_substring out profile 0 (String.length profile))
+      ~finally:(fun () -> Gzip.close_out out)
+;;
+
+let%expect_test "folded stacks" =
+  let filename = Filename_unix.temp_file "magic-trace" ".folded" in
+  let t = create ~format:Folded ~filename in
+  let module T = (val to_trace t) in
+  let thread = T.allocate_thread ~pid:(T.allocate_pid ~name:"p") ~name:"t" in
+  let at ns = Time_ns.Span.of_int_ns ns in
+  T.write_duration_begin ~args:[] ~thread ~name:"main" ~time:(at 0);
+  T.write_duration_complete ~args:[] ~thread ~name:"f" ~time:(at 10) ~time_end:(at 30);
+  T.write_duration_begin ~args:[] ~thread ~name:"g" ~time:(at 40);
+  T.write_duration_complete ~args:[] ~thread ~name:"f" ~time:(at 50) ~time_end:(at 60);
+  T.write_duration_end ~args:[] ~thread ~name:"g" ~time:(at 70);
+  T.write_duration_instant ~args:[] ~thread ~name:"hit" ~time:(at 80);
+  T.write_duration_begin ~args:[] ~thread ~name:"f;g" ~time:(at 90);
+  T.write_duration_end ~args:[] ~thread ~name:"f;g" ~time:(at 100);
+  (* Ends [main], which is still open, at 100. *)
+  close t;
+  print_string (In_channel.read_all filename);
+  Core_unix.unlink filename;
+  [%expect
+    {|
+    p;t;main 40
+    p;t;main;f 20
+    p;t;main;g 20
+    p;t;main;g;f 10
+    p;t;main;f_g 10
+    |}]
+;;
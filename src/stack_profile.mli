@@ -0,0 +1,91 @@
+open! Core
+open Trace_writer_intf
+
+(** Sums up a trace into the time spent in each distinct call stack, instead of writing
+    out each event, so its size depends on the number of distinct stacks rather than on
+    the length of the recording.
+
+    Stacks are kept as a trie of frames, with processes and threads at its root, and each
+    duration's self time (its time less that of the durations nested in it) and count
+    added to its stack's node. [Trace_writer] writes the begins of frames it infers after
+    the frames nested in them, so each thread's durations are held until the profile is
+    closed, to be put back in the order they happened before they're added up. Inclusive
+    times are left to the tools reading the profile, which add up those of every stack
+    beneath a frame. The same trie also sums up traces for [magic-trace diff]. *)
+
+module Format : sig
+  type t =
+    | Folded
+    (** One line per stack, its frames separated by [;] and followed by its self time in
+        nanoseconds, as read by [flamegraph.pl], speedscope and the like. *)
+    | Pprof of { gzip : bool }
+    (** A [perftools.profiles.Profile], with each stack's self time and count as a
+        sample. *)
+
+  (** [*.folded], [*.pb] or [*.pb.gz]. *)
+  val of_filename : string -> t option
+end
+
+(** Time and calls, summed over the durations of a stack or of a symbol. *)
+module Totals : sig
+  type t =
+    { inclusive : Time_ns.Span.t (** Including the durations nested in them. *)
+    ; self : Time_ns.Span.t
+    ; calls : int
+    }
+
+  val zero : t
+end
+
+module Thread : sig
+  type t
+
+  (** A thread whose outermost frames are at the root of a [Trie], so that stacks on
+      every thread created this way are added up together. *)
+  val create : unit -> t
+
+  (** Durations are written as [Trace_writer] writes them, and added up by
+      [Trie.end_thread], which puts them back in the order they happened. *)
+  val begin_ : t -> name:string -> time:Time_ns.Span.t -> unit
+
+  val end_ : t -> time:Time_ns.Span.t -> unit
+
+  val complete
+    :  t
+    -> name:string
+    -> time:Time_ns.Span.t
+    -> time_end:Time_ns.Span.t
+    -> unit
+
+  (** Notes an event on the thread which isn't a duration, so that [Trie.end_thread]
+      ends its durations no earlier. *)
+  val saw_time : t -> Time_ns.Span.t -> unit
+end
+
+(** Every distinct stack, with the totals of the durations that were at the top of it. *)
+module Trie : sig
+  type t
+
+  val create : unit -> t
+
+  (** Adds up the thread's durations, ending any still open at the last time seen on the
+      thread. *)
+  val end_thread : t -> Thread.t -> unit
+
+  (** Each stack's totals, by its frames from the root separated by [;]. *)
+  val paths : t -> (string * Totals.t) list
+
+  (** The totals of every stack with each symbol at its top. A symbol's inclusive time
+      only counts its outermost calls, so the time of recursive calls isn't counted twice.
+  *)
+  val symbols : t -> (string * Totals.t) list
+end
+
+type t
+
+val create : format:Format.t -> filename:string -> t
+val to_trace : t -> (module S_trace with type thread = Thread.t)
+
+(** Ends any durations still open at the last time seen on their thread, then writes the
+    profile. *)
+val close : t -> unit
@@ -0,0 +1,179 @@
+open! Core
+open! Async
+
+module Bound = struct
+  type t =
+    | Absolute of Time_ns.Span.t
+    | Relative_to_hit of Time_ns.Span.t
+  [@@deriving sexp_of]
+
+  (* [perf script] prints timestamps as seconds with nine decimal places. *)
+  let parse_absolute str =
+    let seconds, decimals =
+      match String.lsplit2 str ~on:'.' with
+      | None -> str, ""
+      | Some (seconds, decimals) -> seconds, decimals
+    in
+    let nanoseconds = String.prefix (decimals ^ String.make 9 '0') 9 in
+    Time_ns.Span.of_int_ns
+      ((Int.of_string seconds * 1_000_000_000) + Int.of_string nanoseconds)
+  ;;
+
+  let of_string str =
+    match String.chop_prefix str ~prefix:"+" with
+    | Some offset -> Relative_to_hit (Time_ns.Span.of_string offset)
+    | None ->
+      if String.is_prefix str ~prefix:"-"
+      then Relative_to_hit (Time_ns.Span.of_string str)
+      else Absolute (parse_absolute str)
+  ;;
+end
+
+type t =
+  { start : Bound.t
+  ; end_ : Bound.t
+  ; lead_in : Time_ns.Span.t
+  }
+[@@deriving sexp_of]
+
+let default_lead_in = Time_ns.Span.of_int_ms 10
+
+let of_string str =
+  match String.substr_index str ~pattern:".." with
+  | None -> raise_s [%message "Expected a window of the form START..END" str]
+  | Some index ->
+    { start = Bound.of_string (String.prefix str index)
+    ; end_ = Bound.of_string (String.drop_prefix str (index + 2))
+    ; lead_in = default_lead_in
+    }
+;;
+
+let param =
+  let%map_open.Command window =
+    flag
+      "-window"
+      (optional (Command.Arg_type.create of_string))
+      ~doc:
+        "START..END Only write the events in this window. Each bound is either a perf \
+         timestamp in seconds (e.g. 4509191.343298) or, starting with + or -, an \
+         offset from the first hit of the snapshot symbol (e.g. -10ms..+1ms)."
+    |> Util.experimental_flag ~default:None
+  and lead_in =
+    flag
+      "-window-lead-in"
+      (optional_with_default
+         default_lead_in
+         (Command.Arg_type.create Time_ns.Span.of_string))
+      ~doc:
+        [%string
+          "DURATION How long before a [-window] to start decoding, so that the call \
+           stacks already open at its start are known. Events in it are followed, but \
+           not written. (default: %{default_lead_in#Time_ns.Span})"]
+    |> Util.experimental_flag ~default:default_lead_in
+  in
+  Option.map window ~f:(fun window -> { window with lead_in })
+;;
+
+module Resolved = struct
+  type t =
+    { decode_from : Time_ns.Span.t
+    ; start : Time_ns.Span.t
+    ; end_ : Time_ns.Span.t
+    }
+  [@@deriving sexp_of]
+
+  let to_perf_time span =
+    let ns = Time_ns.Span.to_int_ns span in
+    let sign = if ns < 0 then "-" else "" in
+    let ns = Int.abs ns in
+    sprintf "%s%d.%09d" sign (ns / 1_000_000_000) (ns % 1_000_000_000)
+  ;;
+
+  let perf_script_args t =
+    [ "--time"; [%string "%{to_perf_time t.decode_from},%{to_perf_time t.end_}"] ]
+  ;;
+
+  let restrict t events =
+    (* Events are in time order, so nothing after the first event past the end of the
+       window is needed. *)
+    let past_end = ref false in
+    Pipe.map' events ~max_queue_length:Decode_result.max_batch_size ~f:(fun batch ->
+      Queue.filter_map batch ~f:(fun (event : Event.With_write_info.t) ->
+        if !past_end
+        then None
+        else (
+          match%optional.Time_ns_unix.Span.Option Event.time event.event with
+          | None -> Some event
+          | Some time ->
+            if Time_ns.Span.( > ) time t.end_
+            then (
+              past_end := true;
+              None)
+            else if Time_ns.Span.( < ) time t.start
+            then Some { event with should_write = false }
+            else Some event))
+      |> return)
+  ;;
+end
+
+let resolve { start; end_; lead_in } ~hits =
+  let open Or_error.Let_syntax in
+  let first_hit =
+    List.min_elt hits ~compare:(fun (_, (a : Breakpoint.Hit.t)) (_, b) ->
+      Time_ns.Span.compare a.timestamp b.timestamp)
+  in
+  let resolve_bound : Bound.t -> _ = function
+    | Absolute time -> Ok time
+    | Relative_to_hit offset ->
+      (match first_hit with
+       | None -> Or_error.error_string "-window is relative to a hit, but there were none"
+       | Some (_, hit) -> Ok (Time_ns.Span.( + ) hit.timestamp offset))
+  in
+  let%bind start = resolve_bound start in
+  let%bind end_ = resolve_bound end_ in
+  if Time_ns.Span.( >= ) start end_
+  then
+    Or_error.error_s
+      [%message
+        "Window ends before it starts"
+          ~start:(Resolved.to_perf_time start : string)
+          ~end_:(Resolved.to_perf_time end_ : string)]
+  else if not (Time_ns.Span.is_positive end_)
+  then
+    Or_error.error_s
+      [%message
+        "Window ends before perf's first timestamp"
+          ~end_:(Resolved.to_perf_time end_ : string)]
+  else (
+    let decode_from = Time_ns.Span.(max zero (start - lead_in)) in
+    Ok { Resolved.decode_from; start; end_ })
+;;
+
+let%expect_test "parsing windows" =
+  let hit =
+    { Breakpoint.Hit.timestamp = Time_ns.Span.of_int_ns 1_500_000_000
+    ; passed_timestamp = Time_ns.Span.zero
+    ; passed_val = 0
+    ; tid = Pid.of_int 1
+    ; ip = 0L
+    }
+  in
+  let test ?(lead_in = default_lead_in) str =
+    match resolve { (of_string str) with lead_in } ~hits:[ "hit", hit ] with
+    | Error error -> print_s [%sexp (error : Error.t)]
+    | Ok resolved -> print_s [%sexp (Resolved.perf_script_args resolved : string list)]
+  in
+  test "4509191.3..4509191.35";
+  [%expect {| (--time 4509191.290000000,4509191.350000000) |}];
+  test "-10ms..+1ms";
+  [%expect {| (--time 1.480000000,1.501000000) |}];
+  test "-10ms..+1ms" ~lead_in:Time_ns.Span.zero;
+  [%expect {| (--time 1.490000000,1.501000000) |}];
+  test "+1ms..-1ms";
+  [%expect {| ("Window ends before it starts" (start 1.501000000) (end_ 1.499000000)) |}];
+  (* Decoding can't start before perf's first timestamp. *)
+  test "-2s..+1ms";
+  [%expect {| (--time 0.000000000,1.501000000) |}];
+  test "-3s..-2s";
+  [%expect {| ("Window ends before perf's first timestamp" (end_ -0.500000000)) |}]
+;;
@@ -0,0 +1,47 @@
+open! Core
+open! Async
+
+(** A window of time to write, for when only the events around a trigger hit matter.
+
+    [perf] only decodes from a short lead-in before the window to its end. Events in the
+    lead-in aren't written, but [Trace_writer] follows them, so that call stacks already
+    open when the window starts are known. Those open since before the lead-in still start
+    at the lead-in's start. *)
+
+module Bound : sig
+  type t =
+    | Absolute of Time_ns.Span.t (** A perf timestamp, as printed by [perf script]. *)
+    | Relative_to_hit of Time_ns.Span.t
+        (** An offset from the first hit of the snapshot symbol. *)
+  [@@deriving sexp_of]
+end
+
+type t =
+  { start : Bound.t
+  ; end_ : Bound.t
+  ; lead_in : Time_ns.Span.t
+  }
+[@@deriving sexp_of]
+
+val param : t option Command.Param.t
+
+module Resolved : sig
+  type t =
+    { decode_from : Time_ns.Span.t (** The start of the lead-in. *)
+    ; start : Time_ns.Span.t
+    ; end_ : Time_ns.Span.t
+    }
+  [@@deriving sexp_of]
+
+  (** Arguments which make [perf script] skip events outside the lead-in and window. *)
+  val perf_script_args : t -> string list
+
+  (** Marks events before the window, i.e. in the lead-in, as not to be written, so
+      [Trace_writer] only keeps track of their callstacks, and drops events after it. *)
+  val restrict
+    :  t
+    -> Event.With_write_info.t Pipe.Reader.t
+    -> Event.With_write_info.t Pipe.Reader.t
+end
+
+val resolve : t -> hits:(string * Breakpoint.Hit.t) list -> Resolved.t Or_error.t
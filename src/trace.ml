@@ -89,8 +89,10 @@ end
 
 let write_trace_from_events
   ?ocaml_exception_info
-  ~events_writer
-  ~writer
+  ?(trace_writer_domains = 1)
+  ?coalesce_spans
+  ?latency_report
+  ~(sink : Tracing_tool_output.sink)
   ~print_events
   ~trace_scope
   ~debug_info
@@ -111,42 +113,94 @@ let write_trace_from_events
     if print_events
     then
       List.map events ~f:(fun events ->
-        Pipe.map events ~f:(fun event ->
-          Core.print_s ~mach:() (Event.With_write_info.event event |> Event.sexp_of_t);
-          event))
+        Pipe.map' events ~max_queue_length:Decode_result.max_batch_size ~f:(fun batch ->
+          Queue.iter batch ~f:(fun event ->
+            Core.print_s ~mach:() (Event.With_write_info.event event |> Event.sexp_of_t));
+          return batch))
     else events
   in
-  let trace =
-    let%map.Option writer in
-    let base_time =
-      Time_ns.add (Boot_time.time_ns_of_boot_in_perf_time ()) earliest_time
-    in
-    Tracing.Trace.Expert.create ~base_time:(Some base_time) writer
+  let base_time = Time_ns.add (Boot_time.time_ns_of_boot_in_perf_time ()) earliest_time in
+  let create_writer ~earliest_time ~hits trace =
+    Trace_writer.create
+      ?coalesce_spans
+      ?latency_report
+      ~trace_scope
+      ~debug_info
+      ~ocaml_exception_info
+      ~earliest_time
+      ~hits
+      ~annotate_inferred_start_times:Env_vars.debug
+      trace
   in
-  let writer =
-    match trace with
-    | Some trace ->
-      Trace_writer.create
-        ~trace_scope
-        ~debug_info
-        ~ocaml_exception_info
-        ~earliest_time
-        ~hits
-        ~annotate_inferred_start_times:Env_vars.debug
-        trace
-    | None ->
-      Trace_writer.create_expert
-        ~trace_scope
-        ~debug_info
-        ~ocaml_exception_info
-        ~earliest_time
-        ~hits
-        ~annotate_inferred_start_times:Env_vars.debug
-        (module Null_writer)
+  let create_writer_expert trace =
+    Trace_writer.create_expert
+      ?coalesce_spans
+      ?latency_report
+      ~trace_scope
+      ~debug_info
+      ~ocaml_exception_info
+      ~earliest_time
+      ~hits
+      ~annotate_inferred_start_times:Env_vars.debug
+      trace
+  in
+  (* Each sink's writer, the events file if that's what's being written, and how to
+     close the sink once everything is written. *)
+  let writer, events_writer, close_sink =
+    match sink with
+    | Fxt writer ->
+      let trace = Tracing.Trace.Expert.create ~base_time:(Some base_time) writer in
+      let writer =
+        if trace_writer_domains > 1
+        then (
+          (* Only one shard writes the hits, but every shard has to map the same time to
+             the start of the trace, which [Trace_writer] moves back to the earliest
+             hit. *)
+          let earliest_time_or_hit =
+            List.fold
+              hits
+              ~init:earliest_time
+              ~f:(fun acc (_, (hit : Breakpoint.Hit.t)) ->
+                Time_ns.Span.min acc hit.timestamp)
+          in
+          `Sharded
+            (Trace_writer_shards.create
+               ~num_shards:trace_writer_domains
+               ~base_time
+               ~create_writer:(fun ~shard trace ->
+                 if shard = 0
+                 then create_writer ~earliest_time ~hits trace
+                 else create_writer ~earliest_time:earliest_time_or_hit ~hits:[] trace)
+               trace))
+        else `Single (create_writer ~earliest_time ~hits trace)
+      in
+      let close () =
+        if Env_vars.debug
+        then (
+          let stats = Tracing.Trace.interning_stats trace in
+          eprint_s
+            [%message "String interning" ~_:(stats : Tracing.Trace.Interning_stats.t)]);
+        Tracing.Trace.close trace
+      in
+      writer, None, close
+    | Events events_writer ->
+      `Single (create_writer_expert (module Null_writer)), Some events_writer, ignore
+    | Rolling rolling_trace ->
+      ( `Single (create_writer_expert (Rolling_trace.start rolling_trace ~base_time))
+      , None
+      , fun () -> Rolling_trace.close rolling_trace )
+    | Perfetto perfetto_trace ->
+      ( `Single (create_writer_expert (Perfetto_trace.to_trace perfetto_trace))
+      , None
+      , fun () -> Perfetto_trace.close perfetto_trace )
+    | Profile profile ->
+      ( `Single (create_writer_expert (Stack_profile.to_trace profile))
+      , None
+      , fun () -> Stack_profile.close profile )
   in
   (match events_writer with
    | Some Tracing_tool_output.{ format = Sexp; writer = w; _ } ->
-     Writer.write_line w "(V5 ("
+     Writer.write_line w "(V6 ("
    | Some Tracing_tool_output.{ format = Binio; writer = w; _ } ->
      let shape =
        Bin_prot.Shape.(
@@ -167,36 +221,61 @@ let write_trace_from_events
     then (
       match ev.event with
       | Ok { data = Trace _; _ } | Ok { data = Stacktrace_sample _; _ } ->
-        (match%optional.Time_ns_unix.Span.Option Event.time ev.event with
-         | None -> Trace_writer.end_of_trace writer
-         | Some to_time -> Trace_writer.end_of_trace ~to_time writer);
+        let to_time =
+          match%optional.Time_ns_unix.Span.Option Event.time ev.event with
+          | None -> None
+          | Some to_time -> Some to_time
+        in
+        (match writer with
+         | `Single writer -> Trace_writer.end_of_trace ?to_time writer
+         | `Sharded shards -> Trace_writer_shards.end_of_trace ?to_time shards);
         last_index := index
       | Ok { data = Event_sample _; _ } | Ok { data = Power _; _ } | Error _ -> ());
-    Trace_writer.write_event writer ?events_writer ev
+    match writer with
+    | `Single writer -> Trace_writer.write_event writer ?events_writer ev
+    | `Sharded shards -> Trace_writer_shards.write_event shards ev
   in
   let%bind () =
     Deferred.List.iteri events ~how:`Sequential ~f:(fun index events ->
-      Pipe.iter_without_pushback events ~f:(process_event index))
+      Pipe.iter' events ~max_queue_length:Decode_result.max_batch_size ~f:(fun batch ->
+        Queue.iter batch ~f:(process_event index);
+        match writer with
+        | `Single _ -> Deferred.unit
+        | `Sharded shards -> Trace_writer_shards.flush shards))
   in
   (match events_writer with
    | Some Tracing_tool_output.{ format = Sexp; writer = w; _ } -> Writer.write_line w "))"
    | _ -> ());
-  Trace_writer.end_of_trace writer;
-  Option.iter trace ~f:(fun trace -> Tracing.Trace.close trace);
+  let%bind () =
+    match writer with
+    | `Single writer ->
+      Trace_writer.end_of_trace writer;
+      Deferred.unit
+    | `Sharded shards -> Trace_writer_shards.finish shards
+  in
+  close_sink ();
+  Option.iter latency_report ~f:Latency_report.print;
   close_result
 ;;
 
-let get_events_and_close_result ~decode_events ~range_symbols =
+let get_events_and_close_result ~decode_events ~range_symbols ~time_window =
   let open Deferred.Or_error.Let_syntax in
-  match range_symbols with
-  | None ->
-    let%map { Decode_result.events; close_result } = decode_events () in
-    ( List.map events ~f:(fun events ->
-        Pipe.map events ~f:(fun event ->
-          Event.With_write_info.create ~should_write:true event))
-    , close_result )
-  | Some range_symbols ->
-    For_range.decode_events_and_annotate ~decode_events ~range_symbols
+  let%map events, close_result =
+    match range_symbols with
+    | None ->
+      let%map { Decode_result.events; close_result } = decode_events () in
+      ( List.map events ~f:(fun events ->
+          Pipe.map' events ~max_queue_length:Decode_result.max_batch_size ~f:(fun batch ->
+            Queue.map batch ~f:(Event.With_write_info.create ~should_write:true)
+            |> return))
+      , close_result )
+    | Some range_symbols ->
+      For_range.decode_events_and_annotate ~decode_events ~range_symbols
+  in
+  match time_window with
+  | None -> events, close_result
+  | Some time_window ->
+    List.map events ~f:(Time_window.Resolved.restrict time_window), close_result
 ;;
 
 module Make_commands (Backend : Backend_intf.S) = struct
@@ -205,6 +284,10 @@ module Make_commands (Backend : Backend_intf.S) = struct
       { output_config : Tracing_tool_output.t
       ; decode_opts : Backend.Decode_opts.t
       ; print_events : bool
+      ; trace_writer_domains : int
+      ; coalesce_spans : Time_ns.Span.t option
+      ; latency_report : string list option
+      ; window : Time_window.t option
       }
   end
 
@@ -222,7 +305,14 @@ module Make_commands (Backend : Backend_intf.S) = struct
     ~debug_print_perf_commands
     ~record_dir
     ~collection_mode
-    { Decode_opts.output_config; decode_opts; print_events }
+    { Decode_opts.output_config
+    ; decode_opts
+    ; print_events
+    ; trace_writer_domains
+    ; coalesce_spans
+    ; latency_report
+    ; window
+    }
     =
     Core.eprintf "[ Decoding, this takes a while... ]\n%!";
     let recording_data =
@@ -234,10 +324,11 @@ module Make_commands (Backend : Backend_intf.S) = struct
       with
       | Sys_error _ -> None
     in
-    let decode_events ?filter_same_symbol_jumps () =
+    let decode_events ?filter_same_symbol_jumps ?time_window () =
       Backend.decode_events
         ?perf_maps
         ?filter_same_symbol_jumps
+        ?time_window
         decode_opts
         ~debug_print_perf_commands
         ~recording_data
@@ -246,7 +337,7 @@ module Make_commands (Backend : Backend_intf.S) = struct
     in
     Tracing_tool_output.write_and_maybe_view
       output_config
-      ~f:(fun ~events_writer ~writer () ->
+      ~f:(fun sink ->
         let open Deferred.Or_error.Let_syntax in
         let hits =
           In_channel.read_all (Hits_file.filename ~record_dir)
@@ -272,14 +363,33 @@ module Make_commands (Backend : Backend_intf.S) = struct
           | true -> None
           | false -> Option.bind elf ~f:Elf.ocaml_exception_info
         in
+        let%bind time_window =
+          match window with
+          | None -> return None
+          | Some window ->
+            let%map time_window = Deferred.return (Time_window.resolve window ~hits) in
+            Some time_window
+        in
         let%bind events, close_result =
-          get_events_and_close_result ~decode_events ~range_symbols
+          get_events_and_close_result
+            ~decode_events:(decode_events ?time_window)
+            ~range_symbols
+            ~time_window
         in
         let%bind () =
           write_trace_from_events
             ?ocaml_exception_info
-            ~events_writer
-            ~writer
+            ~trace_writer_domains:
+              ((* Trace filters need every thread's events in one [Trace_writer.t], and
+                  a latency report can't be added to from several domains. *)
+               if Option.is_some range_symbols || Option.is_some latency_report
+               then 1
+               else Int.min trace_writer_domains (Trace_writer_shards.max_shards ()))
+            ?coalesce_spans
+            ?latency_report:
+              (Option.map latency_report ~f:(fun symbols ->
+                 Latency_report.create ~symbols))
+            ~sink
             ~debug_info
             ~trace_scope
             ~print_events
@@ -574,8 +684,44 @@ module Make_commands (Backend : Backend_intf.S) = struct
     let%map_open.Command output_config = Tracing_tool_output.param
     and print_events =
       flag "-z-print-events" no_arg ~doc:"Prints decoded [Event.t]s." |> debug_flag
+    and trace_writer_domains =
+      let default = 1 in
+      flag
+        "-trace-writer-domains"
+        (optional_with_default default int)
+        ~doc:
+          [%string
+            "N Write the trace with N domains in parallel, each handling a share of the \
+             traced threads. Ignored when a trace filter is given, and limited to the \
+             cores left over from compressing the trace. (default: %{default#Int})"]
+      |> Util.experimental_flag ~default
+    and coalesce_spans =
+      flag
+        "-coalesce-spans"
+        (optional (Command.Arg_type.create Time_ns.Span.of_string))
+        ~doc:
+          "DURATION Merge runs of leaf spans under the same parent which call the same \
+           function, or which are all shorter than DURATION (e.g. 100ns), into one span \
+           each. Shrinks traces of tight loops."
+      |> Util.experimental_flag ~default:None
+    and latency_report =
+      flag
+        "-latency-report"
+        (optional (Arg_type.comma_separated string))
+        ~doc:
+          "SYMBOLS Print percentiles of the durations of every call to each of these \
+           functions (comma-separated), and when the slowest calls were, across every \
+           thread and snapshot."
+    and window = Time_window.param
     and decode_opts = Backend.Decode_opts.param in
-    { Decode_opts.output_config; decode_opts; print_events }
+    { Decode_opts.output_config
+    ; decode_opts
+    ; print_events
+    ; trace_writer_domains
+    ; coalesce_spans
+    ; latency_report
+    ; window
+    }
   ;;
 
   let run_command =
@@ -796,7 +942,7 @@ end
 module Perf_tool_commands = Make_commands (Perf_tool_backend)
 
 let command =
-  let commands = Perf_tool_commands.commands in
+  let commands = Perf_tool_commands.commands @ [ "diff", Trace_diff.command ] in
   Command.group ~summary:"Magical tracing based on Intel Processor Trace" commands
 ;;
 
@@ -809,7 +955,7 @@ module For_testing = struct
         }
     in
     let%map events, _ =
-      get_events_and_close_result ~decode_events ~range_symbols
+      get_events_and_close_result ~decode_events ~range_symbols ~time_window:None
       |> Deferred.Or_error.ok_exn
     in
     List.hd_exn events
@@ -12,8 +12,10 @@ module For_testing : sig
 
   val write_trace_from_events
     :  ?ocaml_exception_info:Ocaml_exception_info.t
-    -> events_writer:Tracing_tool_output.events_writer option
-    -> writer:Tracing_zero.Writer.t option
+    -> ?trace_writer_domains:int
+    -> ?coalesce_spans:Time_ns.Span.t
+    -> ?latency_report:Latency_report.t
+    -> sink:Tracing_tool_output.sink
     -> trace_scope:Trace_scope.t
     -> debug_info:Elf.Addr_table.t option
     -> hits:(string * Breakpoint.Hit.t) list
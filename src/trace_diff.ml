@@ -0,0 +1,403 @@
+open! Core
+module Totals = Stack_profile.Totals
+module Trie = Stack_profile.Trie
+
+(* Time and calls per symbol, and per call path from a thread's outermost frame, summed
+   over every thread. *)
+module Profile = struct
+  type t =
+    { trie : Trie.t
+    ; mutable hits : int
+    }
+
+  let create () = { trie = Trie.create (); hits = 0 }
+end
+
+module Input = struct
+  (* The process [Trace_writer] writes trigger hits to, rather than to any thread of the
+     traced program. *)
+  let hits_process = "Snapshot symbol hits"
+
+  let load_fxt (profile : Profile.t) ~filename ~file_format =
+    Tracing.Streaming_parser.with_file ~filename ~file_format ~f:(fun parser ->
+      let threads = Hashtbl.create (module Int) in
+      while Tracing.Streaming_parser.next parser do
+        let time = Tracing.Streaming_parser.timestamp parser in
+        let { Tracing.Parser.Thread.pid; tid; process_name; _ } =
+          Tracing.Streaming_parser.thread parser
+        in
+        let kind = Tracing.Streaming_parser.event_kind parser in
+        if [%equal: string option] process_name (Some hits_process)
+        then (
+          match kind with
+          | Duration_complete | Instant -> profile.hits <- profile.hits + 1
+          | Duration_begin | Duration_end | Counter | Flow_begin | Flow_step | Flow_end ->
+            ())
+        else (
+          let thread =
+            Hashtbl.find_or_add
+              threads
+              ((pid lsl 32) lor tid)
+              ~default:Stack_profile.Thread.create
+          in
+          (* Names are only copied out of the trace once per string record. *)
+          let name () =
+            Tracing.Streaming_parser.lookup_string_exn
+              parser
+              (Tracing.Streaming_parser.name parser)
+          in
+          match kind with
+          | Duration_begin -> Stack_profile.Thread.begin_ thread ~name:(name ()) ~time
+          | Duration_end -> Stack_profile.Thread.end_ thread ~time
+          | Duration_complete ->
+            Stack_profile.Thread.complete
+              thread
+              ~name:(name ())
+              ~time
+              ~time_end:(Tracing.Streaming_parser.end_time_exn parser)
+          | Instant | Counter | Flow_begin | Flow_step | Flow_end ->
+            Stack_profile.Thread.saw_time thread time)
+      done;
+      Hashtbl.iter threads ~f:(Trie.end_thread profile.trie))
+  ;;
+
+  module Events_thread = struct
+    type t =
+      { thread : Stack_profile.Thread.t
+      ; mutable callstack : Symbol.t array
+      ; mutable last_time : Time_ns.Span.t option
+      }
+  end
+
+  (* Events files hold each event with the callstack it was decoded at, which is in effect
+     from the thread's previous event, so the frames which differ from the previous
+     callstack are ended and begun at the time of the previous event. Events files don't
+     record trigger hits. *)
+  let load_events profile ~filename ~(format : Tracing_tool_output.events_output_format) =
+    let compression_state = Callstack_compression.init () in
+    let threads = Hashtbl.create (module Event.Thread) in
+    let add { Trace_writer.Event_and_callstack.event; callstack } =
+      let callstack =
+        Callstack_compression.decompress_callstack compression_state callstack
+      in
+      match event with
+      | Error (_ : Event.Decode_error.t) -> ()
+      | Ok { thread; time; _ } ->
+        let events_thread =
+          Hashtbl.find_or_add threads thread ~default:(fun () ->
+            { Events_thread.thread = Stack_profile.Thread.create ()
+            ; callstack = [||]
+            ; last_time = None
+            })
+        in
+        let since = Option.value events_thread.last_time ~default:time in
+        let last_callstack = events_thread.callstack in
+        let rec common i =
+          if i < Array.length last_callstack
+             && i < Array.length callstack
+             && Symbol.equal last_callstack.(i) callstack.(i)
+          then common (i + 1)
+          else i
+        in
+        let common = common 0 in
+        for (_ : int) = common to Array.length last_callstack - 1 do
+          Stack_profile.Thread.end_ events_thread.thread ~time:since
+        done;
+        for i = common to Array.length callstack - 1 do
+          Stack_profile.Thread.begin_
+            events_thread.thread
+            ~name:(Symbol.display_name callstack.(i))
+            ~time:since
+        done;
+        events_thread.callstack <- callstack;
+        events_thread.last_time <- Some time;
+        Stack_profile.Thread.saw_time events_thread.thread time
+    in
+    In_channel.with_file ~binary:true filename ~f:(fun channel ->
+      match format with
+      | Sexp ->
+        (match Sexp.input_sexp channel with
+         | List [ Atom "V6"; List events ] ->
+           List.iter events ~f:(fun event ->
+             add ([%of_sexp: Trace_writer.Event_and_callstack.t] event))
+         | (_ : Sexp.t) ->
+           failwithf "%s was written by a different version of magic-trace" filename ())
+      | Binio ->
+        let expected_shape =
+          Bin_prot.Shape.(
+            eval_to_digest Trace_writer.Event_and_callstack.bin_shape_t
+            |> Digest.to_md5
+            |> Md5.to_binary)
+        in
+        (match In_channel.really_input_string channel (String.length expected_shape) with
+         | Some shape when String.equal shape expected_shape -> ()
+         | Some _ | None ->
+           failwithf "%s was written by a different version of magic-trace" filename ());
+        let header = Bytes.create Bin_prot.Utils.size_header_length in
+        let rec loop () =
+          match
+            In_channel.really_input channel ~buf:header ~pos:0 ~len:(Bytes.length header)
+          with
+          | None -> ()
+          | Some () ->
+            let len =
+              Bin_prot.Utils.bin_read_size_header
+                (Bigstring.of_bytes header)
+                ~pos_ref:(ref 0)
+            in
+            (match In_channel.really_input_string channel len with
+             | None -> failwithf "%s is truncated" filename ()
+             | Some event ->
+               add
+                 (Trace_writer.Event_and_callstack.bin_read_t
+                    (Bigstring.of_string event)
+                    ~pos_ref:(ref 0)));
+            loop ()
+        in
+        loop ());
+    Hashtbl.iter threads ~f:(fun { Events_thread.thread; _ } ->
+      Trie.end_thread profile.trie thread)
+  ;;
+
+  let load ~filename =
+    let profile = Profile.create () in
+    (if String.is_suffix filename ~suffix:".sexp"
+     then load_events profile ~filename ~format:Sexp
+     else if String.is_suffix filename ~suffix:".binio"
+     then load_events profile ~filename ~format:Binio
+     else (
+       let file_format : Tracing_zero.Writer.File_format.t =
+         if Filename.check_suffix filename ".gz"
+         then Gzip
+         else if Filename.check_suffix filename ".zst"
+         then Zstandard
+         else Uncompressed
+       in
+       load_fxt profile ~filename ~file_format));
+    profile
+  ;;
+end
+
+module Delta = struct
+  type t =
+    { key : string
+    ; a : Totals.t
+    ; b : Totals.t
+    }
+
+  (* Per trigger hit, where the recording has any. *)
+  let per_hit span ~hits =
+    Time_ns.Span.to_ns span /. Float.of_int (Int.max hits 1) |> Time_ns.Span.of_ns
+  ;;
+
+  let calls_per_hit calls ~hits = Float.of_int calls /. Float.of_int (Int.max hits 1)
+
+  let print t ~hits_a ~hits_b =
+    let inclusive_a = per_hit t.a.inclusive ~hits:hits_a in
+    let inclusive_b = per_hit t.b.inclusive ~hits:hits_b in
+    let delta = Time_ns.Span.( - ) inclusive_b inclusive_a in
+    printf
+      "%10s  inclusive %s -> %s  self %s -> %s  calls %g -> %g  %s\n"
+      ((if Time_ns.Span.is_negative delta then "" else "+")
+       ^ Time_ns.Span.to_string delta)
+      (Time_ns.Span.to_string inclusive_a)
+      (Time_ns.Span.to_string inclusive_b)
+      (Time_ns.Span.to_string (per_hit t.a.self ~hits:hits_a))
+      (Time_ns.Span.to_string (per_hit t.b.self ~hits:hits_b))
+      (calls_per_hit t.a.calls ~hits:hits_a)
+      (calls_per_hit t.b.calls ~hits:hits_b)
+      t.key
+  ;;
+end
+
+let print_deltas ~title ~top ~hits_a ~hits_b a b =
+  let a = Map.of_alist_reduce (module String) a ~f:Fn.const in
+  let b = Map.of_alist_reduce (module String) b ~f:Fn.const in
+  let deltas =
+    Map.merge a b ~f:(fun ~key -> function
+      | `Left a -> Some { Delta.key; a; b = Totals.zero }
+      | `Right b -> Some { Delta.key; a = Totals.zero; b }
+      | `Both (a, b) -> Some { Delta.key; a; b })
+    |> Map.data
+  in
+  let change (delta : Delta.t) =
+    Time_ns.Span.abs
+      (Time_ns.Span.( - )
+         (Delta.per_hit delta.b.inclusive ~hits:hits_b)
+         (Delta.per_hit delta.a.inclusive ~hits:hits_a))
+  in
+  printf "%s:\n" title;
+  let deltas =
+    List.stable_sort deltas ~compare:(fun x y ->
+      Time_ns.Span.descending (change x) (change y))
+  in
+  List.iter (List.take deltas top) ~f:(Delta.print ~hits_a ~hits_b)
+;;
+
+let diff ~top (a : Profile.t) (b : Profile.t) =
+  if a.hits > 0 && b.hits > 0
+  then printf "Per trigger hit, of %d in A and %d in B.\n" a.hits b.hits
+  else printf "Totals, as a recording has no trigger hits.\n";
+  let hits_a, hits_b = if a.hits > 0 && b.hits > 0 then a.hits, b.hits else 1, 1 in
+  print_deltas
+    ~title:"Symbols"
+    ~top
+    ~hits_a
+    ~hits_b
+    (Trie.symbols a.trie)
+    (Trie.symbols b.trie);
+  print_deltas
+    ~title:"Call paths"
+    ~top
+    ~hits_a
+    ~hits_b
+    (Trie.paths a.trie)
+    (Trie.paths b.trie)
+;;
+
+let command =
+  Command.basic_or_error
+    ~summary:"Compares the time spent in each function between two traces."
+    ~readme:(fun () ->
+      "Prints the functions and call paths whose inclusive time changed the most from \
+       trace A to trace B, along with their self time and number of calls. Where both \
+       recordings have trigger hits, times and calls are divided by the number of hits, \
+       so recordings of different lengths can be compared.\n\n\
+       Traces can be Fuchsia traces (*.fxt, *.fxt.gz) or events files (*.sexp, *.binio) \
+       written by magic-trace.")
+    (let%map_open.Command a = anon ("A" %: Filename_unix.arg_type)
+     and b = anon ("B" %: Filename_unix.arg_type)
+     and top =
+       let default = 20 in
+       flag
+         "-top"
+         (optional_with_default default int)
+         ~doc:
+           [%string
+             "N Print the N largest changes of each kind (default: %{default#Int})"]
+     in
+     fun () ->
+       Or_error.try_with (fun () ->
+         diff ~top (Input.load ~filename:a) (Input.load ~filename:b)))
+;;
+
+let%expect_test "diff" =
+  (* Spans on one thread, as the times they begin, with their names, and end. *)
+  let profile spans =
+    let profile = Profile.create () in
+    profile.hits <- 2;
+    let thread = Stack_profile.Thread.create () in
+    List.iter spans ~f:(fun (time, name) ->
+      let time = Time_ns.Span.of_int_ns time in
+      match name with
+      | Some name -> Stack_profile.Thread.begin_ thread ~name ~time
+      | None -> Stack_profile.Thread.end_ thread ~time);
+    Trie.end_thread profile.trie thread;
+    profile
+  in
+  let a =
+    profile
+      [ 0, Some "parse"
+      ; 100, None
+      ; 200, Some "parse"
+      ; 300, None
+      ; 1000, Some "handle"
+      ; 1010, Some "parse"
+      ; 1030, None
+      ; 1100, None
+      ]
+  in
+  (* Parses once more, and [handle] recurses instead of parsing. *)
+  let b =
+    profile
+      [ 0, Some "parse"
+      ; 100, None
+      ; 200, Some "parse"
+      ; 300, None
+      ; 400, Some "parse"
+      ; 500, None
+      ; 1000, Some "handle"
+      ; 1010, Some "handle"
+      ; 1030, None
+      ; 1100, None
+      ]
+  in
+  diff ~top:3 a b;
+  [%expect
+    {|
+    Per trigger hit, of 2 in A and 2 in B.
+    Symbols:
+         +40ns  inclusive 110ns -> 150ns  self 110ns -> 150ns  calls 1.5 -> 1.5  parse
+           +0s  inclusive 50ns -> 50ns  self 40ns -> 50ns  calls 0.5 -> 1  handle
+    Call paths:
+         +50ns  inclusive 100ns -> 150ns  self 100ns -> 150ns  calls 1 -> 1.5  parse
+         +10ns  inclusive 0s -> 10ns  self 0s -> 10ns  calls 0 -> 0.5  handle;handle
+         -10ns  inclusive 10ns -> 0s  self 10ns -> 0s  calls 0.5 -> 0  handle;parse
+    |}]
+;;
+
+let%expect_test "trace written starting inside a call" =
+  let filename = Filename_unix.temp_file "magic-trace" ".fxt" in
+  let trace = Tracing.Trace.create_for_file ~base_time:None ~filename in
+  let writer =
+    Trace_writer.create
+      ~trace_scope:Userspace
+      ~debug_info:None
+      ~ocaml_exception_info:None
+      ~earliest_time:Time_ns.Span.zero
+      ~hits:[]
+      ~annotate_inferred_start_times:false
+      trace
+  in
+  let write ns (kind : Event.Kind.t) ~from ~to_ =
+    let location name =
+      { Event.Location.instruction_pointer = 0L
+      ; symbol = From_perf name
+      ; symbol_offset = 0
+      }
+    in
+    Trace_writer.write_event
+      writer
+      (Event.With_write_info.create
+         ~should_write:true
+         (Ok
+            { thread = { pid = None; tid = None }
+            ; time = Time_ns.Span.of_int_ns ns
+            ; data =
+                Trace
+                  { trace_state_change = None
+                  ; kind = Some kind
+                  ; src = location from
+                  ; dst = location to_
+                  }
+            ; in_transaction = false
+            }))
+  in
+  (* The snapshot begins in [parse], called by [handle], called by [run]. *)
+  write 0 Return ~from:"parse" ~to_:"handle";
+  write 10 Call ~from:"handle" ~to_:"log";
+  write 20 Return ~from:"log" ~to_:"handle";
+  write 30 Return ~from:"handle" ~to_:"run";
+  write 40 Call ~from:"run" ~to_:"parse";
+  write 50 Return ~from:"parse" ~to_:"run";
+  Trace_writer.end_of_trace writer;
+  Tracing.Trace.close trace;
+  let profile = Input.load ~filename in
+  Core_unix.unlink filename;
+  List.sort (Trie.paths profile.trie) ~compare:(Comparable.lift String.compare ~f:fst)
+  |> List.iter ~f:(fun (path, { Totals.inclusive; self; calls }) ->
+    printf
+      !"%s  inclusive %{Time_ns.Span}  self %{Time_ns.Span}  calls %d\n"
+      path
+      inclusive
+      self
+      calls);
+  [%expect
+    {|
+    run  inclusive 50ns  self 10ns  calls 1
+    run;handle  inclusive 30ns  self 20ns  calls 1
+    run;handle;[unknown]  inclusive 0s  self 0s  calls 1
+    run;handle;log  inclusive 10ns  self 10ns  calls 1
+    run;parse  inclusive 10ns  self 10ns  calls 1
+    |}]
+;;
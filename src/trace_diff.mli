@@ -0,0 +1,6 @@
+open! Core
+
+(** [magic-trace diff A B]: compares the inclusive and self time and number of calls of
+    each function, and of each call path, between two traces or events files, and prints
+    the largest changes. *)
+val command : Command.t
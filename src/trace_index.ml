@@ -0,0 +1,512 @@
+open! Core
+open! Async
+
+module Source = struct
+  type t =
+    { reader : Tracing.Trace_reader.t
+    ; buf : Bigstring.t
+    }
+
+  let input t bytes ~pos ~len =
+    let len =
+      Tracing.Trace_reader.input
+        t.reader
+        t.buf
+        ~pos:0
+        ~len:(Int.min len (Bigstring.length t.buf))
+    in
+    Bigstring.To_bytes.blit ~src:t.buf ~src_pos:0 ~dst:bytes ~dst_pos:pos ~len;
+    len
+  ;;
+
+  let rec really_input t buf ~pos ~len =
+    if len = 0
+    then true
+    else (
+      match input t buf ~pos ~len with
+      | 0 -> false
+      | n -> really_input t buf ~pos:(pos + n) ~len:(len - n))
+  ;;
+
+  let really_input_exn t buf ~pos ~len =
+    if not (really_input t buf ~pos ~len) then failwith "Truncated trace"
+  ;;
+
+  let with_file ?offset ~filename ~file_format ~f =
+    Tracing.Trace_reader.with_file ?offset ~filename ~file_format ~f:(fun reader ->
+      f { reader; buf = Bigstring.create (64 * 1024) })
+  ;;
+end
+
+(* Just enough of the Fuchsia trace format to follow the string and thread tables. *)
+module Record = struct
+  type t =
+    { mutable bytes : Bytes.t
+    ; mutable length : int
+    }
+
+  let word t i = Stdlib.Bytes.get_int64_le t.bytes (i * 8) |> Int64.to_int_trunc
+  let header t = word t 0
+  let rtype t = header t land 0xf
+  let to_string t = Bytes.To_string.sub t.bytes ~pos:0 ~len:t.length
+
+  (* Returns false at the end of the trace. *)
+  let read t source =
+    if not (Source.really_input source t.bytes ~pos:0 ~len:8)
+    then false
+    else (
+      let header = header t in
+      (* Large records have a wider size field. *)
+      let words =
+        if header land 0xf = 15
+        then (header lsr 4) land 0xffff_ffff
+        else (header lsr 4) land 0xfff
+      in
+      if words = 0 then failwith "Invalid zero-sized record";
+      t.length <- words * 8;
+      if Bytes.length t.bytes < t.length
+      then (
+        let bytes = Bytes.create (Int.max t.length (2 * Bytes.length t.bytes)) in
+        Bytes.blit ~src:t.bytes ~src_pos:0 ~dst:bytes ~dst_pos:0 ~len:8;
+        t.bytes <- bytes);
+      Source.really_input_exn source t.bytes ~pos:8 ~len:(t.length - 8);
+      true)
+  ;;
+
+  module Type = struct
+    let metadata = 0
+    let initialization = 1
+    let string = 2
+    let thread = 3
+    let event = 4
+    let kernel_object = 7
+  end
+
+  let string_index t = (header t lsr 16) land 0x7fff
+
+  let string_value t =
+    Bytes.To_string.sub t.bytes ~pos:8 ~len:((header t lsr 32) land 0x7fff)
+  ;;
+
+  let thread_index t = (header t lsr 16) land 0xff
+  let event_name t = (header t lsr 48) land 0x7fff
+  let event_ticks t = word t 1
+
+  (* Durations end at their last word. *)
+  let event_end_ticks t =
+    if (header t lsr 16) land 0xf = 4 then word t ((t.length / 8) - 1) else event_ticks t
+  ;;
+
+  (* String references are indices unless their top bit is set, when the string is
+     inline. *)
+  let kernel_object_string_refs t =
+    let header = header t in
+    let name = (header lsr 24) land 0xffff in
+    let num_args = (header lsr 40) land 0xf in
+    let refs = ref (if name land 0x8000 = 0 then [ name ] else []) in
+    (* After the header and the object's id, maybe with its name inline *)
+    let pos =
+      ref (if name land 0x8000 = 0 then 2 else 2 + (((name land 0x7fff) + 7) / 8))
+    in
+    for _ = 1 to num_args do
+      let arg = word t !pos in
+      let arg_name = (arg lsr 16) land 0xffff in
+      if arg_name land 0x8000 = 0 then refs := arg_name :: !refs;
+      (* String arguments refer to their value too. *)
+      let value = (arg lsr 32) land 0xffff in
+      if arg land 0xf = 6 && value land 0x8000 = 0 then refs := value :: !refs;
+      pos := !pos + ((arg lsr 4) land 0xfff)
+    done;
+    List.filter !refs ~f:(fun index -> index <> 0)
+  ;;
+end
+
+module Chunk = struct
+  type t =
+    { offset : int
+    ; mutable length : int
+    ; mutable min_ticks : int
+    ; mutable max_ticks : int
+    ; (* String and thread records in effect at [offset], by index. *)
+      strings : string Int.Map.t
+    ; threads : string Int.Map.t
+    ; (* Every process and thread naming record before [offset], each after the string
+         records it refers to, most recent first. *)
+      kernel_objects : string list
+    }
+
+  let has_events t = t.min_ticks <= t.max_ticks
+end
+
+type t =
+  { filename : string
+  ; file_format : Tracing_zero.Writer.File_format.t
+  ; (* The metadata and tick initialization records from the start of the trace. *)
+    header : string
+  ; ticks_per_second : int
+  ; base_ticks : int
+  ; chunks : Chunk.t array
+  ; hits : (string * Time_ns.Span.t) list
+  ; end_ : Time_ns.Span.t
+  }
+
+let span_of_ticks ~ticks_per_second ~base_ticks ticks =
+  Float.of_int (ticks - base_ticks) *. 1e9 /. Float.of_int ticks_per_second
+  |> Float.iround_nearest_exn
+  |> Time_ns.Span.of_int_ns
+;;
+
+let ticks_of_span t span =
+  t.base_ticks
+  + Float.iround_nearest_exn
+      (Float.of_int (Time_ns.Span.to_int_ns span)
+       *. Float.of_int t.ticks_per_second
+       /. 1e9)
+;;
+
+let create ?(chunk_size = 4 * 1024 * 1024) ~filename ~file_format () =
+  Or_error.try_with (fun () ->
+    Source.with_file ~filename ~file_format ~f:(fun source ->
+      let record = { Record.bytes = Bytes.create 4096; length = 0 } in
+      let header = Buffer.create 256 in
+      let ticks_per_second = ref 1_000_000_000 in
+      let base_ticks = ref 0 in
+      let strings = ref Int.Map.empty in
+      let threads = ref Int.Map.empty in
+      let kernel_objects = ref [] in
+      (* Strings in use which name snapshot symbol hits, by index. *)
+      let hit_names = Int.Table.create () in
+      let hits = ref [] in
+      let chunks = Queue.create () in
+      let offset = ref 0 in
+      let start_chunk () =
+        let chunk =
+          { Chunk.offset = !offset
+          ; length = 0
+          ; min_ticks = Int.max_value
+          ; max_ticks = Int.min_value
+          ; strings = !strings
+          ; threads = !threads
+          ; kernel_objects = !kernel_objects
+          }
+        in
+        Queue.enqueue chunks chunk;
+        chunk
+      in
+      (* The first chunk starts after the trace's header, which is only written once. *)
+      let chunk = ref None in
+      while Record.read record source do
+        let rtype = Record.rtype record in
+        if rtype <> Record.Type.metadata
+           && rtype <> Record.Type.initialization
+           && rtype <> Record.Type.string
+           && Option.is_none !chunk
+        then chunk := Some (start_chunk ());
+        Option.iter !chunk ~f:(fun (current : Chunk.t) ->
+          current.length <- !offset - current.offset;
+          if current.length >= chunk_size then chunk := Some (start_chunk ()));
+        if rtype = Record.Type.metadata || rtype = Record.Type.initialization
+        then (
+          Buffer.add_subbytes header record.bytes ~pos:0 ~len:record.length;
+          if rtype = Record.Type.initialization
+          then (
+            ticks_per_second := Record.word record 1;
+            base_ticks := Record.word record 2))
+        else if rtype = Record.Type.string
+        then (
+          let index = Record.string_index record in
+          strings := Map.set !strings ~key:index ~data:(Record.to_string record);
+          let value = Record.string_value record in
+          if String.is_prefix value ~prefix:"hit "
+          then Hashtbl.set hit_names ~key:index ~data:value
+          else Hashtbl.remove hit_names index)
+        else if rtype = Record.Type.thread
+        then
+          threads
+          := Map.set
+               !threads
+               ~key:(Record.thread_index record)
+               ~data:(Record.to_string record)
+        else if rtype = Record.Type.kernel_object
+        then (
+          let strings =
+            List.filter_map
+              (Record.kernel_object_string_refs record)
+              ~f:(Map.find !strings)
+          in
+          kernel_objects
+          := String.concat (strings @ [ Record.to_string record ]) :: !kernel_objects)
+        else if rtype = Record.Type.event
+        then (
+          let current = Option.value_exn !chunk in
+          let ticks = Record.event_ticks record in
+          current.min_ticks <- Int.min current.min_ticks ticks;
+          current.max_ticks <- Int.max current.max_ticks (Record.event_end_ticks record);
+          Option.iter (Hashtbl.find hit_names (Record.event_name record)) ~f:(fun name ->
+            hits := (name, ticks) :: !hits));
+        offset := !offset + record.length
+      done;
+      Option.iter !chunk ~f:(fun (current : Chunk.t) ->
+        current.length <- !offset - current.offset);
+      let span_of_ticks =
+        span_of_ticks ~ticks_per_second:!ticks_per_second ~base_ticks:!base_ticks
+      in
+      let chunks = Queue.to_array chunks in
+      { filename
+      ; file_format
+      ; header = Buffer.contents header
+      ; ticks_per_second = !ticks_per_second
+      ; base_ticks = !base_ticks
+      ; chunks
+      ; hits = List.rev_map !hits ~f:(fun (name, ticks) -> name, span_of_ticks ticks)
+      ; end_ =
+          Array.fold chunks ~init:Time_ns.Span.zero ~f:(fun end_ (chunk : Chunk.t) ->
+            if Chunk.has_events chunk
+            then Time_ns.Span.max end_ (span_of_ticks chunk.max_ticks)
+            else end_)
+      }))
+;;
+
+let hits t = t.hits
+let end_ t = t.end_
+
+(* Calls [f] with each piece of the slice in order, until it returns false. *)
+let iter_slice t ~start ~end_ ~f =
+  let start = ticks_of_span t start in
+  let end_ = ticks_of_span t end_ in
+  let overlaps (chunk : Chunk.t) =
+    Chunk.has_events chunk && chunk.min_ticks <= end_ && chunk.max_ticks >= start
+  in
+  let overlapping =
+    Array.filter_mapi t.chunks ~f:(fun i chunk -> Option.some_if (overlaps chunk) i)
+  in
+  (* The string and thread records in effect at the start of [chunk], after the given
+     process and thread naming records, most recent first. *)
+  let records_before (chunk : Chunk.t) ~kernel_objects =
+    let records = Buffer.create (64 * 1024) in
+    List.iter (List.rev kernel_objects) ~f:(Buffer.add_string records);
+    Map.iter chunk.strings ~f:(Buffer.add_string records);
+    Map.iter chunk.threads ~f:(Buffer.add_string records);
+    Buffer.contents records
+  in
+  (* The header, and the records a chunk refers to from before it, so that it can be read
+     on its own. *)
+  let prologue (chunk : Chunk.t option) =
+    match chunk with
+    | None -> t.header
+    | Some chunk -> t.header ^ records_before chunk ~kernel_objects:chunk.kernel_objects
+  in
+  (* Reads the chunks from [first] to [last] in one go, returning false once [f] does. *)
+  let read_run (first, last) =
+    let first = t.chunks.(first) in
+    let last = t.chunks.(last) in
+    Source.with_file
+      ~offset:first.offset
+      ~filename:t.filename
+      ~file_format:t.file_format
+      ~f:(fun source ->
+        let rec loop remaining =
+          remaining <= 0
+          ||
+          let buf = Bytes.create (Int.min remaining (64 * 1024)) in
+          Source.really_input_exn source buf ~pos:0 ~len:(Bytes.length buf);
+          f (Bytes.unsafe_to_string ~no_mutation_while_string_reachable:buf)
+          && loop (remaining - Bytes.length buf)
+        in
+        loop (last.offset + last.length - first.offset))
+  in
+  if Array.is_empty overlapping
+  then (
+    (* Nothing is in the window, but the processes and threads are kept. *)
+    let last =
+      if Array.is_empty t.chunks
+      then None
+      else Some t.chunks.(Array.length t.chunks - 1)
+    in
+    ignore (f (prologue last) : bool))
+  else (
+    (* Chunks outside the window are left out, even between ones in it: [Trace_writer]
+       writes the begins of frames it infers as each thread ends, so the last chunk of a
+       trace has events from nearly all of it. Each run of consecutive chunks is preceded
+       by the records the chunks skipped over changed. *)
+    let runs =
+      Array.fold overlapping ~init:[] ~f:(fun runs i ->
+        match runs with
+        | (first, last) :: runs when last + 1 = i -> (first, i) :: runs
+        | runs -> (i, i) :: runs)
+      |> List.rev
+    in
+    let rec bridged_runs ~after = function
+      | [] -> true
+      | ((first, last) as run) :: runs ->
+        let chunk = t.chunks.(first) in
+        let skipped_from = t.chunks.(after + 1) in
+        let kernel_objects =
+          List.take
+            chunk.kernel_objects
+            (List.length chunk.kernel_objects - List.length skipped_from.kernel_objects)
+        in
+        f (records_before chunk ~kernel_objects)
+        && read_run run
+        && bridged_runs ~after:last runs
+    in
+    let ((first, last) as run) = List.hd_exn runs in
+    ignore
+      (f (prologue (Some t.chunks.(first)))
+       && read_run run
+       && bridged_runs ~after:last (List.tl_exn runs)
+       : bool))
+;;
+
+let slice t ~start ~end_ =
+  Pipe.create_reader ~close_on_exception:false (fun writer ->
+    match%map
+      Monitor.try_with (fun () ->
+        (* Reading the trace blocks, so it's done in a thread, which waits for the pipe
+           to take each piece. *)
+        In_thread.run (fun () ->
+          iter_slice t ~start ~end_ ~f:(fun piece ->
+            Thread_safe.block_on_async_exn (fun () ->
+              if Pipe.is_closed writer
+              then return false
+              else (
+                let%map () = Pipe.write writer piece in
+                true)))))
+    with
+    | Ok () -> ()
+    | Error exn ->
+      Core.eprintf !"Warning: failed to cut a window out of the trace: %{Exn}\n%!" exn)
+;;
+
+let%expect_test "slicing a window" =
+  let write_trace trace =
+    let pid = Tracing.Trace.allocate_pid trace ~name:"proc" in
+    let thread = Tracing.Trace.allocate_thread trace ~pid ~name:"main" in
+    List.iter [ "a", 0; "b", 1000; "hit foo", 1500; "c", 2000 ] ~f:(fun (name, ns) ->
+      Tracing.Trace.write_duration_complete
+        trace
+        ~args:[]
+        ~thread
+        ~category:""
+        ~name
+        ~time:(Time_ns.Span.of_int_ns ns)
+        ~time_end:(Time_ns.Span.of_int_ns (ns + 10)));
+    Tracing.Trace.close trace
+  in
+  let print_slice ~filename ~file_format =
+    (* Every record gets a chunk of its own. *)
+    let t = create ~chunk_size:1 ~filename ~file_format () |> Or_error.ok_exn in
+    print_s
+      [%message
+        ""
+          ~hits:(hits t : (string * Time_ns.Span.t) list)
+          ~end_:(end_ t : Time_ns.Span.t)];
+    let%map slice =
+      slice t ~start:(Time_ns.Span.of_int_ns 900) ~end_:(Time_ns.Span.of_int_ns 1100)
+      |> Pipe.to_list
+    in
+    let parser = Tracing.Parser.create (Iobuf.of_string (String.concat slice)) in
+    let rec print_records () =
+      let lookup index = Tracing.Parser.lookup_string_exn parser ~index in
+      match Tracing.Parser.parse_next parser with
+      | Error (_ : Tracing.Parser.Parse_error.t) -> ()
+      | Ok (Process_name_change { name; pid = _ }) ->
+        printf "process %s\n" (lookup name);
+        print_records ()
+      | Ok (Thread_name_change { name; pid = _; tid = _ }) ->
+        printf "thread %s\n" (lookup name);
+        print_records ()
+      | Ok (Event { timestamp; name; _ }) ->
+        printf "event %s @%d\n" (lookup name) (Time_ns.Span.to_int_ns timestamp);
+        print_records ()
+      | Ok (_ : Tracing.Parser.Record.t) -> print_records ()
+    in
+    print_records ()
+  in
+  let%bind () =
+    let filename = Filename_unix.temp_file "magic-trace" ".fxt" in
+    write_trace (Tracing.Trace.create_for_file ~base_time:None ~filename);
+    let%map () = print_slice ~filename ~file_format:Uncompressed in
+    Core_unix.unlink filename
+  in
+  [%expect
+    {|
+    ((hits (("hit foo" 1.5us))) (end_ 2.01us))
+    process proc
+    thread main
+    event b @1000
+    |}];
+  (* Frames of a record or two, so the window is read from a frame partway through. *)
+  let%map () =
+    let filename = Filename_unix.temp_file "magic-trace" ".fxt.zst" in
+    write_trace
+      (Tracing.Trace.Expert.create
+         ~base_time:None
+         (Tracing_zero.Writer.Expert.create
+            ~destination:
+              (Tracing_zero.Destinations.seekable_zstd_file_destination
+                 ~buffer_size:128
+                 ~num_domains:1
+                 ~filename
+                 ())
+            ()));
+    let%map () = print_slice ~filename ~file_format:Zstandard in
+    Core_unix.unlink filename;
+    Core_unix.unlink
+      (Tracing_zero.Destinations.Frame_index.filename
+         ~trace_filename:(Filename_unix.realpath filename))
+  in
+  [%expect
+    {|
+    ((hits (("hit foo" 1.5us))) (end_ 2.01us))
+    process proc
+    thread main
+    event b @1000
+    |}]
+;;
+
+let%expect_test "slicing leaves out chunks between those in the window" =
+  let filename = Filename_unix.temp_file "magic-trace" ".fxt" in
+  let trace = Tracing.Trace.create_for_file ~base_time:None ~filename in
+  let pid = Tracing.Trace.allocate_pid trace ~name:"proc" in
+  let thread = Tracing.Trace.allocate_thread trace ~pid ~name:"main" in
+  (* As [Trace_writer] writes a frame it infers was open from the start of the trace. *)
+  List.iter
+    [ "a", 0, 10; "b", 1000, 1010; "c", 2000, 2010; "outer", 0, 2010 ]
+    ~f:(fun (name, ns, end_ns) ->
+      Tracing.Trace.write_duration_complete
+        trace
+        ~args:[]
+        ~thread
+        ~category:""
+        ~name
+        ~time:(Time_ns.Span.of_int_ns ns)
+        ~time_end:(Time_ns.Span.of_int_ns end_ns));
+  Tracing.Trace.close trace;
+  let t =
+    create ~chunk_size:1 ~filename ~file_format:Uncompressed () |> Or_error.ok_exn
+  in
+  let%map slice =
+    slice t ~start:(Time_ns.Span.of_int_ns 900) ~end_:(Time_ns.Span.of_int_ns 1100)
+    |> Pipe.to_list
+  in
+  Core_unix.unlink filename;
+  let parser = Tracing.Parser.create (Iobuf.of_string (String.concat slice)) in
+  let rec print_events () =
+    match Tracing.Parser.parse_next parser with
+    | Error (_ : Tracing.Parser.Parse_error.t) -> ()
+    | Ok (Event { timestamp; name; _ }) ->
+      printf
+        "event %s @%d\n"
+        (Tracing.Parser.lookup_string_exn parser ~index:name)
+        (Time_ns.Span.to_int_ns timestamp);
+      print_events ()
+    | Ok (_ : Tracing.Parser.Record.t) -> print_events ()
+  in
+  print_events ();
+  [%expect
+    {|
+    event b @1000
+    event outer @0
+    |}]
+;;
@@ -0,0 +1,34 @@
+open! Core
+
+(** An index of a Fuchsia trace file by time, so that a window of it can be cut out as a
+    trace of its own, without loading the whole trace.
+
+    The trace's records are split into chunks of a few megabytes. Each chunk keeps the
+    range of event times in it, and the string, thread and process records in effect at
+    its start, so a run of chunks can be preceded by just those to make a valid trace.
+
+    Uncompressed, gzip and zstd traces can be indexed. Windows of zstd traces written with
+    a frame index are decompressed from the frame they start in, but gzip traces have to
+    be decompressed from the start for each run of chunks in a window. *)
+
+type t
+
+val create
+  :  ?chunk_size:int
+  -> filename:string
+  -> file_format:Tracing_zero.Writer.File_format.t
+  -> unit
+  -> t Or_error.t
+
+(** Events which mark a hit of a snapshot symbol, by name and time. *)
+val hits : t -> (string * Time_ns.Span.t) list
+
+(** The time of the last event in the trace. *)
+val end_ : t -> Time_ns.Span.t
+
+(** A trace of every chunk with events between [start] and [end_], so it may include some
+    events either side of the window, and spans begun before the first chunk are cut
+    off. Chunks between them with no events in the window are left out. The trace is
+    read in a thread and streamed through the pipe a piece at a time, and reading stops
+    if the pipe is closed. *)
+val slice : t -> start:Time_ns.Span.t -> end_:Time_ns.Span.t -> string Async.Pipe.Reader.t
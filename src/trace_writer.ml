@@ -59,31 +59,219 @@ module Pending_event = struct
   ;;
 end
 
+(* The events a thread has seen at its current timestamp, which [flush] spreads out over
+   the time until the next one. Deep call chains produce long runs of events sharing a
+   timestamp, so rather than consing up a [Pending_event.t] per event, a batch is kept as
+   parallel arrays that are reused from one batch to the next. Once they've grown to fit,
+   queueing an event doesn't allocate. *)
+module Pending_events = struct
+  module Kind = struct
+    type t =
+      | Call
+      | Ret
+      | Ret_from_untraced
+      | (* Forced by [end_of_thread], so the span it ends is cut short. *)
+        Ret_cut_short
+
+    let consumes_time = function
+      | Call -> true
+      | Ret | Ret_from_untraced | Ret_cut_short -> false
+    ;;
+  end
+
+  type t =
+    { mutable length : int
+    ; mutable num_consuming_time : int
+    ; mutable kinds : Kind.t array
+    ; (* The location called, or returned from. *)
+      mutable locations : Event.Location.t array
+    ; (* Only meaningful for [Ret_from_untraced]. *)
+      mutable reset_times : Mapped_time.t array
+    }
+
+  let initial_capacity = 16
+
+  let create () =
+    { length = 0
+    ; num_consuming_time = 0
+    ; kinds = Array.create ~len:initial_capacity Kind.Ret
+    ; locations = Array.create ~len:initial_capacity Event.Location.unknown
+    ; reset_times = Array.create ~len:initial_capacity Mapped_time.start_of_trace
+    }
+  ;;
+
+  let grow t =
+    let capacity = 2 * Array.length t.kinds in
+    let grow_array array ~default =
+      let grown = Array.create ~len:capacity default in
+      Array.blit ~src:array ~src_pos:0 ~dst:grown ~dst_pos:0 ~len:t.length;
+      grown
+    in
+    t.kinds <- grow_array t.kinds ~default:Kind.Ret;
+    t.locations <- grow_array t.locations ~default:Event.Location.unknown;
+    t.reset_times <- grow_array t.reset_times ~default:Mapped_time.start_of_trace
+  ;;
+
+  let add t (kind : Kind.t) location ~reset_time =
+    if t.length = Array.length t.kinds then grow t;
+    let i = t.length in
+    Array.unsafe_set t.kinds i kind;
+    Array.unsafe_set t.locations i location;
+    Array.unsafe_set t.reset_times i reset_time;
+    t.length <- i + 1;
+    if Kind.consumes_time kind then t.num_consuming_time <- t.num_consuming_time + 1
+  ;;
+
+  let clear t =
+    t.length <- 0;
+    t.num_consuming_time <- 0
+  ;;
+
+  let to_pending_event t i : Pending_event.t =
+    let location = t.locations.(i) in
+    match t.kinds.(i) with
+    | Call -> Pending_event.create_call location ~from_untraced:false
+    | Ret | Ret_cut_short -> { symbol = location.symbol; kind = Ret }
+    | Ret_from_untraced ->
+      { symbol = location.symbol
+      ; kind = Ret_from_untraced { reset_time = t.reset_times.(i) }
+      }
+  ;;
+
+  let sexp_of_t t =
+    List.init t.length ~f:(to_pending_event t) |> [%sexp_of: Pending_event.t list]
+  ;;
+end
+
+(* Every distinct location pushed onto any callstack, numbered densely. Callstacks store
+   these ids, so a frame costs one unboxed int however many threads' stacks it's on.
+
+   Locations are looked up by address, which is cheap to hash, and checked against the
+   symbol last seen there, which is usually the same [Symbol.t]. An address only gets a
+   new id if it's seen with a different symbol, e.g. after code is unloaded and
+   replaced. *)
+module Location_table = struct
+  type t =
+    { ids_by_address : int Int64.Table.t
+    ; mutable locations : Event.Location.t array
+    ; mutable length : int
+    }
+
+  let create () =
+    { ids_by_address = Int64.Table.create ()
+    ; locations = Array.create ~len:64 Event.Location.unknown
+    ; length = 0
+    }
+  ;;
+
+  let same_location (a : Event.Location.t) (b : Event.Location.t) =
+    a.symbol_offset = b.symbol_offset
+    && (phys_equal a.symbol b.symbol || Symbol.equal a.symbol b.symbol)
+  ;;
+
+  let add t location =
+    let id = t.length in
+    if id = Array.length t.locations
+    then (
+      let grown = Array.create ~len:(2 * id) Event.Location.unknown in
+      Array.blit ~src:t.locations ~src_pos:0 ~dst:grown ~dst_pos:0 ~len:id;
+      t.locations <- grown);
+    t.locations.(id) <- location;
+    t.length <- id + 1;
+    id
+  ;;
+
+  let id t (location : Event.Location.t) =
+    match Hashtbl.find t.ids_by_address location.instruction_pointer with
+    | Some id when same_location (Array.unsafe_get t.locations id) location -> id
+    | Some _ | None ->
+      let id = add t location in
+      Hashtbl.set t.ids_by_address ~key:location.instruction_pointer ~data:id;
+      id
+  ;;
+
+  let location t id = Array.unsafe_get t.locations id
+end
+
 module Callstack = struct
   type t =
-    { stack : Event.Location.t Stack.t
+    { locations : Location_table.t
+    ; (* Oldest frame first; the top of the stack is at [depth - 1]. *)
+      mutable ids : int array
+    ; mutable depth : int
     ; mutable create_time : Mapped_time.t
     }
-  [@@deriving sexp, bin_io]
 
-  let create ~create_time = { stack = Stack.create (); create_time }
-  let push t v = Stack.push t.stack v
-  let pop t = Stack.pop t.stack
-  let top t = Stack.top t.stack
-  let is_empty t = Stack.is_empty t.stack
-  let depth t = Stack.length t.stack
+  let create locations ~create_time = { locations; ids = [||]; depth = 0; create_time }
+
+  (* An empty callstack sharing [t]'s location table. *)
+  let create_like t ~create_time = create t.locations ~create_time
+  let is_empty t = t.depth = 0
+  let depth t = t.depth
+  let location_at t i = Location_table.location t.locations (Array.unsafe_get t.ids i)
+
+  let push t location =
+    if t.depth = Array.length t.ids
+    then (
+      let grown = Array.create ~len:(Int.max 16 (2 * t.depth)) 0 in
+      Array.blit ~src:t.ids ~src_pos:0 ~dst:grown ~dst_pos:0 ~len:t.depth;
+      t.ids <- grown);
+    Array.unsafe_set t.ids t.depth (Location_table.id t.locations location);
+    t.depth <- t.depth + 1
+  ;;
 
-  let how_many_match { stack; create_time = _ } (future_callstack : Event.Location.t list)
-    =
-    let zipped_stacks, _ =
-      List.zip_with_remainder (Stack.to_list stack |> List.rev) future_callstack
-    in
-    let ans =
-      List.take_while zipped_stacks ~f:(fun (current_location, future_location) ->
-        Int64.(current_location.instruction_pointer = future_location.instruction_pointer))
-      |> List.length
+  let top t = if t.depth = 0 then None else Some (location_at t (t.depth - 1))
+
+  let pop t =
+    let top = top t in
+    if t.depth > 0 then t.depth <- t.depth - 1;
+    top
+  ;;
+
+  (* Removes the oldest frame. *)
+  let drop_bottom t =
+    if t.depth > 0
+    then (
+      Array.blit ~src:t.ids ~src_pos:1 ~dst:t.ids ~dst_pos:0 ~len:(t.depth - 1);
+      t.depth <- t.depth - 1)
+  ;;
+
+  let exists t ~f =
+    let rec loop i = i >= 0 && (f (location_at t i) || loop (i - 1)) in
+    loop (t.depth - 1)
+  ;;
+
+  let iter_oldest_first t ~f =
+    for i = 0 to t.depth - 1 do
+      f (location_at t i)
+    done
+  ;;
+
+  let to_list_top_first t =
+    List.init t.depth ~f:(fun i -> location_at t (t.depth - 1 - i))
+  ;;
+
+  let sexp_of_t t =
+    [%sexp
+      { stack = (to_list_top_first t : Event.Location.t list)
+      ; create_time = (t.create_time : Mapped_time.t)
+      }]
+  ;;
+
+  (* The number of frames, counting from the oldest, which are at the same addresses as
+     the start of [future_callstack]. This only walks the common prefix. *)
+  let how_many_match t (future_callstack : Event.Location.t list) =
+    let rec loop i (future_callstack : Event.Location.t list) =
+      match future_callstack with
+      | future_location :: future_callstack
+        when i < t.depth
+             && Int64.(
+                  (location_at t i).instruction_pointer
+                  = future_location.instruction_pointer) ->
+        loop (i + 1) future_callstack
+      | _ -> i
     in
-    ans
+    loop 0 future_callstack
   ;;
 end
 
@@ -113,7 +301,7 @@ module Thread_info = struct
     ; inactive_callstacks : Callstack.t Stack.t
     ; mutable last_decode_error_time : Mapped_time.t
     ; ocaml_exception_state : ocaml_exception_state
-    ; mutable pending_events : Pending_event.t list
+    ; pending_events : Pending_events.t
     ; mutable pending_time : Mapped_time.t
     ; start_events : (Mapped_time.t * Pending_event.t) Deque.t
         (* When the last event arrived. Used to give timestamps to events lacking them. *)
@@ -125,7 +313,7 @@ module Thread_info = struct
 
   let set_callstack t ~is_kernel_address ~time =
     let create_time = if is_kernel_address then time else t.last_decode_error_time in
-    t.callstack <- Callstack.create ~create_time
+    t.callstack <- Callstack.create_like t.callstack ~create_time
   ;;
 
   let set_callstack_from_addr t ~addr ~time =
@@ -133,16 +321,78 @@ module Thread_info = struct
   ;;
 end
 
+(* Everything [write_call] writes for a call into a function apart from the address called
+   from, worked out the first time the function is called rather than on every call. *)
+module Call_template = struct
+  type t =
+    { symbol : Symbol.t
+    ; name : string
+    ; inferred_name : string
+    ; args_after_address : Tracing.Trace.Arg.t list
+    ; inferred_args_after_address : Tracing.Trace.Arg.t list
+    }
+
+  let create ~(debug_info : Elf.Addr_table.t) ~(symbol : Symbol.t) ~base_address =
+    let display_name = Symbol.display_name symbol in
+    let open Tracing.Trace.Arg in
+    (* Using [Interned] uses up the ~32k interned string slots around twice as fast on
+       sufficiently large programs, if the trace goes through a lot of different code.
+       Past that, the trace writer library recycles the least recently used slots, so
+       the cost is strings being written out again rather than a failure. It does make
+       the traces noticeably smaller.
+
+       ---
+
+       [base_address] might be lie in the kernel, in which case [to_int] will fail (but
+       that's alright, because we wouldn't have a symbol for it in the executable's
+       [debug_info] anyway). *)
+    let args_after_address args_after_symbol =
+      let symbol_arg = "symbol", Interned display_name in
+      let debug_info =
+        match symbol with
+        | From_perf_map { start_addr = _; size = _; function_ = _ } -> None
+        | _ -> Option.bind (Int64.to_int base_address) ~f:(Hashtbl.find debug_info)
+      in
+      match (debug_info : Elf.Location.t option) with
+      | None -> symbol_arg :: args_after_symbol
+      | Some info ->
+        ("line", Int info.line)
+        :: ("col", Int info.col)
+        :: symbol_arg
+        ::
+        (match info.filename with
+         | Some x -> ("file", Interned x) :: args_after_symbol
+         | None -> args_after_symbol)
+    in
+    { symbol
+    ; name = display_name
+    ; inferred_name = display_name ^ " [inferred start time]"
+    ; args_after_address = args_after_address []
+    ; inferred_args_after_address =
+        args_after_address [ "inferred_start_time", Interned "true" ]
+    }
+  ;;
+end
+
 module type Trace = Trace_writer_intf.S_trace
 
 type 'thread inner =
   { debug_info : Elf.Addr_table.t
+  ; locations : Location_table.t
+  ; (* Keyed by the address of the function called. *)
+    call_templates : Call_template.t Int64.Table.t
   ; ocaml_exception_info : Ocaml_exception_info.t option
   ; thread_info : 'thread Thread_info.t Hashtbl.M(Event.Thread).t
+  ; (* Consecutive events are nearly always from the same thread, so remember the last
+       thread's info rather than hashing every event's [Event.Thread.t]. *)
+    mutable last_thread : (Event.Thread.t * 'thread Thread_info.t) option
   ; base_time : Time_ns.Span.t
   ; trace_scope : Trace_scope.t
   ; trace : (module Trace with type thread = 'thread)
+  ; (* Writes any spans [trace] is holding back to coalesce. *)
+    flush_coalesced_spans : unit -> unit
   ; annotate_inferred_start_times : bool
+  ; latency_report : Latency_report.t option
   ; mutable in_filtered_region : bool
   ; suppressed_errors : Hash_set.M(Source_code_position).t
   ; mutable transaction_events : Event.With_write_info.t Deque.t
@@ -299,6 +549,8 @@ let write_hits (T t) hits =
 ;;
 
 let create_expert
+  ?coalesce_spans
+  ?latency_report
   ~trace_scope
   ~debug_info
   ~ocaml_exception_info
@@ -311,25 +563,55 @@ let create_expert
     List.fold hits ~init:earliest_time ~f:(fun acc (_, (hit : Breakpoint.Hit.t)) ->
       Time_ns.Span.min acc hit.timestamp)
   in
-  let t =
+  let create
+    : type thread.
+      (module Trace with type thread = thread) -> flush_coalesced_spans:(unit -> unit) -> t
+    =
+    fun trace ~flush_coalesced_spans ->
     T
       { debug_info = Option.value debug_info ~default:(Int.Table.create ())
+      ; locations = Location_table.create ()
+      ; call_templates = Int64.Table.create ()
       ; ocaml_exception_info
       ; thread_info = Hashtbl.create (module Event.Thread)
+      ; last_thread = None
       ; base_time
       ; trace_scope
       ; trace
+      ; flush_coalesced_spans
       ; annotate_inferred_start_times
+      ; latency_report
       ; in_filtered_region = true
       ; suppressed_errors = Hash_set.create (module Source_code_position)
       ; transaction_events = Deque.create ()
       }
   in
+  (* The latency report sees spans before they're coalesced. *)
+  let create
+    : type thread.
+      (module Trace with type thread = thread) -> flush_coalesced_spans:(unit -> unit) -> t
+    =
+    fun trace ~flush_coalesced_spans ->
+    match latency_report with
+    | None -> create trace ~flush_coalesced_spans
+    | Some latency_report ->
+      create (Latency_report.wrap latency_report trace) ~flush_coalesced_spans
+  in
+  let t =
+    match coalesce_spans with
+    | None -> create trace ~flush_coalesced_spans:ignore
+    | Some min_duration ->
+      let coalescer = Span_coalescer.create ~min_duration trace in
+      create (Span_coalescer.to_trace coalescer) ~flush_coalesced_spans:(fun () ->
+        Span_coalescer.flush coalescer)
+  in
   write_hits t hits;
   t
 ;;
 
 let create
+  ?coalesce_spans
+  ?latency_report
   ~trace_scope
   ~debug_info
   ~ocaml_exception_info
@@ -339,6 +621,8 @@ let create
   trace
   =
   create_expert
+    ?coalesce_spans
+    ?latency_report
     ~trace_scope
     ~debug_info
     ~ocaml_exception_info
@@ -348,81 +632,80 @@ let create
     (Real_trace.create trace)
 ;;
 
-let write_pending_event'
+let call_template t ~symbol ~base_address =
+  match Hashtbl.find t.call_templates base_address with
+  | Some (template : Call_template.t)
+    when phys_equal template.symbol symbol || Symbol.equal template.symbol symbol ->
+    template
+  | Some _ | None ->
+    let template = Call_template.create ~debug_info:t.debug_info ~symbol ~base_address in
+    Hashtbl.set t.call_templates ~key:base_address ~data:template;
+    template
+;;
+
+let write_call
   (type thread)
   (t : thread inner)
   (thread : thread Thread_info.t)
   time
-  { Pending_event.symbol; kind }
+  ~(symbol : Symbol.t)
+  ~addr
+  ~offset
+  ~from_untraced
   =
-  let display_name = Symbol.display_name symbol in
-  match kind with
-  | Call { addr; offset; from_untraced } ->
-    (* Adding a call is always the result of seeing something new on the top of the
-       stack, so the base address is just the current base address. *)
-    let base_address = Int64.(addr - of_int offset) in
-    let open Tracing.Trace.Arg in
-    let symbol_args =
-      (* Using [Interned] may cause some issues with the 32k interned string limit, on
-         sufficiently large programs if the trace goes through a lot of different code,
-         but that'll also be a problem with the span names. This will just make it
-         happen around twice as fast. It does make the traces noticeably smaller.
-
-         The real solution is to get around to improving the interning table management
-         in the trace writer library.
-
-         ---
-
-         [base_address] might be lie in the kernel, in which case [to_int] will fail (but
-         that's alright, because we wouldn't have a symbol for it in the executable's
-         [debug_info] anyway). *)
-      let address = [ "address", Pointer addr ] in
-      match symbol with
-      | From_perf_map { start_addr = _; size = _; function_ = _ } ->
-        address @ [ "symbol", Interned display_name ]
-      | _ ->
-        (match Option.bind (Int64.to_int base_address) ~f:(Hashtbl.find t.debug_info) with
-         | None -> address @ [ "symbol", Interned display_name ]
-         | Some (info : Elf.Location.t) ->
-           address
-           @ [ "line", Int info.line
-             ; "col", Int info.col
-             ; "symbol", Interned display_name
-             ]
-           @
-             (match info.filename with
-             | Some x -> [ "file", Interned x ]
-             | None -> []))
-    in
-    let inferred_start_time_arg =
-      if from_untraced then [ "inferred_start_time", Interned "true" ] else []
-    in
-    let args = symbol_args @ inferred_start_time_arg in
-    let name =
-      if t.annotate_inferred_start_times && from_untraced
-      then display_name ^ " [inferred start time]"
-      else display_name
-    in
-    write_duration_begin t ~thread:thread.thread ~name ~time ~args
-  | Ret -> write_duration_end t ~name:display_name ~time ~thread:thread.thread ~args:[]
-  | Ret_from_untraced { reset_time } ->
-    write_duration_complete
+  (* Adding a call is always the result of seeing something new on the top of the
+     stack, so the base address is just the current base address. *)
+  let base_address = Int64.(addr - of_int offset) in
+  let template = call_template t ~symbol ~base_address in
+  let args_after_address =
+    if from_untraced
+    then template.inferred_args_after_address
+    else template.args_after_address
+  in
+  let name =
+    if t.annotate_inferred_start_times && from_untraced
+    then template.inferred_name
+    else template.name
+  in
+  write_duration_begin
+    t
+    ~thread:thread.thread
+    ~name
+    ~time
+    ~args:(("address", Tracing.Trace.Arg.Pointer addr) :: args_after_address)
+;;
+
+let write_ret ?(cut_short = false) t (thread : _ Thread_info.t) time ~symbol =
+  let write () =
+    write_duration_end
       t
-      ~time:reset_time
-      ~time_end:time
-      ~name:(Symbol.display_name Unknown)
+      ~name:(Symbol.display_name symbol)
+      ~time
       ~thread:thread.thread
       ~args:[]
+  in
+  match t.latency_report with
+  | Some latency_report when cut_short ->
+    Latency_report.cutting_spans_short latency_report ~f:write
+  | Some _ | None -> write ()
 ;;
 
-(* It would be reasonable to also have returns consume time, but making them not
-   consume time substantially reduces the frequency where we need to use zero-duration
-   events. In general the traces are easier to read if returns aren't counted as consuming
-   time. *)
-let consumes_time { Pending_event.symbol = _; kind } =
+let write_ret_from_untraced t (thread : _ Thread_info.t) time ~reset_time =
+  write_duration_complete
+    t
+    ~time:reset_time
+    ~time_end:time
+    ~name:(Symbol.display_name Unknown)
+    ~thread:thread.thread
+    ~args:[]
+;;
+
+let write_pending_event' t thread time { Pending_event.symbol; kind } =
   match kind with
-  | Call _ -> true
-  | Ret | Ret_from_untraced _ -> false
+  | Call { addr; offset; from_untraced } ->
+    write_call t thread time ~symbol ~addr ~offset ~from_untraced
+  | Ret -> write_ret t thread time ~symbol
+  | Ret_from_untraced { reset_time } -> write_ret_from_untraced t thread time ~reset_time
 ;;
 
 let write_pending_event
@@ -439,16 +722,50 @@ let write_pending_event
   | _ -> write_pending_event' t thread time ev
 ;;
 
+(* [write_pending_event] for the [i]th event of [thread]'s batch, which only builds a
+   [Pending_event.t] for the events that have to be held back. *)
+let write_batched_event
+  (t : _ inner)
+  (thread : _ Thread_info.t)
+  time
+  (pending : Pending_events.t)
+  i
+  =
+  let location = Array.unsafe_get pending.locations i in
+  match Array.unsafe_get pending.kinds i with
+  | Call when Mapped_time.is_base_time time ->
+    Deque.enqueue_back thread.start_events (time, Pending_events.to_pending_event pending i)
+  | Ret_from_untraced ->
+    Deque.enqueue_front thread.start_events (time, Pending_events.to_pending_event pending i)
+  | Call ->
+    write_call
+      t
+      thread
+      time
+      ~symbol:location.symbol
+      ~addr:location.instruction_pointer
+      ~offset:location.symbol_offset
+      ~from_untraced:false
+  | Ret -> write_ret t thread time ~symbol:location.symbol
+  | Ret_cut_short -> write_ret t thread time ~symbol:location.symbol ~cut_short:true
+;;
+
 let flush (t : _ inner) ~to_time (thread : _ Thread_info.t) =
   (* Try to evenly distribute the time between timestamp updates between all the
-     time-consuming events in the batch. *)
-  let count = List.count thread.pending_events ~f:consumes_time in
+     time-consuming events in the batch.
+
+     It would be reasonable to also have returns consume time, but making them not
+     consume time substantially reduces the frequency where we need to use zero-duration
+     events. In general the traces are easier to read if returns aren't counted as
+     consuming time. *)
+  let pending = thread.pending_events in
+  let count = pending.num_consuming_time in
   let total_ns = Mapped_time.diff to_time thread.pending_time |> Time_ns.Span.to_int_ns in
   let ns_offset = ref 0 in
   let shares_consumed = ref 0 in
-  List.iter (List.rev thread.pending_events) ~f:(fun ev ->
+  for i = 0 to pending.length - 1 do
     let ns_share =
-      if consumes_time ev
+      if Pending_events.Kind.consumes_time (Array.unsafe_get pending.kinds i)
       then (
         incr shares_consumed;
         (total_ns - !ns_offset) / (count - !shares_consumed + 1))
@@ -456,14 +773,22 @@ let flush (t : _ inner) ~to_time (thread : _ Thread_info.t) =
     in
     let time = Mapped_time.add thread.pending_time (Time_ns.Span.of_int_ns !ns_offset) in
     ns_offset := !ns_offset + ns_share;
-    write_pending_event t thread time ev);
+    write_batched_event t thread time pending i
+  done;
   thread.pending_time <- to_time;
-  thread.pending_events <- []
+  Pending_events.clear pending
 ;;
 
-let add_event (t : _ inner) (thread : _ Thread_info.t) time ev =
+let add_event
+  (t : _ inner)
+  (thread : _ Thread_info.t)
+  time
+  (kind : Pending_events.Kind.t)
+  location
+  ~reset_time
+  =
   if Mapped_time.( <> ) time thread.pending_time then flush t ~to_time:time thread;
-  thread.pending_events <- ev :: thread.pending_events
+  Pending_events.add thread.pending_events kind location ~reset_time
 ;;
 
 let opt_pid_to_string opt_pid =
@@ -540,7 +865,7 @@ let create_thread t event =
   let track_group_id = allocate_pid t ~name in
   let thread = allocate_thread t ~pid:track_group_id ~name:"main" in
   { Thread_info.thread
-  ; callstack = Callstack.create ~create_time:effective_time
+  ; callstack = Callstack.create t.locations ~create_time:effective_time
   ; inactive_callstacks = Stack.create ()
   ; last_decode_error_time = effective_time
   ; ocaml_exception_state =
@@ -549,7 +874,7 @@ let create_thread t event =
        | Some ocaml_exception_info ->
          With_exception_info
            { ocaml_exception_info; last_known_instruction_pointer = ref None })
-  ; pending_events = []
+  ; pending_events = Pending_events.create ()
   ; pending_time = Mapped_time.start_of_trace
   ; start_events = Deque.create ()
   ; last_event_time = effective_time
@@ -558,15 +883,43 @@ let create_thread t event =
   }
 ;;
 
+let thread_info_of_event t event =
+  let thread = Event.thread event in
+  match t.last_thread with
+  | Some (last_thread, thread_info)
+    when [%compare.equal: Event.Thread.t] last_thread thread -> thread_info
+  | Some _ | None ->
+    let thread_info =
+      Hashtbl.find_or_add t.thread_info thread ~default:(fun () -> create_thread t event)
+    in
+    t.last_thread <- Some (thread, thread_info);
+    thread_info
+;;
+
 let call t thread_info ~time ~location =
-  let ev = Pending_event.create_call location ~from_untraced:false in
-  add_event t thread_info time ev;
+  add_event t thread_info time Call location ~reset_time:Mapped_time.start_of_trace;
   Callstack.push thread_info.callstack location
 ;;
 
-let ret_without_checking_for_go_hacks t (thread_info : _ Thread_info.t) ~time =
+let unknown_return_location =
+  { Event.Location.unknown with symbol = From_perf "[unknown]" }
+;;
+
+let ret_without_checking_for_go_hacks
+  ?(cut_short = false)
+  t
+  (thread_info : _ Thread_info.t)
+  ~time
+  =
   match Callstack.pop thread_info.callstack with
-  | Some { symbol; _ } -> add_event t thread_info time { symbol; kind = Ret }
+  | Some location ->
+    add_event
+      t
+      thread_info
+      time
+      (if cut_short then Ret_cut_short else Ret)
+      location
+      ~reset_time:Mapped_time.start_of_trace
   | None ->
     (* No known stackframe was popped --- could occur if the start of the snapshot
        started in the middle of a tracing region *)
@@ -574,24 +927,24 @@ let ret_without_checking_for_go_hacks t (thread_info : _ Thread_info.t) ~time =
       t
       thread_info
       time
-      { symbol = From_perf "[unknown]"
-      ; kind = Ret_from_untraced { reset_time = thread_info.callstack.create_time }
-      }
+      Ret_from_untraced
+      unknown_return_location
+      ~reset_time:thread_info.callstack.create_time
 ;;
 
-let rec clear_callstack t (thread_info : _ Thread_info.t) ~time =
+let rec clear_callstack ?cut_short t (thread_info : _ Thread_info.t) ~time =
   let ret = ret_without_checking_for_go_hacks in
   match Callstack.top thread_info.callstack with
   | None -> ()
   | Some _ ->
-    ret t thread_info ~time;
-    clear_callstack t thread_info ~time
+    ret ?cut_short t thread_info ~time;
+    clear_callstack ?cut_short t thread_info ~time
 ;;
 
 (* Unlike [clear_callstack], [clear_all_callstacks] also returns from all inactive
-   callstacks. *)
+   callstacks. The spans it ends are cut short, since they'd have gone on past [time]. *)
 let rec clear_all_callstacks t thread_info ~time =
-  clear_callstack t thread_info ~time;
+  clear_callstack t thread_info ~time ~cut_short:true;
   match Stack.pop thread_info.inactive_callstacks with
   | None -> ()
   | Some callstack ->
@@ -639,9 +992,7 @@ end = struct
   ;;
 
   let current_stack_contains_known_gogo_destination (thread_info : _ Thread_info.t) =
-    Stack.find thread_info.callstack.stack ~f:(fun location ->
-      is_known_gogo_destination location)
-    |> Option.is_some
+    Callstack.exists thread_info.callstack ~f:is_known_gogo_destination
   ;;
 
   let rec pop_until_gogo_destination t (thread_info : _ Thread_info.t) ~time =
@@ -774,7 +1125,9 @@ end = struct
     clear_callstack t thread_info ~time;
     match Stack.pop thread_info.inactive_callstacks with
     | Some callstack -> thread_info.callstack <- callstack
-    | None -> thread_info.callstack <- Callstack.create ~create_time:time
+    | None ->
+      thread_info.callstack
+      <- Callstack.create_like thread_info.callstack ~create_time:time
   ;;
 
   let check_current_symbol_track_entertraps
@@ -792,10 +1145,7 @@ end = struct
          first (synthetic) frame missing. A more principled approach would be the one
          outlined in another CR-someday below, where we teach [Callstack] about traps
          directly. *)
-      let s = thread_info.callstack.stack |> Stack.to_list in
-      let s = List.take s (List.length s - 1) in
-      Stack.clear thread_info.callstack.stack;
-      List.iter (List.rev s) ~f:(fun x -> Stack.push thread_info.callstack.stack x);
+      Callstack.drop_bottom thread_info.callstack;
       clear_trap_stack t thread_info ~time
     | _ -> check_current_symbol t thread_info ~time dst
   ;;
@@ -833,7 +1183,8 @@ end = struct
                   generation of new frames). *)
                let top = Callstack.top thread_info.callstack |> Option.value_exn in
                Stack.push thread_info.inactive_callstacks thread_info.callstack;
-               thread_info.callstack <- Callstack.create ~create_time:time;
+               thread_info.callstack
+               <- Callstack.create_like thread_info.callstack ~create_time:time;
                Callstack.push thread_info.callstack top
              | Poptrap ->
                (* Assuming we didn't drop anything, we should only have the synthetic
@@ -895,12 +1246,12 @@ let end_of_trace ?to_time (T t) =
       thread_info.pending_time <- mapped_time;
       thread_info.last_event_time <- mapped_time;
       thread_info.callstack.create_time <- mapped_time
-    | None -> ())
+    | None -> ());
+  t.flush_coalesced_spans ()
 ;;
 
 let rewrite_callstack t ~(callstack : Callstack.t) ~thread_info ~time =
-  let called_locations = callstack.stack |> Stack.to_list |> List.rev in
-  List.iter called_locations ~f:(fun location ->
+  Callstack.iter_oldest_first callstack ~f:(fun location ->
     write_pending_event'
       t
       thread_info
@@ -948,11 +1299,10 @@ let write_event_and_callstack
   callstack
   =
   let compression_event =
-    Callstack_compression.compress_callstack
+    Callstack_compression.compress_frames
       events_writer.callstack_compression_state
-      (Callstack.(callstack.stack)
-       |> Stack.to_list
-       |> List.map ~f:(fun Event.Location.{ symbol; _ } -> symbol))
+      ~depth:(Callstack.depth callstack)
+      ~symbol_at:(fun i -> Event.Location.symbol (Callstack.location_at callstack i))
   in
   let event_and_callstack =
     Event_and_callstack.{ event; callstack = compression_event }
@@ -1023,10 +1373,7 @@ let rec write_event (T t) ?events_writer original_event =
 
 and write_event' (T t) ?events_writer event =
   let { Event.With_write_info.event; should_write } = event in
-  let thread = Event.thread event in
-  let thread_info =
-    Hashtbl.find_or_add t.thread_info thread ~default:(fun () -> create_thread t event)
-  in
+  let thread_info = thread_info_of_event t event in
   let thread = thread_info.thread in
   let time = event_time t event thread_info in
   let outer_event = event in
@@ -1100,11 +1447,13 @@ and write_event' (T t) ?events_writer event =
        ; in_transaction = _
        } ->
        let how_many_ret =
-         Stack.length thread_info.callstack.stack
+         Callstack.depth thread_info.callstack
          - Callstack.how_many_match thread_info.callstack callstack
        in
-       List.init how_many_ret ~f:Fn.id |> List.iter ~f:(fun _ -> ret t thread_info ~time);
-       let calls = List.drop callstack (Stack.length thread_info.callstack.stack) in
+       for _ = 1 to how_many_ret do
+         ret t thread_info ~time
+       done;
+       let calls = List.drop callstack (Callstack.depth thread_info.callstack) in
        List.iter calls ~f:(fun location -> call t thread_info ~time ~location)
      | { Event.Ok.thread = _ (* Already used this to look up thread info. *)
        ; time = _ (* Already in scope. Also, this time hasn't been [map_time]'d. *)
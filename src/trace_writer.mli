@@ -9,8 +9,13 @@ val debug : bool ref
 
 type t [@@deriving sexp_of]
 
+(** If [coalesce_spans] is given, runs of tiny leaf spans are merged as described in
+    [Span_coalescer], with it as the [min_duration]. If [latency_report] is given, the
+    spans of its symbols are added to it. *)
 val create
-  :  trace_scope:Trace_scope.t
+  :  ?coalesce_spans:Time_ns.Span.t
+  -> ?latency_report:Latency_report.t
+  -> trace_scope:Trace_scope.t
   -> debug_info:Elf.Addr_table.t option
   -> ocaml_exception_info:Ocaml_exception_info.t option
   -> earliest_time:Time_ns.Span.t
@@ -34,11 +39,7 @@ module Mapped_time : sig
 end
 
 module Callstack : sig
-  type t =
-    { stack : Event.Location.t Stack.t
-    ; mutable create_time : Mapped_time.t
-    }
-  [@@deriving sexp, bin_io]
+  type t [@@deriving sexp_of]
 end
 
 module Event_and_callstack : sig
@@ -50,7 +51,9 @@ module Event_and_callstack : sig
 end
 
 val create_expert
-  :  trace_scope:Trace_scope.t
+  :  ?coalesce_spans:Time_ns.Span.t
+  -> ?latency_report:Latency_report.t
+  -> trace_scope:Trace_scope.t
   -> debug_info:Elf.Addr_table.t option
   -> ocaml_exception_info:Ocaml_exception_info.t option
   -> earliest_time:Time_ns.Span.t
@@ -0,0 +1,306 @@
+open! Core
+open! Async
+
+(* A bounded queue for handing work from the Async thread to a shard's domain. If the
+   shard fails, its exception is kept in the channel and raised by every later push. *)
+module Channel = struct
+  type 'a t =
+    { queue : 'a Queue.t
+    ; capacity : int
+    ; mutex : Stdlib.Mutex.t
+    ; not_empty : Stdlib.Condition.t
+    ; not_full : Stdlib.Condition.t
+    ; mutable error : exn option
+    }
+
+  let create ~capacity =
+    { queue = Queue.create ()
+    ; capacity
+    ; mutex = Stdlib.Mutex.create ()
+    ; not_empty = Stdlib.Condition.create ()
+    ; not_full = Stdlib.Condition.create ()
+    ; error = None
+    }
+  ;;
+
+  let raise_if_failed_locked t =
+    match t.error with
+    | None -> ()
+    | Some exn ->
+      Stdlib.Mutex.unlock t.mutex;
+      raise exn
+  ;;
+
+  let enqueue_locked t x =
+    Queue.enqueue t.queue x;
+    Stdlib.Condition.signal t.not_empty;
+    Stdlib.Mutex.unlock t.mutex
+  ;;
+
+  (* Blocks until there's room, so must not be called from the Async thread. *)
+  let push t x =
+    Stdlib.Mutex.lock t.mutex;
+    while Option.is_none t.error && Queue.length t.queue >= t.capacity do
+      Stdlib.Condition.wait t.not_full t.mutex
+    done;
+    raise_if_failed_locked t;
+    enqueue_locked t x
+  ;;
+
+  (* Returns false instead of blocking if the channel is full. *)
+  let try_push t x =
+    Stdlib.Mutex.lock t.mutex;
+    raise_if_failed_locked t;
+    if Queue.length t.queue >= t.capacity
+    then (
+      Stdlib.Mutex.unlock t.mutex;
+      false)
+    else (
+      enqueue_locked t x;
+      true)
+  ;;
+
+  let pop t =
+    Stdlib.Mutex.lock t.mutex;
+    while Queue.is_empty t.queue do
+      Stdlib.Condition.wait t.not_empty t.mutex
+    done;
+    let x = Queue.dequeue_exn t.queue in
+    Stdlib.Condition.signal t.not_full;
+    Stdlib.Mutex.unlock t.mutex;
+    x
+  ;;
+
+  (* Called by the consumer as it gives up, waking any push waiting for room. *)
+  let fail t exn =
+    Stdlib.Mutex.lock t.mutex;
+    t.error <- Some exn;
+    Stdlib.Condition.broadcast t.not_full;
+    Stdlib.Mutex.unlock t.mutex
+  ;;
+
+  let raise_if_failed t =
+    Stdlib.Mutex.lock t.mutex;
+    raise_if_failed_locked t;
+    Stdlib.Mutex.unlock t.mutex
+  ;;
+end
+
+module Message = struct
+  type t =
+    | Events of Event.With_write_info.t Queue.t
+    | End_of_trace of Time_ns.Span.t option
+    | Finish
+end
+
+module Shard = struct
+  type t =
+    { filename : string
+    ; channel : Message.t Channel.t
+    ; domain : unit Stdlib.Domain.t
+    ; mutable buffered : Event.With_write_info.t Queue.t
+    ; (* Messages not yet handed to the shard, oldest first. *)
+      pending : Message.t Queue.t
+    }
+
+  (* Enough batches to keep a shard busy while the Async thread waits on [perf]. *)
+  let max_queued_messages = 64
+
+  (* Runs on the shard's domain. *)
+  let run channel ~trace ~writer =
+    let rec loop () =
+      match (Channel.pop channel : Message.t) with
+      | Events events ->
+        Queue.iter events ~f:(Trace_writer.write_event writer);
+        loop ()
+      | End_of_trace to_time ->
+        Trace_writer.end_of_trace ?to_time writer;
+        loop ()
+      | Finish ->
+        Trace_writer.end_of_trace writer;
+        Tracing.Trace.close trace
+    in
+    try loop () with
+    | exn -> Channel.fail channel exn
+  ;;
+
+  let create ~shard ~base_time ~create_writer =
+    let filename = Filename_unix.temp_file "magic-trace-shard" ".fxt" in
+    (* The shard's own domain does the writing, so there's no need for another one to
+       write in the background. *)
+    let trace =
+      Tracing.Trace.Expert.create
+        ~base_time:(Some base_time)
+        (Tracing_zero.Writer.Expert.create
+           ~destination:(Tracing_zero.Destinations.direct_file_destination ~filename ())
+           ())
+    in
+    let writer = create_writer ~shard trace in
+    let channel = Channel.create ~capacity:max_queued_messages in
+    let domain = Stdlib.Domain.spawn (fun () -> run channel ~trace ~writer) in
+    { filename; channel; domain; buffered = Queue.create (); pending = Queue.create () }
+  ;;
+
+  let enqueue_buffered t =
+    if not (Queue.is_empty t.buffered)
+    then (
+      Queue.enqueue t.pending (Message.Events t.buffered);
+      t.buffered <- Queue.create ())
+  ;;
+
+  (* Pushes what it can without blocking, and waits for room for the rest on another
+     thread so the Async thread is free meanwhile. *)
+  let flush t =
+    enqueue_buffered t;
+    let rec push_without_blocking () =
+      match Queue.peek t.pending with
+      | None -> true
+      | Some message ->
+        Channel.try_push t.channel message
+        && (ignore (Queue.dequeue_exn t.pending : Message.t);
+            push_without_blocking ())
+    in
+    if push_without_blocking ()
+    then Deferred.unit
+    else (
+      let messages = Queue.to_list t.pending in
+      Queue.clear t.pending;
+      In_thread.run (fun () -> List.iter messages ~f:(Channel.push t.channel)))
+  ;;
+
+  let finish t =
+    enqueue_buffered t;
+    Queue.enqueue t.pending Finish;
+    (* A push can only fail once the shard has failed and its domain has returned, in
+       which case [raise_if_failed] raises the shard's exception below. *)
+    let%bind (_ : (unit, exn) Result.t) = Monitor.try_with (fun () -> flush t) in
+    let%map () = In_thread.run (fun () -> Stdlib.Domain.join t.domain) in
+    Channel.raise_if_failed t.channel
+  ;;
+end
+
+type t =
+  { trace : Tracing.Trace.t
+  ; shards : Shard.t array
+  }
+
+(* Leaves a core for the Async thread and for each domain compressing the real trace. *)
+let max_shards () =
+  Int.max
+    1
+    (Stdlib.Domain.recommended_domain_count ()
+     - 1
+     - Tracing_zero.Destinations.default_compression_domains ())
+;;
+
+let create ~num_shards ~base_time ~create_writer trace =
+  let shards =
+    Array.init num_shards ~f:(fun shard -> Shard.create ~shard ~base_time ~create_writer)
+  in
+  { trace; shards }
+;;
+
+let write_event t (event : Event.With_write_info.t) =
+  let thread = Event.thread event.event in
+  let shard = t.shards.(Event.Thread.hash thread % Array.length t.shards) in
+  Queue.enqueue shard.buffered event
+;;
+
+let flush t = Deferred.Array.iter ~how:`Parallel t.shards ~f:Shard.flush
+
+let end_of_trace ?to_time t =
+  Array.iter t.shards ~f:(fun (shard : Shard.t) ->
+    Shard.enqueue_buffered shard;
+    Queue.enqueue shard.pending (End_of_trace to_time))
+;;
+
+module Record_type = struct
+  let metadata = 0
+  let initialization = 1
+  let thread = 3
+  let kernel_object = 7
+end
+
+(* Copies a shard's records into the real trace as they are, but for its header. A shard
+   sets every string and thread slot its events refer to before they do, so each shard
+   still reads correctly after the ones merged before it. Process and thread ids, which
+   every shard allocates from 1, are moved past [koid_offset]. Returns the highest id
+   after moving, for the next shard to start past.
+
+   Shards number counters by name from 1 too, but [Trace_writer] only writes the one. *)
+let merge_shard t ~filename ~koid_offset =
+  In_channel.with_file ~binary:true filename ~f:(fun channel ->
+    let record = ref (Bytes.create 4096) in
+    let word i = Stdlib.Bytes.get_int64_le !record (i * 8) |> Int64.to_int_trunc in
+    let max_koid = ref koid_offset in
+    let move_koid i =
+      let koid = word i + koid_offset in
+      Stdlib.Bytes.set_int64_le !record (i * 8) (Int64.of_int koid);
+      max_koid := Int.max !max_koid koid
+    in
+    (* Words of an inline string, which a reference with its top bit set stands for. *)
+    let inline_words string_ref =
+      if string_ref land 0x8000 = 0 then 0 else ((string_ref land 0x7fff) + 7) / 8
+    in
+    let rec loop () =
+      match In_channel.really_input channel ~buf:!record ~pos:0 ~len:8 with
+      | None -> ()
+      | Some () ->
+        let header = word 0 in
+        let rtype = header land 0xf in
+        (* Large records have a wider size field. *)
+        let words =
+          if rtype = 15
+          then (header lsr 4) land 0xffff_ffff
+          else (header lsr 4) land 0xfff
+        in
+        if words = 0
+        then raise_s [%message "Zero-sized record in trace shard" (filename : string)];
+        let len = words * 8 in
+        if Bytes.length !record < len
+        then (
+          let bytes = Bytes.create (Int.max len (2 * Bytes.length !record)) in
+          Bytes.blit ~src:!record ~src_pos:0 ~dst:bytes ~dst_pos:0 ~len:8;
+          record := bytes);
+        (match In_channel.really_input channel ~buf:!record ~pos:8 ~len:(len - 8) with
+         | Some () -> ()
+         | None -> raise_s [%message "Truncated trace shard" (filename : string)]);
+        if rtype = Record_type.thread
+        then (
+          move_koid 1;
+          move_koid 2)
+        else if rtype = Record_type.kernel_object
+        then (
+          move_koid 1;
+          (* Threads name their process with a kernel object id argument. *)
+          let pos = ref (2 + inline_words ((header lsr 24) land 0xffff)) in
+          for (_ : int) = 1 to (header lsr 40) land 0xf do
+            let arg = word !pos in
+            if arg land 0xf = 8
+            then move_koid (!pos + 1 + inline_words ((arg lsr 16) land 0xffff));
+            pos := !pos + ((arg lsr 4) land 0xfff)
+          done);
+        if rtype <> Record_type.metadata && rtype <> Record_type.initialization
+        then Tracing.Trace.Expert.write_records t.trace !record ~pos:0 ~len;
+        loop ()
+    in
+    loop ();
+    !max_koid)
+;;
+
+let finish t =
+  let%map results =
+    Deferred.Array.map ~how:`Parallel t.shards ~f:(fun shard ->
+      Monitor.try_with (fun () -> Shard.finish shard))
+  in
+  Exn.protect
+    ~f:(fun () ->
+      Array.iter results ~f:Result.ok_exn;
+      let (_ : int) =
+        Array.fold t.shards ~init:0 ~f:(fun koid_offset (shard : Shard.t) ->
+          merge_shard t ~filename:shard.filename ~koid_offset)
+      in
+      ())
+    ~finally:(fun () ->
+      Array.iter t.shards ~f:(fun (shard : Shard.t) -> Core_unix.unlink shard.filename))
+;;
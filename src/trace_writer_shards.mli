@@ -0,0 +1,45 @@
+open! Core
+open! Async
+
+(** Writes a trace with several [Trace_writer.t]s running in parallel, each on its own
+    domain.
+
+    Events are sharded by thread, so each shard sees every event of the threads it owns in
+    order, and nothing else. Each shard writes through its own [Tracing.Trace.t] into a
+    private temporary file, with its own interned strings, threads and pids. [finish] then
+    copies the shards' records into the real trace one after another, as each shard sets
+    the strings and threads it refers to itself, only moving each shard's pids and tids
+    past those of the shards before it.
+
+    [Trace_writer] state which spans threads isn't shared between shards, so this can't be
+    used with trace filters.
+
+    If a shard raises, its exception is raised by the next [flush] or [finish]. *)
+type t
+
+(** The most shards worth running alongside the Async thread and the domains compressing
+    the real trace. *)
+val max_shards : unit -> int
+
+val create
+  :  num_shards:int
+  -> base_time:Time_ns.t
+       (** The [base_time] the real trace was created with. *)
+  -> create_writer:(shard:int -> Tracing.Trace.t -> Trace_writer.t)
+  -> Tracing.Trace.t
+  -> t
+
+(** Buffers an event for the shard which owns its thread. *)
+val write_event : t -> Event.With_write_info.t -> unit
+
+(** Hands buffered events and ends of traces to the shards. Becomes determined once the
+    shards have room for them, which is immediately unless they've fallen far behind. *)
+val flush : t -> unit Deferred.t
+
+(** Like [Trace_writer.end_of_trace], for every shard, after the events buffered so far.
+    Takes effect on the next [flush]. *)
+val end_of_trace : ?to_time:Time_ns.Span.t -> t -> unit
+
+(** Waits for every shard to finish writing, then merges them into the real trace, which
+    shouldn't have been written to but for its header. Doesn't close the real trace. *)
+val finish : t -> unit Deferred.t
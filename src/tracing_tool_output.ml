@@ -34,12 +34,92 @@ module Serve = struct
     Uri.path uri
   ;;
 
+  (* A window of trace time to cut out of the trace, e.g. [?start=10ms&end=20ms]. *)
+  let window_of_request req =
+    let uri = Cohttp_async.Request.uri req in
+    match Uri.get_query_param uri "start", Uri.get_query_param uri "end" with
+    | Some start, Some end_ ->
+      Or_error.try_with (fun () ->
+        Some (Time_ns.Span.of_string start, Time_ns.Span.of_string end_))
+    | _ -> Ok None
+  ;;
+
+  let html_escape s =
+    String.concat_map s ~f:(function
+      | '<' -> "&lt;"
+      | '>' -> "&gt;"
+      | '&' -> "&amp;"
+      | '"' -> "&quot;"
+      | c -> String.of_char c)
+  ;;
+
+  let window_query (start, end_) =
+    [%string "?start=%{start#Time_ns.Span}&end=%{end_#Time_ns.Span}"]
+  ;;
+
+  (* Lets the user load a window of the trace, either by hand or around a hit. The hits
+     and the trace's end are left out while [index] is still being built. *)
+  let window_picker ~window ~(index : Trace_index.t option) =
+    let value bound =
+      Option.value_map window ~default:"" ~f:(fun window ->
+        Time_ns.Span.to_string (bound window))
+    in
+    let trace_end =
+      match index with
+      | None -> "(indexing the trace)"
+      | Some index -> [%string "of %{Trace_index.end_ index#Time_ns.Span}"]
+    in
+    let hit_links =
+      List.take (Option.value_map index ~default:[] ~f:Trace_index.hits) 20
+      |> List.map ~f:(fun (name, time) ->
+        let start = Time_ns.Span.(max zero (time - of_int_ms 10)) in
+        let end_ = Time_ns.Span.(time + of_int_ms 1) in
+        let href = html_escape (window_query (start, end_)) in
+        [%string {|<a href="/%{href}">%{html_escape name} @ %{time#Time_ns.Span}</a>|}])
+      |> String.concat ~sep:" "
+    in
+    [%string
+      {|
+    <form
+      action="/"
+      style="
+        position: fixed;
+        bottom: 0px;
+        right: 0px;
+        z-index: 1;
+        padding: 4px;
+        background: white;
+        font: 12px sans-serif;
+      ">
+      Window <input name="start" size="8" value="%{value fst}">
+      to <input name="end" size="8" value="%{value snd}">
+      %{trace_end}
+      <input type="submit" value="Load">
+      <a href="/">Whole trace</a>
+      %{hit_links}
+    </form>
+      |}]
+  ;;
+
   let respond_string ~content_type ?flush ?headers ?status s =
     let headers = Cohttp.Header.add_opt headers "Content-Type" content_type in
     Cohttp_async.Server.respond_string ?flush ~headers ?status s
   ;;
 
-  let respond_index t ~filename =
+  (* [index] is [None] while it's still being built. *)
+  let respond_index t ~filename ~window ~index =
+    (* The trace's URL is itself a parameter, so its own parameters need escaping. *)
+    let trace_url =
+      [%string "%{url t}/trace/%{filename}"]
+      ^ Option.value_map window ~default:"" ~f:(fun window ->
+        Uri.pct_encode ~component:`Query_value (window_query window))
+    in
+    let window_picker =
+      match index with
+      | None -> window_picker ~window ~index:None
+      | Some (Ok index) -> window_picker ~window ~index:(Some index)
+      | Some (Error (_ : Error.t)) -> ""
+    in
     respond_string
       ~content_type:"text/html"
       ~status:`OK
@@ -54,7 +134,7 @@ module Serve = struct
   </head>
   <body>
     <iframe
-      src="/ui/index.html#!/viewer?url=%{url t}/trace/%{filename}"
+      src="/ui/index.html#!/viewer?url=%{trace_url}"
       style="
         position: fixed;
         border: none;
@@ -67,27 +147,65 @@ module Serve = struct
         height: 100%;
       ">
     </iframe>
+    %{window_picker}
   </body>
   </html>
     |}]
   ;;
 
-  let serve_trace_file t ~filename ~store_path =
+  (* [fxt_format] is [None] if the trace isn't in the Fuchsia format, so can't be cut into
+     windows. *)
+  let serve_trace_file t ~filename ~store_path ~fxt_format =
     let static_handler =
       Cohttp_static_handler.directory_handler ~directory:t.perfetto_ui_base_directory ()
     in
+    (* Built in the background from the start, since it means reading the whole trace,
+       so the page can be served before it's ready. *)
+    let index =
+      match fxt_format with
+      | None -> return (Or_error.error_string "Only Fuchsia traces can be windowed")
+      | Some file_format ->
+        In_thread.run (fun () -> Trace_index.create ~filename:store_path ~file_format ())
+    in
     let handler ~body addr request =
       let path = request_path request in
       (* Uncomment this to debug routing *)
       (* Core.printf "%s\n%!" path; *)
       match path with
-      | "" | "/" | "/index.html" -> respond_index t ~filename
+      | "" | "/" | "/index.html" ->
+        respond_index
+          t
+          ~filename
+          ~window:(Or_error.ok (window_of_request request) |> Option.join)
+          ~index:(Deferred.peek index)
       (* Serve the trace under any name under /trace/ so only the HTML has to change *)
       | s when String.is_prefix s ~prefix:"/trace/" ->
-        let headers =
-          Cohttp.Header.add_opt None "Content-Type" "application/octet-stream"
-        in
-        Cohttp_async.Server.respond_with_file ~headers store_path
+        (match window_of_request request with
+         | Ok None ->
+           let headers =
+             Cohttp.Header.add_opt None "Content-Type" "application/octet-stream"
+           in
+           Cohttp_async.Server.respond_with_file ~headers store_path
+         | Ok (Some (start, end_)) ->
+           (match%bind index with
+            | Error error ->
+              respond_string
+                ~content_type:"text/plain"
+                ~status:`Bad_request
+                (Error.to_string_hum error)
+            | Ok index ->
+              let headers =
+                Cohttp.Header.add_opt None "Content-Type" "application/octet-stream"
+              in
+              Cohttp_async.Server.respond_with_pipe
+                ~headers
+                ~code:`OK
+                (Trace_index.slice index ~start ~end_))
+         | Error error ->
+           respond_string
+             ~content_type:"text/plain"
+             ~status:`Bad_request
+             (Error.to_string_hum error))
       | _ -> static_handler ~body addr request
     in
     let where_to_listen =
@@ -134,6 +252,13 @@ type events_writer =
   ; callstack_compression_state : Callstack_compression.t
   }
 
+type sink =
+  | Events of events_writer
+  | Fxt of Tracing_zero.Writer.t
+  | Rolling of Rolling_trace.t
+  | Perfetto of Perfetto_trace.t
+  | Profile of Stack_profile.t
+
 type display_mode =
   | Disabled
   | Serve of Serve.t
@@ -142,6 +267,7 @@ type display_mode =
 type t =
   { display_mode : display_mode
   ; output_path : string
+  ; rollover : Rolling_trace.Limits.t option
   }
 
 let param =
@@ -154,15 +280,15 @@ let param =
       ~doc:
         [%string
           "FILE File to output the trace to. File format depends on suffix [*.sexp \
-           *.binio *.fxt] (default: '%{default}')"]
+           *.binio *.fxt *.pftrace *.folded *.pb.gz] (default: '%{default}')"]
   and display_mode =
     [ Serve.maybe_param |> Option.map ~f:(map ~f:(fun s -> Serve s))
     ; Share.maybe_param |> Option.map ~f:(map ~f:(fun s -> Share s))
     ]
     |> List.filter_opt
     |> choose_one_non_optional ~if_nothing_chosen:(Default_to Disabled)
-  in
-  { display_mode; output_path }
+  and rollover = Rolling_trace.Limits.param in
+  { display_mode; output_path; rollover }
 ;;
 
 let notify_trace ~store_path =
@@ -170,6 +296,11 @@ let notify_trace ~store_path =
   Deferred.Or_error.ok_unit
 ;;
 
+let notify_profile ~store_path =
+  Core.eprintf "Wrote profile to %s.\n%!" store_path;
+  Deferred.Or_error.ok_unit
+;;
+
 let maybe_stash_old_trace ~filename =
   (* Replicate [perf]'s behavior when the output file already exists. *)
   try Core_unix.rename ~src:filename ~dst:(filename ^ ".old") with
@@ -180,19 +311,60 @@ let write_and_maybe_serve
   ?num_temp_strs
   t
   ~filename
-  ~(f :
-      events_writer:events_writer option
-      -> writer:Tracing_zero.Writer.t option
-      -> unit
-      -> 'a Deferred.Or_error.t)
+  ~(f : sink -> 'a Deferred.Or_error.t)
   =
   let open Deferred.Or_error.Let_syntax in
   maybe_stash_old_trace ~filename;
-  let { display_mode; output_path } = t in
+  let { display_mode; output_path; rollover } = t in
   let matches_sexp = String.is_suffix ~suffix:".sexp" output_path in
   let matches_binio = String.is_suffix ~suffix:".binio" output_path in
-  match matches_sexp || matches_binio with
-  | false ->
+  let matches_perfetto = String.is_suffix ~suffix:".pftrace" output_path in
+  let profile_format = Stack_profile.Format.of_filename output_path in
+  let file_format : Tracing_zero.Writer.File_format.t =
+    if Filename.check_suffix filename ".gz"
+    then Gzip
+    else if Filename.check_suffix filename ".zst"
+    then Zstandard
+    else Uncompressed
+  in
+  let%bind () =
+    match profile_format, display_mode, rollover with
+    | None, _, _ | Some _, Disabled, None -> return ()
+    | Some _, (Serve _ | Share _), _ ->
+      Deferred.Or_error.error_string
+        "-serve and -share show a timeline, so can't be used with a profile -output"
+    | Some _, Disabled, Some _ ->
+      Deferred.Or_error.error_string
+        "-rollover-* only writes Fuchsia traces, so can't be used with a profile -output"
+  in
+  match matches_sexp || matches_binio, rollover with
+  | false, Some limits ->
+    let%bind () =
+      match display_mode with
+      | Disabled -> return ()
+      | Serve _ | Share _ ->
+        Deferred.Or_error.error_string
+          "-serve and -share need a single trace file, so can't be used with -rollover-*"
+    in
+    let%bind () =
+      if matches_perfetto
+      then
+        Deferred.Or_error.error_string
+          "-rollover-* only writes Fuchsia traces, so can't be used with a .pftrace \
+           -output"
+      else return ()
+    in
+    let rolling_trace =
+      Rolling_trace.create ?num_temp_strs limits ~output_path ~file_format
+    in
+    let%map res = f (Rolling rolling_trace) in
+    Core.eprintf
+      "Wrote %d trace files, listed in %s. Visit https://magic-trace.org/ and open any \
+       of them to view trace.\n%!"
+      (Rolling_trace.num_files rolling_trace)
+      (Rolling_trace.manifest_filename rolling_trace);
+    res
+  | false, None ->
     let fd = Core_unix.openfile output_path ~mode:[ O_RDWR; O_CREAT; O_CLOEXEC ] in
     (* Write to and serve from an indirect reference to [fxt_path], through our process'
        fd table. This is a little grotesque, but avoids a race where the user runs
@@ -200,31 +372,42 @@ let write_and_maybe_serve
        [-serve] -- without this hack, the earlier magic-trace serving instance would start
        serving the new trace, which is unlikely to be what the user expected. *)
     let indirect_store_path = [%string "/proc/self/fd/%{fd#Core_unix.File_descr}"] in
-    let writer =
-      let file_format : Tracing_zero.Writer.File_format.t =
-        if Filename.check_suffix filename ".gz"
-        then Gzip
-        else if Filename.check_suffix filename ".zst"
-        then Zstandard
-        else Uncompressed
-      in
-      Tracing_zero.Writer.create_for_file
-        ?num_temp_strs
-        ~file_format
-        ~filename:indirect_store_path
-        ()
+    let%bind res =
+      match profile_format, matches_perfetto with
+      | Some format, (_ : bool) ->
+        let profile = Stack_profile.create ~format ~filename:indirect_store_path in
+        f (Profile profile)
+      | None, true ->
+        let perfetto_trace = Perfetto_trace.create ~filename:indirect_store_path in
+        f (Perfetto perfetto_trace)
+      | None, false ->
+        let writer =
+          Tracing_zero.Writer.create_for_file
+            ?num_temp_strs
+            ~file_format
+            ~mmap:Env_vars.mmap_output
+            ~filename:indirect_store_path
+            ()
+        in
+        f (Fxt writer)
     in
-    let%bind res = f ~events_writer:None ~writer:(Some writer) () in
     let%bind () =
       match display_mode with
-      | Disabled -> notify_trace ~store_path:output_path
+      | Disabled ->
+        (match profile_format with
+         | Some (_ : Stack_profile.Format.t) -> notify_profile ~store_path:output_path
+         | None -> notify_trace ~store_path:output_path)
       | Share share -> Share.share_trace_file share ~output_path
       | Serve serve ->
-        Serve.serve_trace_file serve ~filename ~store_path:indirect_store_path
+        Serve.serve_trace_file
+          serve
+          ~filename
+          ~store_path:indirect_store_path
+          ~fxt_format:(if matches_perfetto then None else Some file_format)
     in
     Core_unix.close fd;
     return res
-  | true ->
+  | true, (_ : Rolling_trace.Limits.t option) ->
     let%map res =
       let format =
         match matches_sexp with
@@ -235,7 +418,7 @@ let write_and_maybe_serve
         let events_writer =
           { format; writer; callstack_compression_state = Callstack_compression.init () }
         in
-        f ~events_writer:(Some events_writer) ~writer:None ())
+        f (Events events_writer))
     in
     res
 ;;
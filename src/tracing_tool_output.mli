@@ -13,20 +13,24 @@ type events_writer =
   ; callstack_compression_state : Callstack_compression.t
   }
 
+(** Where [write_and_maybe_view] has [f] write, depending on [-output]. *)
+type sink =
+  | Events of events_writer (** [*.sexp] or [*.binio] *)
+  | Fxt of Tracing_zero.Writer.t
+  | Rolling of Rolling_trace.t (** A Fuchsia trace with [-rollover-*] *)
+  | Perfetto of Perfetto_trace.t (** [*.pftrace] *)
+  | Profile of Stack_profile.t (** [*.folded], [*.pb] or [*.pb.gz] *)
+
 (** Offers configuration parameters for where to save a file and whether to serve it *)
 val param : t Command.Param.t
 
 (** After [f] writes a trace, either hosts a Perfetto UI server for the resulting file or
     just saves it and prints a message about how to view the resulting trace.
 
-    It is the responsibility of [f] to close the writer and Perfetto may fail to load the
+    It is the responsibility of [f] to close the sink and Perfetto may fail to load the
     trace if the writer isn't closed. *)
 val write_and_maybe_view
   :  ?num_temp_strs:int
   -> t
-  -> f:
-       (events_writer:events_writer option
-        -> writer:Tracing_zero.Writer.t option
-        -> unit
-        -> 'a Deferred.Or_error.t)
+  -> f:(sink -> 'a Deferred.Or_error.t)
   -> 'a Deferred.Or_error.t
@@ -3,17 +3,17 @@ open Magic_trace_lib
 
 let compressed_test_string =
   {|(
-      ((new_symbols())(callstack()))
-      ((new_symbols())(callstack()))
-      ((new_symbols())(callstack()))
-      ((new_symbols(((From_perf _start)0)))(callstack((0 0))))
-      ((new_symbols((Untraced 1)))(callstack((1 0)(0 0))))
-      ((new_symbols())(callstack((0 0))))
-      ((new_symbols(((From_perf _dl_start)2)))(callstack((2 0)(0 0))))
-      ((new_symbols())(callstack((1 1)(0 0))))
-      ((new_symbols())(callstack((2 1))))
-      ((new_symbols())(callstack((1 2))))
-      ((new_symbols())(callstack((2 1))))
+      ((new_symbols())(new_nodes())(callstack 0))
+      ((new_symbols())(new_nodes())(callstack 0))
+      ((new_symbols())(new_nodes())(callstack 0))
+      ((new_symbols((From_perf _start)))(new_nodes((0 0)))(callstack 1))
+      ((new_symbols(Untraced))(new_nodes((1 1)))(callstack 2))
+      ((new_symbols())(new_nodes())(callstack 1))
+      ((new_symbols((From_perf _dl_start)))(new_nodes((1 2)))(callstack 3))
+      ((new_symbols())(new_nodes((1 0)(4 1)))(callstack 5))
+      ((new_symbols())(new_nodes())(callstack 3))
+      ((new_symbols())(new_nodes())(callstack 5))
+      ((new_symbols())(new_nodes())(callstack 3))
     )|}
 ;;
 
@@ -23,13 +23,13 @@ let decompressed_test_string =
       ()
       ()
       ((From_perf _start))
-      (Untraced (From_perf _start))
+      ((From_perf _start) Untraced)
       ((From_perf _start))
-      ((From_perf _dl_start) (From_perf _start))
-      (Untraced (From_perf _start) (From_perf _start))
-      ((From_perf _dl_start) (From_perf _start))
-      (Untraced (From_perf _start) (From_perf _start))
-      ((From_perf _dl_start) (From_perf _start))
+      ((From_perf _start) (From_perf _dl_start))
+      ((From_perf _start) (From_perf _start) Untraced)
+      ((From_perf _start) (From_perf _dl_start))
+      ((From_perf _start) (From_perf _start) Untraced)
+      ((From_perf _start) (From_perf _dl_start))
     )|}
 ;;
 
@@ -41,25 +41,25 @@ let%expect_test "decompress" =
   let state = Callstack_compression.init () in
   List.iter compression_events ~f:(fun comp_event ->
     let callstack = Callstack_compression.decompress_callstack state comp_event in
-    print_s [%sexp (callstack : Symbol.t list)]);
+    print_s [%sexp (callstack : Symbol.t array)]);
   [%expect
     {|
       ()
       ()
       ()
       ((From_perf _start))
-      (Untraced (From_perf _start))
+      ((From_perf _start) Untraced)
       ((From_perf _start))
-      ((From_perf _dl_start) (From_perf _start))
-      (Untraced (From_perf _start) (From_perf _start))
-      ((From_perf _dl_start) (From_perf _start))
-      (Untraced (From_perf _start) (From_perf _start))
-      ((From_perf _dl_start) (From_perf _start))|}]
+      ((From_perf _start) (From_perf _dl_start))
+      ((From_perf _start) (From_perf _start) Untraced)
+      ((From_perf _start) (From_perf _dl_start))
+      ((From_perf _start) (From_perf _start) Untraced)
+      ((From_perf _start) (From_perf _dl_start))|}]
 ;;
 
 let%expect_test "compress" =
   let compression_events =
-    [%of_sexp: Symbol.t list list] (Sexp.of_string decompressed_test_string)
+    [%of_sexp: Symbol.t array list] (Sexp.of_string decompressed_test_string)
   in
   let state = Callstack_compression.init () in
   List.iter compression_events ~f:(fun callstack ->
@@ -67,15 +67,15 @@ let%expect_test "compress" =
     print_s [%sexp (comp_event : Callstack_compression.compression_event)]);
   [%expect
     {|
-    ((new_symbols ()) (callstack ()))
-    ((new_symbols ()) (callstack ()))
-    ((new_symbols ()) (callstack ()))
-    ((new_symbols (((From_perf _start) 0))) (callstack ((0 0))))
-    ((new_symbols ((Untraced 1))) (callstack ((1 0) (0 0))))
-    ((new_symbols ()) (callstack ((0 0))))
-    ((new_symbols (((From_perf _dl_start) 2))) (callstack ((2 0) (0 0))))
-    ((new_symbols ()) (callstack ((1 1) (0 0))))
-    ((new_symbols ()) (callstack ((2 1))))
-    ((new_symbols ()) (callstack ((1 2))))
-    ((new_symbols ()) (callstack ((2 1))))|}]
+    ((new_symbols ()) (new_nodes ()) (callstack 0))
+    ((new_symbols ()) (new_nodes ()) (callstack 0))
+    ((new_symbols ()) (new_nodes ()) (callstack 0))
+    ((new_symbols ((From_perf _start))) (new_nodes ((0 0))) (callstack 1))
+    ((new_symbols (Untraced)) (new_nodes ((1 1))) (callstack 2))
+    ((new_symbols ()) (new_nodes ()) (callstack 1))
+    ((new_symbols ((From_perf _dl_start))) (new_nodes ((1 2))) (callstack 3))
+    ((new_symbols ()) (new_nodes ((1 0) (4 1))) (callstack 5))
+    ((new_symbols ()) (new_nodes ()) (callstack 3))
+    ((new_symbols ()) (new_nodes ()) (callstack 5))
+    ((new_symbols ()) (new_nodes ()) (callstack 3))|}]
 ;;
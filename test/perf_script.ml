@@ -8,7 +8,6 @@ let run ?(debug = false) ?events_writer ?ocaml_exception_info ~trace_scope file
      This works, but is ridiculous. *)
   let git_root = "../../.." in
   let script = In_channel.read_all (git_root ^ "/test/" ^ file) in
-  let lines = String.split script ~on:'\n' in
   let next_pid = ref 0 in
   let next_thread = ref 0 in
   let module Trace = struct
@@ -82,8 +81,18 @@ let run ?(debug = false) ?events_writer ?ocaml_exception_info ~trace_scope file
           not ([%compare.equal: Symbol.t] data.src.symbol data.dst.symbol)
         | Error _ | Ok _ -> true
       in
+      (* [perf script]'s output is read through a pipe into a buffer shorter than some
+         lines, so records and lines are split across chunks and the buffer has to
+         grow. *)
+      let%bind `Reader reader_fd, `Writer writer_fd =
+        Unix.pipe (Info.of_string "perf script")
+      in
+      let reader = Reader.create ~buf_len:128 reader_fd in
+      let writer = Writer.create writer_fd in
+      Writer.write writer script;
+      don't_wait_for (Writer.close writer);
       let%map split_lines =
-        Perf_decode.For_testing.split_line_pipe (Pipe.of_list lines) |> Pipe.to_list
+        Perf_decode.For_testing.split_reader_into_records reader |> Pipe.to_list
       in
       List.iter split_lines ~f:(fun lines ->
         let event =
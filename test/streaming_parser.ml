@@ -0,0 +1,301 @@
+open! Core
+open! Async
+module Destinations = Tracing_zero.Destinations
+module Streaming_parser = Tracing.Streaming_parser
+
+(* Every kind of event [Streaming_parser] reads, with every type of argument, on two
+   threads. *)
+let write_trace destination =
+  let trace =
+    Tracing.Trace.Expert.create
+      ~base_time:(Some Time_ns.epoch)
+      (Tracing_zero.Writer.Expert.create ~destination ())
+  in
+  let pid = Tracing.Trace.allocate_pid trace ~name:"process" in
+  let threads =
+    [| Tracing.Trace.allocate_thread trace ~pid ~name:"first"
+     ; Tracing.Trace.allocate_thread trace ~pid ~name:"second"
+    |]
+  in
+  for i = 0 to 99 do
+    let thread = threads.(i % 2) in
+    let time = Time_ns.Span.of_int_us i in
+    let name = [%string "span %{i % 10#Int}"] in
+    Tracing.Trace.write_duration_begin trace ~args:[] ~thread ~category:"c" ~name ~time;
+    Tracing.Trace.write_instant
+      trace
+      ~args:[ "value", Interned [%string "value %{i % 7#Int}"]; "string", String "s" ]
+      ~thread
+      ~category:"c"
+      ~name:"instant"
+      ~time;
+    Tracing.Trace.write_counter
+      trace
+      ~args:[ "count", Int i; "ratio", Float (Float.of_int i /. 4.) ]
+      ~thread
+      ~category:"c"
+      ~name:[%string "counter %{i % 3#Int}"]
+      ~time;
+    Tracing.Trace.write_duration_complete
+      trace
+      ~args:
+        [ "big", Int64 (Int64.shift_left 1L 40); "address", Pointer (Int64.of_int i) ]
+      ~thread
+      ~category:"c"
+      ~name:"complete"
+      ~time
+      ~time_end:Time_ns.Span.(time + of_int_ns 100);
+    Tracing.Trace.write_duration_end
+      trace
+      ~args:[]
+      ~thread
+      ~category:"c"
+      ~name
+      ~time:Time_ns.Span.(time + of_int_ns 500)
+  done;
+  let flow = Tracing.Trace.create_flow trace in
+  List.iter [ 10; 20; 30 ] ~f:(fun us ->
+    Tracing.Trace.write_flow_step
+      trace
+      flow
+      ~thread:threads.(0)
+      ~time:(Time_ns.Span.of_int_us us));
+  Tracing.Trace.finish_flow trace flow;
+  Tracing.Trace.close trace
+;;
+
+(* An unsupported record type, then an event naming a string that was never interned. *)
+let invalid_records =
+  let bytes = Bytes.create 24 in
+  Bytes.set_int64_le bytes 0 (Int64.of_int (6 lor (1 lsl 4)));
+  Bytes.set_int64_le
+    bytes
+    8
+    (Int64.of_int (4 lor (2 lsl 4) lor (1 lsl 24) lor (500 lsl 32) lor (500 lsl 48)));
+  Bytes.set_int64_le bytes 16 0L;
+  Bytes.to_string bytes
+;;
+
+module Arg = struct
+  type t =
+    | String of string
+    | Int of int
+    | Int64 of int64
+    | Pointer of Int64.Hex.t
+    | Float of float
+  [@@deriving sexp_of, compare]
+end
+
+module Event = struct
+  type t =
+    { timestamp : Time_ns.Span.t
+    ; thread : int * int
+    ; category : string
+    ; name : string
+    ; args : (string * Arg.t) list
+    ; event_type : Sexp.t
+    }
+  [@@deriving sexp_of, compare]
+end
+
+module Parsed = struct
+  type t =
+    { events : Event.t list
+    ; warnings : Tracing.Parser.Warnings.t
+    }
+  [@@deriving sexp_of]
+
+  let equal a b =
+    [%compare.equal: Event.t list] a.events b.events
+    && a.warnings.num_unparsed_records = b.warnings.num_unparsed_records
+    && a.warnings.num_unparsed_args = b.warnings.num_unparsed_args
+  ;;
+end
+
+let parse contents =
+  let parser = Tracing.Parser.create (Iobuf.of_string contents) in
+  let string index = Tracing.Parser.lookup_string_exn parser ~index in
+  let rec loop acc =
+    match Tracing.Parser.parse_next parser with
+    | Error No_more_words -> List.rev acc
+    | Error (_ : Tracing.Parser.Parse_error.t) -> loop acc
+    | Ok (Event { timestamp; thread; category; name; arguments; event_type }) ->
+      let { Tracing.Parser.Thread.pid; tid; _ } =
+        Tracing.Parser.lookup_thread_exn parser ~index:thread
+      in
+      let args =
+        List.map arguments ~f:(fun (arg_name, value) ->
+          let value : Arg.t =
+            match value with
+            | String index -> String (string index)
+            | Int i -> Int i
+            | Int64 i -> Int64 i
+            | Pointer p -> Pointer p
+            | Float f -> Float f
+          in
+          string arg_name, value)
+      in
+      loop
+        ({ Event.timestamp
+         ; thread = pid, tid
+         ; category = string category
+         ; name = string name
+         ; args
+         ; event_type = [%sexp (event_type : Tracing.Parser.Event_type.t)]
+         }
+         :: acc)
+    | Ok (_ : Tracing.Parser.Record.t) -> loop acc
+  in
+  let events = loop [] in
+  { Parsed.events; warnings = Tracing.Parser.warnings parser }
+;;
+
+let stream parser =
+  let string = Streaming_parser.lookup_string_exn parser in
+  let rec loop acc =
+    if not (Streaming_parser.next parser)
+    then List.rev acc
+    else (
+      let { Tracing.Parser.Thread.pid; tid; _ } = Streaming_parser.thread parser in
+      let args = ref [] in
+      Streaming_parser.iter_args parser ~f:(fun ~name value ->
+        let value : Arg.t =
+          match value with
+          | String index -> String (string index)
+          | Int i -> Int i
+          | Int64 i -> Int64 i
+          | Pointer p -> Pointer p
+          | Float f -> Float f
+        in
+        args := (string name, value) :: !args);
+      let id () = Streaming_parser.id_exn parser in
+      let event_type : Tracing.Parser.Event_type.t =
+        match Streaming_parser.event_kind parser with
+        | Instant -> Instant
+        | Counter -> Counter { id = id () }
+        | Duration_begin -> Duration_begin
+        | Duration_end -> Duration_end
+        | Duration_complete ->
+          Duration_complete { end_time = Streaming_parser.end_time_exn parser }
+        | Flow_begin -> Flow_begin { flow_correlation_id = id () }
+        | Flow_step -> Flow_step { flow_correlation_id = id () }
+        | Flow_end -> Flow_end { flow_correlation_id = id () }
+      in
+      loop
+        ({ Event.timestamp = Streaming_parser.timestamp parser
+         ; thread = pid, tid
+         ; category = string (Streaming_parser.category parser)
+         ; name = string (Streaming_parser.name parser)
+         ; args = List.rev !args
+         ; event_type = [%sexp (event_type : Tracing.Parser.Event_type.t)]
+         }
+         :: acc))
+  in
+  let events = loop [] in
+  { Parsed.events; warnings = Streaming_parser.warnings parser }
+;;
+
+let stream_file ~filename ~file_format =
+  Streaming_parser.with_file ~filename ~file_format ~f:stream
+;;
+
+let print_summary name (parsed : Parsed.t) =
+  print_s
+    [%message
+      name
+        ~num_events:(List.length parsed.events : int)
+        ~warnings:(parsed.warnings : Tracing.Parser.Warnings.t)]
+;;
+
+let written_trace () =
+  write_trace (Destinations.direct_file_destination ~filename:"trace.fxt" ());
+  In_channel.read_all "trace.fxt"
+;;
+
+let%expect_test "the streaming parser reads what the parser does" =
+  Expect_test_helpers_async.within_temp_dir (fun () ->
+    let contents = written_trace () ^ invalid_records in
+    Out_channel.write_all "invalid.fxt" ~data:contents;
+    let parsed = parse contents in
+    let streamed =
+      Streaming_parser.create (Iobuf.of_string contents |> Iobuf.read_only) |> stream
+    in
+    let streamed_from_file =
+      stream_file ~filename:"invalid.fxt" ~file_format:Uncompressed
+    in
+    Expect_test_helpers_base.require_equal (module Parsed) parsed streamed;
+    Expect_test_helpers_base.require_equal (module Parsed) parsed streamed_from_file;
+    print_summary "parsed" parsed;
+    [%expect
+      {|
+      (parsed (num_events 503)
+       (warnings ((num_unparsed_records 2) (num_unparsed_args 0))))
+      |}];
+    return ())
+;;
+
+let%expect_test "compressed traces" =
+  Expect_test_helpers_async.within_temp_dir (fun () ->
+    let parsed = parse (written_trace ()) in
+    (* Small buffers, so the trace is many gzip members and zstd frames. *)
+    write_trace
+      (Destinations.parallel_gzip_file_destination
+         ~buffer_size:4096
+         ~num_domains:2
+         ~filename:"trace.fxt.gz"
+         ());
+    write_trace
+      (Destinations.seekable_zstd_file_destination
+         ~buffer_size:4096
+         ~num_domains:2
+         ~filename:"trace.fxt.zst"
+         ());
+    let multiple_gzip_members =
+      List.length
+        (String.substr_index_all
+           (In_channel.read_all "trace.fxt.gz")
+           ~may_overlap:false
+           ~pattern:"\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff")
+      > 1
+    in
+    let multiple_zstd_frames =
+      List.length (Destinations.Frame_index.load ~trace_filename:"trace.fxt.zst") > 1
+    in
+    print_s [%message (multiple_gzip_members : bool) (multiple_zstd_frames : bool)];
+    [%expect {| ((multiple_gzip_members true) (multiple_zstd_frames true)) |}];
+    (* The zstd trace ends with its seek table, in a skippable frame. *)
+    List.iter
+      [ "gzip", "trace.fxt.gz", Tracing_zero.Writer.File_format.Gzip
+      ; "zstd", "trace.fxt.zst", Zstandard
+      ]
+      ~f:(fun (name, filename, file_format) ->
+        let streamed = stream_file ~filename ~file_format in
+        Expect_test_helpers_base.require_equal (module Parsed) parsed streamed;
+        print_summary name streamed);
+    [%expect
+      {|
+      (gzip (num_events 503)
+       (warnings ((num_unparsed_records 0) (num_unparsed_args 0))))
+      (zstd (num_events 503)
+       (warnings ((num_unparsed_records 0) (num_unparsed_args 0))))
+      |}];
+    return ())
+;;
+
+let%expect_test "truncated record" =
+  Expect_test_helpers_async.within_temp_dir (fun () ->
+    let contents = written_trace () in
+    (* Cuts the last record, an event, off partway through. *)
+    let truncated = String.drop_suffix contents 12 in
+    Out_channel.write_all "truncated.fxt" ~data:truncated;
+    let parsed = parse truncated in
+    let streamed = stream_file ~filename:"truncated.fxt" ~file_format:Uncompressed in
+    Expect_test_helpers_base.require_equal (module Parsed) parsed streamed;
+    print_summary "truncated" streamed;
+    [%expect
+      {|
+      (truncated (num_events 502)
+       (warnings ((num_unparsed_records 0) (num_unparsed_args 0))))
+      |}];
+    return ())
+;;
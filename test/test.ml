@@ -148,8 +148,7 @@ let dump_using_file ?range_symbols events =
     write_trace_from_events
       ~debug_info:None
       ~trace_scope:Userspace
-      ~events_writer:None
-      ~writer:(Some writer)
+      ~sink:(Magic_trace_lib.Tracing_tool_output.Fxt writer)
       ~hits:[]
       ~events:[ events ]
       ~close_result
@@ -393,6 +392,106 @@ let%expect_test "random perfs" =
   return ()
 ;;
 
+(* Each thread's events, with every string and thread looked up, keyed by thread. *)
+let events_by_thread ~trace_writer_domains events =
+  let%bind events = get_events_pipe ~events () in
+  let buf = Iobuf.create ~len:500_000 in
+  let destination = Tracing_zero.Destinations.iobuf_destination buf in
+  let writer = Tracing_zero.Writer.Expert.create ~destination () in
+  let%map or_error =
+    write_trace_from_events
+      ~trace_writer_domains
+      ~debug_info:None
+      ~trace_scope:Userspace
+      ~sink:(Magic_trace_lib.Tracing_tool_output.Fxt writer)
+      ~hits:[]
+      ~events:[ events ]
+      ~close_result:(return (Ok ()))
+      ()
+  in
+  ok_exn or_error;
+  let parser = Tracing.Parser.create (Iobuf.read_only buf) in
+  let string index = Tracing.Parser.lookup_string_exn parser ~index in
+  let events_by_thread = Hashtbl.create (module Sexp) in
+  let rec loop () =
+    match Tracing.Parser.parse_next parser with
+    | Error No_more_words -> ()
+    | Error error -> raise_s [%sexp (error : Tracing.Parser.Parse_error.t)]
+    | Ok (Event { timestamp; thread; category; name; arguments; event_type }) ->
+      let { Tracing.Parser.Thread.process_name; thread_name; _ } =
+        Tracing.Parser.lookup_thread_exn parser ~index:thread
+      in
+      let arguments =
+        List.map arguments ~f:(fun (name, value) ->
+          let value =
+            match value with
+            | String index -> Sexp.Atom (string index)
+            | value -> [%sexp (value : Tracing.Parser.Event_arg.value)]
+          in
+          string name, value)
+      in
+      Hashtbl.add_multi
+        events_by_thread
+        ~key:[%sexp (process_name : string option), (thread_name : string option)]
+        ~data:
+          [%sexp
+            (timestamp : Time_ns.Span.t)
+            , (string category : string)
+            , (string name : string)
+            , (arguments : (string * Sexp.t) list)
+            , (event_type : Tracing.Parser.Event_type.t)];
+      loop ()
+    | Ok _ -> loop ()
+  in
+  loop ();
+  Hashtbl.to_alist events_by_thread
+  |> List.map ~f:(fun (thread, events) -> thread, List.rev events)
+  |> List.sort ~compare:[%compare: Sexp.t * Sexp.t list]
+;;
+
+let%expect_test "sharded trace writing" =
+  let open Trace_helpers in
+  let%bind.With _dirname = Expect_test_helpers_async.within_temp_dir in
+  let thread_events tid =
+    let calls =
+      Quickcheck.random_value
+        ~seed:(`Deterministic (Int.to_string tid))
+        ~size:20
+        Quickcheck.Generator.(
+          weighted_union [ 30., return call; 30., return ret; 10., return jmp ]
+          |> list_non_empty)
+    in
+    start_recording ();
+    List.iter calls ~f:(fun f -> f ());
+    events ()
+    |> List.map ~f:(function
+      | Ok event ->
+        Ok
+          { event with
+            thread = { pid = Some (Pid.of_int tid); tid = Some (Pid.of_int tid) }
+          }
+      | Error _ as error -> error)
+  in
+  let events =
+    List.concat_map [ 456; 457; 458; 459 ] ~f:thread_events
+    |> List.stable_sort ~compare:(fun (a : Event.t) (b : Event.t) ->
+      match a, b with
+      | Ok a, Ok b -> Time_ns.Span.compare a.time b.time
+      | Error _, _ | _, Error _ -> 0)
+  in
+  let%bind single = events_by_thread ~trace_writer_domains:1 events in
+  let%bind sharded = events_by_thread ~trace_writer_domains:3 events in
+  Expect_test_helpers_base.require_equal (module Int) (List.length single) 4;
+  Expect_test_helpers_base.require_equal
+    (module struct
+      type t = (Sexp.t * Sexp.t list) list [@@deriving sexp_of, equal]
+    end)
+    single
+    sharded;
+  [%expect {| |}];
+  return ()
+;;
+
 let%expect_test "with initial returns" =
   let%bind.With _dirname = Expect_test_helpers_async.within_temp_dir in
   let events =
@@ -698,6 +797,113 @@ let%expect_test "enqueuing events at start" =
   return ()
 ;;
 
+let%expect_test "profile of a snapshot starting inside a call" =
+  let%bind.With _dirname = Expect_test_helpers_async.within_temp_dir in
+  let events =
+    Trace_helpers.(
+      (* [run] had called [handle], which had called [parse], before the snapshot began.
+         [Trace_writer] only writes the begins of [run] and [handle] once the thread
+         ends, after [log] and after [handle]'s own end. *)
+      add Return 10 "handle";
+      add Call 20 "log";
+      add Return 30 "handle";
+      add Return 40 "run";
+      add Call 50 "parse";
+      add Return 60 "run";
+      events ())
+  in
+  let%bind events = get_events_pipe ~events () in
+  let filename = "trace.folded" in
+  let%bind or_error =
+    write_trace_from_events
+      ~debug_info:None
+      ~trace_scope:Userspace
+      ~sink:
+        (Magic_trace_lib.Tracing_tool_output.Profile
+           (Magic_trace_lib.Stack_profile.create ~format:Folded ~filename))
+      ~hits:[]
+      ~events:[ events ]
+      ~close_result:(return (Ok ()))
+      ()
+  in
+  ok_exn or_error;
+  print_string (In_channel.read_all filename);
+  [%expect
+    {|
+    [pid=1234] [tid=456];main;run 10
+    [pid=1234] [tid=456];main;run;handle 20
+    [pid=1234] [tid=456];main;run;handle;log 10
+    [pid=1234] [tid=456];main;run;parse 10
+    |}];
+  return ()
+;;
+
+let%expect_test "latency report across a decode error" =
+  let%bind.With _dirname = Expect_test_helpers_async.within_temp_dir in
+  let before_error =
+    Trace_helpers.(
+      (* [run] had called [handle] before the snapshot began. *)
+      add Return 10 "handle";
+      add Return 30 "run";
+      add Call 40 "handle";
+      add Return 50 "run";
+      events ())
+  in
+  let decode_error : Event.t =
+    Error
+      { thread = { pid = Some (Pid.of_int 1234); tid = Some (Pid.of_int 456) }
+      ; time = Time_ns_unix.Span.Option.some (Time_ns.Span.of_int_ns 60)
+      ; instruction_pointer = None
+      ; message = "Overflow packet"
+      }
+  in
+  let after_error =
+    Trace_helpers.(
+      add Call 70 "handle";
+      add Return 80 "run";
+      add Call 90 "handle";
+      add Return 100 "run";
+      events ())
+  in
+  let%bind events =
+    get_events_pipe ~events:(before_error @ [ decode_error ] @ after_error) ()
+  in
+  let writer =
+    let buf = Iobuf.create ~len:500_000 in
+    Tracing_zero.Writer.Expert.create
+      ~destination:(Tracing_zero.Destinations.iobuf_destination buf)
+      ()
+  in
+  (* The [handle] the snapshot began in is cut off, and the three after it aren't. *)
+  let%bind or_error =
+    write_trace_from_events
+      ~latency_report:(Magic_trace_lib.Latency_report.create ~symbols:[ "handle" ])
+      ~debug_info:None
+      ~trace_scope:Userspace
+      ~sink:(Magic_trace_lib.Tracing_tool_output.Fxt writer)
+      ~hits:[]
+      ~events:[ events ]
+      ~close_result:(return (Ok ()))
+      ()
+  in
+  ok_exn or_error;
+  [%expect
+    {|
+    handle: 3 spans
+      1 more cut off by the edges of the trace, left out
+      p50    10ns
+      p90    10ns
+      p99    10ns
+      p99.9  10ns
+      max    10ns
+      slowest:
+        10ns at 30ns in [pid=1234] [tid=456]
+        10ns at 60ns in [pid=1234] [tid=456]
+        10ns at 80ns in [pid=1234] [tid=456]
+    |}];
+  return ()
+;;
+
 let%expect_test "filtered trace" =
   let%bind.With _dirname = Expect_test_helpers_async.within_temp_dir in
   let events =
@@ -822,3 +1028,44 @@ let%expect_test "get debug information from ELF" =
   [%expect {| |}];
   return ()
 ;;
+
+let%expect_test "offline symbolization from an ELF" =
+  let filename = "sample-targets/ocaml-raise/sample.exe" in
+  let elf = Option.value_exn (Magic_trace_lib.Elf.create filename) in
+  let name, symbol =
+    Magic_trace_lib.Elf.matching_functions elf (Re.Perl.compile_pat "raise_after")
+    |> Map.min_elt_exn
+  in
+  (* Mapped where its executable segment asks to be, as [perf] would report it. *)
+  let text =
+    let buffer = Owee_buf.map_binary filename in
+    let header, (_ : Owee_elf.section array) = Owee_elf.read_elf buffer in
+    Owee_elf.read_programs buffer header
+    |> Array.find_exn ~f:(fun (program : Owee_elf.program) ->
+      program.p_type = 1 (* PT_LOAD *) && program.p_flags land 1 (* PF_X *) <> 0)
+  in
+  let symbolizer = Magic_trace_lib.Offline_symbolizer.create () in
+  let is_mmap =
+    Magic_trace_lib.Offline_symbolizer.add_mmap_line
+      symbolizer
+      (sprintf
+         "1/1 0.000000000: PERF_RECORD_MMAP2 1/1: [0x%Lx(0x%Lx) @ 0x%Lx fd:01 1 0]: \
+          r-xp %s"
+         text.p_vaddr
+         text.p_memsz
+         text.p_offset
+         filename)
+  in
+  let addr = Int64.( + ) (Owee_elf.Symbol_table.Symbol.value symbol) 4L in
+  let pid = Some (Pid.of_int 1) in
+  (match Magic_trace_lib.Offline_symbolizer.resolve symbolizer ~pid ~addr with
+   | `Symbol (symbol, offset) ->
+     print_s
+       [%message
+         (is_mmap : bool)
+           ~is_symbol:(String.equal (Symbol.display_name symbol) name : bool)
+           (offset : int)]
+   | `In_dso _ | `Unmapped -> print_s [%message "Not symbolized" (name : string)]);
+  [%expect {| ((is_mmap true) (is_symbol true) (offset 4)) |}];
+  return ()
+;;
@@ -0,0 +1,231 @@
+open! Core
+open! Async
+module Destinations = Tracing_zero.Destinations
+module Frame_index = Destinations.Frame_index
+
+(* Enough records to fill several of the small buffers the destinations are given below,
+   with the event timestamp in ticks equal to [i] microseconds in nanoseconds. *)
+let num_events = 2_000
+
+let write_trace destination =
+  let trace =
+    Tracing.Trace.Expert.create
+      ~base_time:(Some Time_ns.epoch)
+      (Tracing_zero.Writer.Expert.create ~destination ())
+  in
+  let pid = Tracing.Trace.allocate_pid trace ~name:"process" in
+  let thread = Tracing.Trace.allocate_thread trace ~pid ~name:"thread" in
+  for i = 0 to num_events - 1 do
+    let time = Time_ns.Span.of_int_us i in
+    Tracing.Trace.write_duration_complete
+      trace
+      ~args:[ "i", Int i ]
+      ~thread
+      ~category:"test"
+      ~name:[%string "span %{i % 100#Int}"]
+      ~time
+      ~time_end:Time_ns.Span.(time + of_int_ns 500)
+  done;
+  Tracing.Trace.close trace
+;;
+
+let read_trace ~filename ~file_format =
+  Tracing.Trace_reader.with_file ~filename ~file_format ~f:(fun reader ->
+    let contents = Buffer.create (1024 * 1024) in
+    let buf = Bigstring.create 4096 in
+    let rec loop () =
+      match Tracing.Trace_reader.input reader buf ~pos:0 ~len:(Bigstring.length buf) with
+      | 0 -> Buffer.contents contents
+      | len ->
+        Buffer.add_string contents (Bigstring.To_string.sub buf ~pos:0 ~len);
+        loop ()
+    in
+    loop ())
+;;
+
+(* The trace as written without compression, serially. *)
+let expected_contents () =
+  write_trace (Destinations.direct_file_destination ~filename:"expected.fxt" ());
+  In_channel.read_all "expected.fxt"
+;;
+
+(* The position of each event record in the trace, and its timestamp in ticks. *)
+let events contents =
+  let parser = Tracing.Streaming_parser.create (Iobuf.of_string contents) in
+  let rec loop acc =
+    if Tracing.Streaming_parser.next parser
+    then
+      loop
+        (( Iobuf.Expert.lo (Tracing.Streaming_parser.record parser)
+         , Time_ns.Span.to_int_ns (Tracing.Streaming_parser.timestamp parser) )
+         :: acc)
+    else List.rev acc
+  in
+  loop []
+;;
+
+let check_round_trip ~name ~file_format ~filename destination =
+  let expected = expected_contents () in
+  write_trace destination;
+  let same_contents = String.equal expected (read_trace ~filename ~file_format) in
+  print_s [%message name (same_contents : bool)]
+;;
+
+let%expect_test "uncompressed destinations" =
+  Expect_test_helpers_async.within_temp_dir (fun () ->
+    check_round_trip
+      ~name:"async"
+      ~file_format:Uncompressed
+      ~filename:"async.fxt"
+      (Destinations.async_file_destination
+         ~buffer_size:4096
+         ~num_buffers:2
+         ~filename:"async.fxt"
+         ());
+    (* A window of a few pages, so the file is remapped many times and the data ends
+       partway through a page at every remap. *)
+    check_round_trip
+      ~name:"mmap"
+      ~file_format:Uncompressed
+      ~filename:"mmap.fxt"
+      (Destinations.mmap_file_destination ~window_size:10_000 ~filename:"mmap.fxt" ());
+    [%expect
+      {|
+      (async (same_contents true))
+      (mmap (same_contents true))
+      |}];
+    return ())
+;;
+
+let%expect_test "parallel compressed destinations" =
+  Expect_test_helpers_async.within_temp_dir (fun () ->
+    check_round_trip
+      ~name:"parallel gzip"
+      ~file_format:Gzip
+      ~filename:"trace.fxt.gz"
+      (Destinations.parallel_gzip_file_destination
+         ~buffer_size:16_384
+         ~num_domains:2
+         ~filename:"trace.fxt.gz"
+         ());
+    check_round_trip
+      ~name:"parallel zstd"
+      ~file_format:Zstandard
+      ~filename:"trace.fxt.zst"
+      (Destinations.parallel_zstd_file_destination
+         ~buffer_size:16_384
+         ~num_domains:2
+         ~filename:"trace.fxt.zst"
+         ());
+    [%expect
+      {|
+      ("parallel gzip" (same_contents true))
+      ("parallel zstd" (same_contents true))
+      |}];
+    return ())
+;;
+
+let uint_le contents ~pos ~size =
+  List.init size ~f:(fun i -> Char.to_int contents.[pos + i] lsl (8 * i))
+  |> List.fold ~init:0 ~f:( lor )
+;;
+
+(* The seek table that ends the file, in the zstd seekable format: a skippable frame of
+   each frame's compressed and decompressed lengths, then the number of frames, a
+   descriptor byte and a magic number. *)
+let seek_table contents ~pos =
+  let uint32 pos = uint_le contents ~pos ~size:4 in
+  let num_frames = uint32 (String.length contents - 9) in
+  [%test_result: int] (uint32 pos) ~expect:0x184D2A5E;
+  [%test_result: int] (uint32 (pos + 4)) ~expect:((num_frames * 8) + 9);
+  [%test_result: int] (uint32 (String.length contents - 4)) ~expect:0x8F92EAB1;
+  [%test_result: int] (String.length contents) ~expect:(pos + 8 + (num_frames * 8) + 9);
+  List.init num_frames ~f:(fun i ->
+    let entry = pos + 8 + (i * 8) in
+    uint32 entry, uint32 (entry + 4))
+;;
+
+let%expect_test "seekable zstd destination" =
+  Expect_test_helpers_async.within_temp_dir (fun () ->
+    let filename = "trace.fxt.zst" in
+    check_round_trip
+      ~name:"seekable zstd"
+      ~file_format:Zstandard
+      ~filename
+      (Destinations.seekable_zstd_file_destination
+         ~buffer_size:16_384
+         ~num_domains:2
+         ~filename
+         ());
+    let expected = expected_contents () in
+    let compressed = In_channel.read_all filename in
+    let frames = Frame_index.load ~trace_filename:filename in
+    let multiple_frames = List.length frames > 1 in
+    (* Frames are laid out back to back in both the file and the trace. *)
+    let end_, decompressed_end, contiguous =
+      List.fold
+        frames
+        ~init:(0, 0, true)
+        ~f:(fun (offset, decompressed_offset, contiguous) (frame : Frame_index.Frame.t) ->
+          ( frame.offset + frame.compressed_length
+          , frame.decompressed_offset + frame.decompressed_length
+          , contiguous
+            && frame.offset = offset
+            && frame.decompressed_offset = decompressed_offset ))
+    in
+    let contiguous = contiguous && decompressed_end = String.length expected in
+    let seek_table_matches_index =
+      [%equal: (int * int) list]
+        (seek_table compressed ~pos:end_)
+        (List.map frames ~f:(fun (frame : Frame_index.Frame.t) ->
+           frame.compressed_length, frame.decompressed_length))
+    in
+    (* Each frame decompresses on its own to its part of the trace. *)
+    let frames_stand_alone =
+      List.for_all frames ~f:(fun (frame : Frame_index.Frame.t) ->
+        Out_channel.write_all
+          "frame.zst"
+          ~data:
+            (String.sub compressed ~pos:frame.offset ~len:frame.compressed_length);
+        String.equal
+          (read_trace ~filename:"frame.zst" ~file_format:Zstandard)
+          (String.sub
+             expected
+             ~pos:frame.decompressed_offset
+             ~len:frame.decompressed_length))
+    in
+    let events = events expected in
+    let in_frame (frame : Frame_index.Frame.t) (pos, _) =
+      pos >= frame.decompressed_offset
+      && pos < frame.decompressed_offset + frame.decompressed_length
+    in
+    (* Each frame's tick range is that of the events in its part of the trace. *)
+    let tick_ranges_match =
+      List.for_all frames ~f:(fun (frame : Frame_index.Frame.t) ->
+        let ticks = List.filter events ~f:(in_frame frame) |> List.map ~f:snd in
+        [%equal: int option * int option]
+          (frame.min_ticks, frame.max_ticks)
+          (List.min_elt ticks ~compare, List.max_elt ticks ~compare))
+    in
+    let all_events_in_frames =
+      List.length events = num_events
+      && List.for_all events ~f:(fun event ->
+        List.exists frames ~f:(fun frame -> in_frame frame event))
+    in
+    print_s
+      [%message
+        (multiple_frames : bool)
+          (contiguous : bool)
+          (seek_table_matches_index : bool)
+          (frames_stand_alone : bool)
+          (tick_ranges_match : bool)
+          (all_events_in_frames : bool)];
+    [%expect
+      {|
+      ("seekable zstd" (same_contents true))
+      ((multiple_frames true) (contiguous true) (seek_table_matches_index true)
+       (frames_stand_alone true) (tick_ranges_match true)
+       (all_events_in_frames true))
+      |}];
+    return ())
+;;
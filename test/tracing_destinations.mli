@@ -0,0 +1 @@
+(*_ This signature is deliberately empty. *)